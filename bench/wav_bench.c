@@ -0,0 +1,305 @@
+#include <sys/stat.h>
+#include <time.h>
+
+#include "wav_analysis.h"
+
+/* Duration of the generated fixture in seconds */
+#define FIXTURE_SECONDS 60
+#define FIXTURE_RATE 44100
+#define FIXTURE_CHANNELS 2
+
+/* Kernel whose throughput the others are compared to, as the speed of
+   the machine running the benchmark changes them all alike */
+#define REFERENCE_KERNEL 0
+
+typedef struct Kernel {
+    const char* name;
+    void        (*prepare)(void);   // Untimed allocations of the kernel (NULL if none)
+    double      (*run)(void);       // Returns the number of bytes processed
+    double      throughput;         // Best measured MB/s
+    double      baseline;           // Baseline throughput relative to the reference (0 if missing)
+} Kernel;
+
+static char fixturePath[4096];
+static char outputPath[4096];
+static WavHeader header;
+static int16_t* data = NULL;
+static float* converted = NULL;
+
+/* Keeps the results of the kernels alive for the optimizer */
+static volatile double sink;
+
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+/* Deterministic stereo signal: two sines with a little noise */
+static void generate_fixture(const char* dir)
+{
+    size_t nbFrames = (size_t)FIXTURE_SECONDS * FIXTURE_RATE;
+    int16_t* samples = (int16_t*)malloc(nbFrames * FIXTURE_CHANNELS * sizeof(int16_t));
+    uint32_t seed = 12345;
+    WavHeader fixtureHeader;
+
+    if (!samples) {
+        fprintf(stderr, "Cannot allocate memory for fixture\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbFrames; ++i) {
+        for (int c = 0; c < FIXTURE_CHANNELS; ++c) {
+            seed = seed * 1664525 + 1013904223;
+            double tone = sin(2 * M_PI * (440.0 + 110.0 * c) * i / FIXTURE_RATE);
+            samples[i * FIXTURE_CHANNELS + c] = (int16_t)(12000 * tone + (int)(seed >> 24) - 128);
+        }
+    }
+
+    mkdir(dir, 0755);
+    snprintf(fixturePath, sizeof(fixturePath), "%s/fixture.wav", dir);
+    snprintf(outputPath, sizeof(outputPath), "%s/output.wav", dir);
+
+    wav_header_init(&fixtureHeader, FIXTURE_CHANNELS, FIXTURE_RATE, 16,
+                    nbFrames * FIXTURE_CHANNELS * sizeof(int16_t));
+    wav_write(fixturePath, &fixtureHeader, &samples);
+    free(samples);
+}
+
+
+static double run_read()
+{
+    wav_read(fixturePath, &header, &data);
+    return header.DataSize;
+}
+
+
+static double run_write()
+{
+    wav_write(outputPath, &header, &data);
+    return header.DataSize;
+}
+
+
+static double run_extract()
+{
+    int16_t* channel = NULL;
+    WavHeader channelHeader;
+
+    wav_extract_channel_data(&channel, &data, &channelHeader, &header, 0, -1);
+    sink = channel[channelHeader.DataSize / 4];
+    free(channel);
+    return header.DataSize;
+}
+
+
+static void prepare_convert()
+{
+    converted = (float*)malloc(header.DataSize / sizeof(int16_t) * sizeof(float));
+
+    if (!converted) {
+        fprintf(stderr, "Cannot allocate memory for conversion\n");
+        exit(1);
+    }
+}
+
+
+static double run_convert()
+{
+    size_t count = header.DataSize / sizeof(int16_t);
+
+    wav_convert_s16_to_f32(converted, data, count);
+    sink = converted[count / 2];
+    return header.DataSize;
+}
+
+
+static double run_stats()
+{
+    WavStats stats;
+
+    wav_stats_init(&stats, header.NbChannels);
+    wav_stats_update(&stats, data, header.DataSize / header.BytePerChunk);
+    wav_stats_finish(&stats);
+    sink = stats.channels[0].rms;
+    return header.DataSize;
+}
+
+
+/* Round trip through the planar layout, which restores the samples */
+static double run_planar()
+{
+    size_t nbFrames = header.DataSize / header.BytePerChunk;
+
+    wav_deinterleave_inplace(data, nbFrames, header.NbChannels);
+    sink = data[nbFrames / 2];
+    wav_interleave_inplace(data, nbFrames, header.NbChannels);
+    return 2.0 * header.DataSize;
+}
+
+
+/* Read "name": value from the kernels object of a baseline file */
+static double baseline_value(const char* json, const char* name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\"", name);
+
+    const char* kernels = strstr(json, "\"kernels\"");
+    const char* found = kernels ? strstr(kernels, key) : NULL;
+    if (!found)
+        return 0.0;
+
+    found = strchr(found + strlen(key), ':');
+    return found ? strtod(found + 1, NULL) : 0.0;
+}
+
+
+static char* read_text(const char* filename)
+{
+    FILE* stream = fopen(filename, "rb");
+    if (stream == NULL)
+        return NULL;
+
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+
+    char* text = (char*)calloc(1, size + 1);
+    if (!text || fread(text, 1, size, stream) != (size_t)size) {
+        fprintf(stderr, "Cannot read %s\n", filename);
+        exit(1);
+    }
+
+    fclose(stream);
+    return text;
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* baselineFile = "bench/baseline.json";
+    const char* fixtureDir = "build/fixtures";
+    double tolerance = -1.0;
+    int repeat = 5;
+    int update = 0;
+
+    Kernel kernels[] = {
+        { "read",    NULL,            run_read,    0.0, 0.0 },
+        { "write",   NULL,            run_write,   0.0, 0.0 },
+        { "extract", NULL,            run_extract, 0.0, 0.0 },
+        { "convert", prepare_convert, run_convert, 0.0, 0.0 },
+        { "stats",   NULL,            run_stats,   0.0, 0.0 },
+        { "planar",  NULL,            run_planar,  0.0, 0.0 },
+    };
+    size_t nbKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baselineFile = argv[++i];
+        else if (!strcmp(argv[i], "--fixtures") && i + 1 < argc)
+            fixtureDir = argv[++i];
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            tolerance = strtod(argv[++i], NULL);
+        else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--update"))
+            update = 1;
+        else {
+            fprintf(stderr, "Usage: wav_bench [--baseline <file.json>] [--fixtures <dir>]\n"
+                            "                 [--tolerance <ratio>] [--repeat <n>] [--update]\n");
+            return 1;
+        }
+    }
+
+    generate_fixture(fixtureDir);
+
+    char* json = update ? NULL : read_text(baselineFile);
+    if (json && tolerance < 0) {
+        const char* found = strstr(json, "\"tolerance\"");
+        found = found ? strchr(found, ':') : NULL;
+        tolerance = found ? strtod(found + 1, NULL) : 0.25;
+    }
+    if (tolerance < 0)
+        tolerance = 0.25;
+
+    // Read first so that the other kernels have data; best of repeat runs
+    for (size_t k = 0; k < nbKernels; ++k) {
+        if (kernels[k].prepare)
+            kernels[k].prepare();
+
+        for (int r = 0; r < repeat; ++r) {
+            double start = now();
+            double bytes = kernels[k].run();
+            double elapsed = now() - start;
+            double throughput = bytes / elapsed / 1e6;
+
+            if (throughput > kernels[k].throughput)
+                kernels[k].throughput = throughput;
+        }
+        if (json)
+            kernels[k].baseline = baseline_value(json, kernels[k].name);
+    }
+
+    free(data);
+    free(converted);
+    remove(outputPath);
+
+    // Baselines hold throughputs relative to the reference kernel of the same run
+    double reference = kernels[REFERENCE_KERNEL].throughput;
+
+    if (update) {
+        FILE* stream = fopen(baselineFile, "w");
+        if (stream == NULL) {
+            fprintf(stderr, "Cannot open file %s\n", baselineFile);
+            return 1;
+        }
+
+        fprintf(stream, "{\n  \"tolerance\": %.2f,\n  \"unit\": \"ratio to %s\",\n  \"kernels\": {\n",
+                tolerance, kernels[REFERENCE_KERNEL].name);
+        for (size_t k = 0; k < nbKernels; ++k) {
+            fprintf(stream, "    \"%s\": %.3f%s\n", kernels[k].name, kernels[k].throughput / reference,
+                    k + 1 < nbKernels ? "," : "");
+        }
+        fprintf(stream, "  }\n}\n");
+        fclose(stream);
+
+        printf("Baseline written to %s\n", baselineFile);
+        return 0;
+    }
+
+    int regressions = 0;
+    printf("%-8s %12s %12s %12s %8s\n", "kernel", "MB/s", "ratio", "baseline", "status");
+
+    for (size_t k = 0; k < nbKernels; ++k) {
+        double ratio = kernels[k].throughput / reference;
+        const char* status = "new";
+
+        if (k == REFERENCE_KERNEL) {
+            status = "ref";
+        }
+        else if (kernels[k].baseline > 0) {
+            if (ratio < kernels[k].baseline * (1.0 - tolerance)) {
+                status = "SLOWER";
+                ++regressions;
+            }
+            else {
+                status = "ok";
+            }
+        }
+
+        printf("%-8s %12.1f %12.3f %12.3f %8s\n", kernels[k].name, kernels[k].throughput,
+               ratio, kernels[k].baseline, status);
+    }
+
+    free(json);
+
+    if (regressions) {
+        printf("%d kernel(s) slower than baseline - %.0f%% relative to %s\n", regressions,
+               tolerance * 100, kernels[REFERENCE_KERNEL].name);
+        return 1;
+    }
+    return 0;
+}
@@ -24,6 +24,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef WAV_TRACE
+#include "wav_trace.h"
+#else
+#define WAV_TRACE_BEGIN(name) do { } while (0)
+#define WAV_TRACE_END(name) do { } while (0)
+#endif
+
 /* Structure to store the wavfile header */
 typedef struct WavHeader {
     /* RIFF Chunk */
@@ -69,6 +76,170 @@ typedef struct WavHeader {
  * 
  */
 
+/**
+ * @details Instrumentation
+ * 
+ * Compiling with -DWAV_INSTRUMENT counts the bytes, I/O calls and
+ * allocations of the read, write and extract paths and measures the 
+ * time spent in each stage. Compiling with -DWAV_TRACE records each
+ * stage as a trace event (see wav_trace.h). Without them the hooks 
+ * expand to nothing.
+ * 
+ */ 
+
+/* Stages timed by the instrumentation */
+typedef enum WavStage {
+    WAV_STAGE_OPEN,         // fopen
+    WAV_STAGE_HEADER,       // Header read and chunk parsing
+    WAV_STAGE_ALLOC,        // Data buffer allocation
+    WAV_STAGE_READ,         // Sample data read
+    WAV_STAGE_EXTRACT,      // Channel extraction loop
+    WAV_STAGE_WRITE,        // Header and sample data write
+    WAV_STAGE_CLOSE,        // fclose
+    WAV_NB_STAGES
+} WavStage;
+
+/* Counters filled by the instrumentation */
+typedef struct WavInstrStats {
+    uint64_t    bytesRead;
+    uint64_t    bytesWritten;
+    uint64_t    nbIoCalls;                  // fopen, fread, fwrite, fseek, fclose
+    uint64_t    nbAllocs;
+    uint64_t    allocBytes;
+    uint64_t    stageNs[WAV_NB_STAGES];     // Time spent in each stage
+    uint64_t    stageCalls[WAV_NB_STAGES];  // Number of times each stage ran
+} WavInstrStats;
+
+/* Names of the stages, used by wav_instr_dump and the trace events */
+const char* const wav_stage_names[WAV_NB_STAGES] = {
+    "open", "header", "alloc", "read", "extract", "write", "close"
+};
+
+#ifdef WAV_INSTRUMENT
+
+WavInstrStats wav_instr_stats;
+
+/* Counters are updated atomically, so they can be shared by threads */
+#define WAV_INSTR_ADD(field, value) \
+    __atomic_fetch_add(&wav_instr_stats.field, (uint64_t)(value), __ATOMIC_RELAXED)
+
+#else
+
+#define WAV_INSTR_ADD(field, value) do { } while (0)
+
+#endif  // WAV_INSTRUMENT
+
+#if defined(WAV_INSTRUMENT) || defined(WAV_TRACE)
+
+#include <time.h>
+
+uint64_t wav_instr_now (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t wav_stage_begin (WavStage stage)
+{
+#ifdef WAV_TRACE
+    wav_trace_begin(wav_stage_names[stage]);
+#endif
+    (void)stage;
+    return wav_instr_now();
+}
+
+void wav_stage_end (WavStage stage,
+                    uint64_t start)
+{
+#ifdef WAV_INSTRUMENT
+    WAV_INSTR_ADD(stageNs[stage], wav_instr_now() - start);
+    WAV_INSTR_ADD(stageCalls[stage], 1);
+#endif
+#ifdef WAV_TRACE
+    wav_trace_end(wav_stage_names[stage]);
+#endif
+    (void)stage;
+    (void)start;
+}
+
+/* Stage hooks feed both the counters and the trace */
+#define WAV_INSTR_BEGIN(stage) \
+    uint64_t wavInstrStart_##stage = wav_stage_begin(stage)
+#define WAV_INSTR_END(stage) \
+    wav_stage_end(stage, wavInstrStart_##stage)
+
+#else
+
+#define WAV_INSTR_BEGIN(stage) do { } while (0)
+#define WAV_INSTR_END(stage) do { } while (0)
+
+#endif  // WAV_INSTRUMENT || WAV_TRACE
+
+
+/**
+ * @brief   Copy the instrumentation counters
+ * 
+ * @param[out] stats     Pointer to the copy (zeroed without WAV_INSTRUMENT)
+ * @returns              None
+ * 
+ */ 
+void wav_instr_get (WavInstrStats* stats)
+{
+#ifdef WAV_INSTRUMENT
+    uint64_t* dst = (uint64_t*)stats;
+    uint64_t* src = (uint64_t*)&wav_instr_stats;
+    for (size_t i = 0; i < sizeof(WavInstrStats) / sizeof(uint64_t); ++i)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+#else
+    memset(stats, 0, sizeof(WavInstrStats));
+#endif
+}
+
+
+/**
+ * @brief   Reset the instrumentation counters
+ * 
+ */ 
+void wav_instr_reset (void)
+{
+#ifdef WAV_INSTRUMENT
+    uint64_t* counters = (uint64_t*)&wav_instr_stats;
+    for (size_t i = 0; i < sizeof(WavInstrStats) / sizeof(uint64_t); ++i)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#endif
+}
+
+
+/**
+ * @brief   Print the instrumentation counters
+ * 
+ * @param[in]  stream    Stream where to print (stderr for instance)
+ * @returns              None
+ * 
+ */ 
+void wav_instr_dump (FILE* stream)
+{
+#ifdef WAV_INSTRUMENT
+    WavInstrStats stats;
+
+    wav_instr_get(&stats);
+    fprintf(stream, "bytes read:    %llu\n", (unsigned long long)stats.bytesRead);
+    fprintf(stream, "bytes written: %llu\n", (unsigned long long)stats.bytesWritten);
+    fprintf(stream, "io calls:      %llu\n", (unsigned long long)stats.nbIoCalls);
+    fprintf(stream, "allocations:   %llu (%llu bytes)\n",
+            (unsigned long long)stats.nbAllocs, (unsigned long long)stats.allocBytes);
+
+    for (int i = 0; i < WAV_NB_STAGES; ++i) {
+        fprintf(stream, "%-8s %10llu calls %14llu ns\n", wav_stage_names[i],
+                (unsigned long long)stats.stageCalls[i], (unsigned long long)stats.stageNs[i]);
+    }
+#else
+    fprintf(stream, "wav instrumentation disabled (build with -DWAV_INSTRUMENT)\n");
+#endif
+}
+
+
 /**
  * @brief   Read wav information from a wavfile
  * 
@@ -82,7 +253,10 @@ void wav_read (const char* filename,
                WavHeader* header, 
                int16_t** data)
 {
+    WAV_INSTR_BEGIN(WAV_STAGE_OPEN);
     FILE* stream = fopen(filename, "rb");
+    WAV_INSTR_END(WAV_STAGE_OPEN);
+    WAV_INSTR_ADD(nbIoCalls, 1);
 
     if (stream == NULL) {
         fprintf(stderr, "Cannot open file\n");
@@ -90,10 +264,14 @@ void wav_read (const char* filename,
     }
 
     // Read wav header from stream
+    WAV_INSTR_BEGIN(WAV_STAGE_HEADER);
     if (!fread(header, 1, sizeof(WavHeader), stream)) {
         fprintf(stderr, "Cannot read wav header from stream\n");
         exit(1);
     }
+    WAV_INSTR_END(WAV_STAGE_HEADER);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    WAV_INSTR_ADD(bytesRead, sizeof(WavHeader));
 
     // Verify if filename is a wavfile
     if (strncmp(header->FileTypeChunkID, "RIFF", 4) ||
@@ -114,7 +292,11 @@ void wav_read (const char* filename,
     if (*data) 
         free(*data);
  
+    WAV_INSTR_BEGIN(WAV_STAGE_ALLOC);
     *data = (int16_t*)malloc(header->DataSize);
+    WAV_INSTR_END(WAV_STAGE_ALLOC);
+    WAV_INSTR_ADD(nbAllocs, 1);
+    WAV_INSTR_ADD(allocBytes, header->DataSize);
 
     if (!*data) {
         fprintf(stderr, "Cannot allocate memory for data buffer\n");
@@ -122,15 +304,22 @@ void wav_read (const char* filename,
     }
 
     // Read data values from stream
+    WAV_INSTR_BEGIN(WAV_STAGE_READ);
     if (!fread(*data, 1,header->DataSize, stream)) {
         fprintf(stderr, "Cannot read data from stream\n");
         exit(1);
     }
+    WAV_INSTR_END(WAV_STAGE_READ);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    WAV_INSTR_ADD(bytesRead, header->DataSize);
 
+    WAV_INSTR_BEGIN(WAV_STAGE_CLOSE);
     if (fclose(stream) == EOF) {
         fprintf(stderr, "Cannot close file\n");
         exit(1);
     }
+    WAV_INSTR_END(WAV_STAGE_CLOSE);
+    WAV_INSTR_ADD(nbIoCalls, 1);
 }
 
 
@@ -147,7 +336,10 @@ void wav_write (const char* filename,
                 WavHeader* header, 
                 int16_t** data)
 {
+    WAV_INSTR_BEGIN(WAV_STAGE_OPEN);
     FILE * stream = fopen(filename, "wb");
+    WAV_INSTR_END(WAV_STAGE_OPEN);
+    WAV_INSTR_ADD(nbIoCalls, 1);
 
     if (stream == NULL) {
         fprintf(stderr, "Cannot open file\n");
@@ -160,6 +352,7 @@ void wav_write (const char* filename,
     }
 
     // Write wav header into stream
+    WAV_INSTR_BEGIN(WAV_STAGE_WRITE);
     if (!fwrite(header, sizeof(WavHeader), 1, stream)) {
         fprintf(stderr, "Cannot write wav header into stream\n");
         exit(1);
@@ -170,11 +363,17 @@ void wav_write (const char* filename,
         fprintf(stderr, "Cannot write data into stream\n");
         exit(1);
     }
+    WAV_INSTR_END(WAV_STAGE_WRITE);
+    WAV_INSTR_ADD(nbIoCalls, 2);
+    WAV_INSTR_ADD(bytesWritten, sizeof(WavHeader) + header->DataSize);
 
+    WAV_INSTR_BEGIN(WAV_STAGE_CLOSE);
     if (fclose(stream) == EOF) {
         fprintf(stderr, "Cannot close file\n");
         exit(1);
     }
+    WAV_INSTR_END(WAV_STAGE_CLOSE);
+    WAV_INSTR_ADD(nbIoCalls, 1);
 }
 
 
@@ -204,8 +403,8 @@ void wav_extract_channel_data (int16_t** dstData,
         exit(1);
     }
 
-    if (channel > 6) {
-        fprintf(stderr, "Only 6 channels available\n");
+    if (channel >= srcHeader->NbChannels) {
+        fprintf(stderr, "Only %u channels available\n", srcHeader->NbChannels);
         exit(1);
     }
 
@@ -232,7 +431,11 @@ void wav_extract_channel_data (int16_t** dstData,
     dstHeader->BytePerSec = dstHeader->SampleRate * dstHeader->BytePerChunk;
     dstHeader->FileSize = dstHeader->DataSize + sizeof(WavHeader) - 8;
 
+    WAV_INSTR_BEGIN(WAV_STAGE_ALLOC);
     *dstData = (int16_t*)malloc(sizeMaxBytes);
+    WAV_INSTR_END(WAV_STAGE_ALLOC);
+    WAV_INSTR_ADD(nbAllocs, 1);
+    WAV_INSTR_ADD(allocBytes, sizeMaxBytes);
 
     if (!*dstData) {
         fprintf(stderr, "Cannot allocate memory for data buffer\n");
@@ -240,13 +443,349 @@ void wav_extract_channel_data (int16_t** dstData,
     }
 
     // Copy the elements at the channel position
+    WAV_INSTR_BEGIN(WAV_STAGE_EXTRACT);
     for (int i = 0; i < sizeMax; ++i) {
         (*dstData)[i] = (*srcData)[i * srcHeader->NbChannels + channel];
     }
+    WAV_INSTR_END(WAV_STAGE_EXTRACT);
     
 }
 
 
+/* Read-only view of one channel of an interleaved buffer, without copy */
+typedef struct WavChannelView {
+    const int16_t*  base;       // First sample of the channel
+    size_t          stride;     // Distance between two samples, NbChannels
+    size_t          length;     // Number of samples
+} WavChannelView;
+
+
+/**
+ * @brief   View a channel of interleaved data in place
+ * @details Unlike wav_extract_channel_data, nothing is allocated or
+ *          copied: the view stays valid as long as @p data does.
+ *          Sample i of the channel is view.base[i * view.stride].
+ * 
+ * @param[in]  data      Pointer to the interleaved samples
+ * @param[in]  header    Pointer to the wav header of the samples
+ * @param[in]  channel   Channel number to view
+ * @returns              View of the channel
+ * 
+ */ 
+WavChannelView wav_channel_view (const int16_t* data,
+                                 const WavHeader* header,
+                                 unsigned int channel)
+{
+    WavChannelView view;
+
+    if (channel >= header->NbChannels) {
+        fprintf(stderr, "Only %u channels available\n", header->NbChannels);
+        exit(1);
+    }
+
+    view.base = data + channel;
+    view.stride = header->NbChannels;
+    view.length = header->DataSize / header->BytePerChunk;
+    return view;
+}
+
+
+/**
+ * @brief   Restrict a view to @p length samples from @p start
+ * @details The range is clamped to the samples of @p view .
+ * 
+ */ 
+WavChannelView wav_channel_view_slice (const WavChannelView* view,
+                                       size_t start,
+                                       size_t length)
+{
+    WavChannelView slice = *view;
+
+    start = start < view->length ? start : view->length;
+    slice.base = view->base + start * view->stride;
+    slice.length = length < view->length - start ? length : view->length - start;
+    return slice;
+}
+
+
+/* Number of samples transposed at once through the stack by the
+   in-place layout conversions, small enough to stay in L1 cache */
+#define WAV_TRANSPOSE_BLOCK 4096
+
+/* Deinterleave up to WAV_TRANSPOSE_BLOCK samples through the stack */
+void wav_block_to_planar (int16_t* data,
+                          size_t nbFrames,
+                          unsigned int nbChannels)
+{
+    int16_t block[WAV_TRANSPOSE_BLOCK];
+    memcpy(block, data, nbFrames * nbChannels * sizeof(int16_t));
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        int16_t* dst = data + c * nbFrames;
+        for (size_t i = 0; i < nbFrames; ++i)
+            dst[i] = block[i * nbChannels + c];
+    }
+}
+
+/* Interleave up to WAV_TRANSPOSE_BLOCK samples through the stack */
+void wav_block_to_interleaved (int16_t* data,
+                               size_t nbFrames,
+                               unsigned int nbChannels)
+{
+    int16_t block[WAV_TRANSPOSE_BLOCK];
+    memcpy(block, data, nbFrames * nbChannels * sizeof(int16_t));
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        const int16_t* src = block + c * nbFrames;
+        for (size_t i = 0; i < nbFrames; ++i)
+            data[i * nbChannels + c] = src[i];
+    }
+}
+
+/*
+ * Transpose in place a matrix of rows x cols chunks of chunkSize samples,
+ * up to WAV_TRANSPOSE_BLOCK, by following the cycles of the permutation:
+ * each chunk is copied once, and a bit per chunk marks those in place.
+ */
+void wav_transpose_chunks (int16_t* data,
+                           size_t rows,
+                           size_t cols,
+                           size_t chunkSize)
+{
+    size_t nbChunks = rows * cols;
+    size_t chunkBytes = chunkSize * sizeof(int16_t);
+    uint8_t* moved = (uint8_t*)calloc(nbChunks / 8 + 1, 1);
+    int16_t saved[WAV_TRANSPOSE_BLOCK];
+
+    if (!moved) {
+        fprintf(stderr, "Cannot allocate memory for transposition\n");
+        exit(1);
+    }
+
+    // Chunk (r, c) at r * cols + c goes to c * rows + r; first and last stay
+    for (size_t start = 1; start + 1 < nbChunks; ++start) {
+        if (moved[start / 8] & (1 << (start % 8)))
+            continue;
+
+        size_t to = start;
+        memcpy(saved, data + start * chunkSize, chunkBytes);
+
+        for (;;) {
+            size_t from = (to % rows) * cols + to / rows;
+            moved[to / 8] |= 1 << (to % 8);
+            if (from == start)
+                break;
+            memcpy(data + to * chunkSize, data + from * chunkSize, chunkBytes);
+            to = from;
+        }
+        memcpy(data + to * chunkSize, saved, chunkBytes);
+    }
+
+    free(moved);
+}
+
+
+/**
+ * @brief   Convert interleaved frames to planar channels in place
+ * @details Blocks of WAV_TRANSPOSE_BLOCK samples are transposed through the
+ *          stack, which makes a matrix of blocks x channels runs of samples.
+ *          This matrix is transposed by moving whole runs along the cycles
+ *          of the permutation, so every sample is copied twice, and the
+ *          frames after the last whole block are merged in one more pass.
+ *          Two blocks of stack and a bit per run are used, so the peak
+ *          memory stays the one of the buffer read by wav_read.
+ *          Channel c then starts at data + c * nbFrames, which is viewed
+ *          with { data + c * nbFrames, 1, nbFrames }.
+ * 
+ * @param[in,out] data        Pointer to the samples
+ * @param[in]     nbFrames    Number of frames
+ * @param[in]     nbChannels  Number of channels
+ * @returns                   None
+ * 
+ */ 
+void wav_deinterleave_inplace (int16_t* data,
+                               size_t nbFrames,
+                               unsigned int nbChannels)
+{
+    if (nbFrames <= 1 || nbChannels <= 1)
+        return;
+
+    // Runs of a single sample when a frame does not fit in a block
+    size_t blockFrames = WAV_TRANSPOSE_BLOCK / nbChannels ? WAV_TRANSPOSE_BLOCK / nbChannels : 1;
+    size_t nbBlocks = nbFrames / blockFrames;
+    size_t mainFrames = nbBlocks * blockFrames;
+    size_t rest = nbFrames - mainFrames;
+
+    if (blockFrames > 1) {
+        for (size_t b = 0; b < nbBlocks; ++b)
+            wav_block_to_planar(data + b * blockFrames * nbChannels, blockFrames, nbChannels);
+    }
+    wav_transpose_chunks(data, nbBlocks, nbChannels, blockFrames);
+
+    // Spread the channels by the frames left, from the last one
+    if (rest) {
+        int16_t block[WAV_TRANSPOSE_BLOCK];
+        const int16_t* tail = data + nbChannels * mainFrames;
+
+        for (unsigned c = 0; c < nbChannels; ++c) {
+            for (size_t i = 0; i < rest; ++i)
+                block[c * rest + i] = tail[i * nbChannels + c];
+        }
+
+        for (unsigned c = nbChannels; c-- > 0; ) {
+            memmove(data + c * nbFrames, data + c * mainFrames, mainFrames * sizeof(int16_t));
+            memcpy(data + c * nbFrames + mainFrames, block + c * rest, rest * sizeof(int16_t));
+        }
+    }
+}
+
+
+/**
+ * @brief   Convert planar channels back to interleaved frames in place
+ * @details Inverse of wav_deinterleave_inplace, with the same memory use.
+ * 
+ * @param[in,out] data        Pointer to the samples
+ * @param[in]     nbFrames    Number of frames
+ * @param[in]     nbChannels  Number of channels
+ * @returns                   None
+ * 
+ */ 
+void wav_interleave_inplace (int16_t* data,
+                             size_t nbFrames,
+                             unsigned int nbChannels)
+{
+    if (nbFrames <= 1 || nbChannels <= 1)
+        return;
+
+    size_t blockFrames = WAV_TRANSPOSE_BLOCK / nbChannels ? WAV_TRANSPOSE_BLOCK / nbChannels : 1;
+    size_t nbBlocks = nbFrames / blockFrames;
+    size_t mainFrames = nbBlocks * blockFrames;
+    size_t rest = nbFrames - mainFrames;
+
+    // Gather the frames after the last whole block, from the first channel
+    if (rest) {
+        int16_t block[WAV_TRANSPOSE_BLOCK];
+
+        for (unsigned c = 0; c < nbChannels; ++c) {
+            const int16_t* src = data + c * nbFrames + mainFrames;
+            for (size_t i = 0; i < rest; ++i)
+                block[i * nbChannels + c] = src[i];
+        }
+
+        for (unsigned c = 1; c < nbChannels; ++c)
+            memmove(data + c * mainFrames, data + c * nbFrames, mainFrames * sizeof(int16_t));
+        memcpy(data + nbChannels * mainFrames, block, rest * nbChannels * sizeof(int16_t));
+    }
+
+    wav_transpose_chunks(data, nbChannels, nbBlocks, blockFrames);
+    if (blockFrames > 1) {
+        for (size_t b = 0; b < nbBlocks; ++b)
+            wav_block_to_interleaved(data + b * blockFrames * nbChannels, blockFrames, nbChannels);
+    }
+}
+
+
+/**
+ * @brief   Fill a canonical 44-byte PCM header
+ * 
+ * @param[out] header         Pointer to the wavfile header
+ * @param[in]  nbChannels     Number of channels
+ * @param[in]  sampleRate     Sample rate in Hz
+ * @param[in]  bitsPerSample  Number of bits per sample
+ * @param[in]  dataSize       Size of the data chunk in bytes
+ * @returns                   None
+ * 
+ */ 
+void wav_header_init (WavHeader* header,
+                      uint16_t nbChannels,
+                      uint32_t sampleRate,
+                      uint16_t bitsPerSample,
+                      uint32_t dataSize)
+{
+    memcpy(header->FileTypeChunkID, "RIFF", 4);
+    memcpy(header->FileFormatID, "WAVE", 4);
+    memcpy(header->FormatChunkID, "fmt ", 4);
+    memcpy(header->DataChunkID, "data", 4);
+    header->FmtChunkSize = 16;
+    header->AudioFormat = 1;
+    header->NbChannels = nbChannels;
+    header->SampleRate = sampleRate;
+    header->BitsPerSample = bitsPerSample;
+    header->BytePerChunk = nbChannels * bitsPerSample / 8;
+    header->BytePerSec = sampleRate * header->BytePerChunk;
+    header->DataSize = dataSize;
+    header->FileSize = dataSize + sizeof(WavHeader) - 8;
+}
+
+
+/* Initial value of a wav_hash_bytes chain */
+#define WAV_HASH_INIT 0xcbf29ce484222325ULL
+
+/**
+ * @brief   Hash a byte buffer with the 64-bit FNV-1a function
+ * @details Chain calls by passing the previous result as @p hash 
+ *          to hash data received in several parts.
+ * 
+ * @param[in]  data      Pointer to the bytes to hash
+ * @param[in]  size      Number of bytes to hash
+ * @param[in]  hash      WAV_HASH_INIT or result of the previous call
+ * @returns              Updated hash value
+ * 
+ */ 
+uint64_t wav_hash_bytes (const void* data, 
+                         size_t size, 
+                         uint64_t hash)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief   Hash the samples of a channel view with wav_hash_bytes
+ * @details Gives the same result as wav_hash_bytes on the extracted 
+ *          channel data.
+ * 
+ * @param[in]  view      Pointer to the channel view
+ * @param[in]  hash      WAV_HASH_INIT or result of the previous call
+ * @returns              Updated hash value
+ * 
+ */ 
+uint64_t wav_hash_channel (const WavChannelView* view,
+                           uint64_t hash)
+{
+    for (size_t i = 0; i < view->length; ++i) {
+        uint16_t sample = (uint16_t)view->base[i * view->stride];
+        hash = (hash ^ (sample & 0xff)) * 0x100000001b3ULL;
+        hash = (hash ^ (sample >> 8)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief   Convert 16-bit samples to floats in [-1, 1)
+ * 
+ * @param[out] dst       Pointer to the float samples
+ * @param[in]  src       Pointer to the 16-bit samples
+ * @param[in]  count     Number of samples (all channels)
+ * @returns              None
+ * 
+ */ 
+void wav_convert_s16_to_f32 (float* dst, 
+                             const int16_t* src, 
+                             size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = src[i] * (1.0f / 32768.0f);
+}
+
+
 int wav_get_duration(WavHeader* header)
 {
     int duration_sec = 0;
@@ -0,0 +1,317 @@
+/**
+ ******************************************************************************
+ * @file     wav_align.h
+ * @brief    Find the offset between two recordings by GCC-PHAT cross-correlation
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_ALIGN_H__
+#define __WAV_ALIGN_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include "wav_analysis.h"
+#include "wav_fft.h"
+
+/* Sample rate of the coarse search over the whole recordings */
+#define WAV_ALIGN_RATE 1000
+
+/* Number of frames compared by the fine search at the full rate */
+#define WAV_ALIGN_WINDOW 65536
+
+/**
+ * @details The lag is the frame of the reference where the other
+ *          recording starts: other[n] matches reference[n + lag]. It is
+ *          negative when the other recording starts first.
+ *
+ */
+typedef struct WavAlignment {
+    int64_t     lag;
+    double      confidence;     // Correlation of the aligned signals, 0 (none) to 1 (same)
+} WavAlignment;
+
+
+/**
+ * @brief   Read a whole source as a decimated mono signal
+ * @details Channels and groups of @p factor frames are averaged while the
+ *          source is read block by block, so only the decimated signal is
+ *          kept in memory.
+ *
+ * @param[in]   source    Pointer to the source, read from its first frame
+ * @param[in]   factor    Number of frames averaged into a sample
+ * @param[out]  count     Number of samples of the signal
+ * @returns               Signal, to free after usage
+ *
+ */
+float* wav_align_decimate (WavSource* source,
+                           unsigned factor,
+                           size_t* count)
+{
+    unsigned nbChannels = source->header.NbChannels;
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    size_t capacity = source->nbFrames != WAV_UNKNOWN_FRAMES ? source->nbFrames / factor + 1 : 65536;
+    float* mono = (float*)malloc(WAV_ANALYSIS_BLOCK * sizeof(float));
+    float* signal = (float*)malloc(capacity * sizeof(float));
+    float sum = 0.0f;
+    unsigned nbSummed = 0;
+    size_t nbRead;
+
+    if (!block || !mono || !signal) {
+        fprintf(stderr, "Cannot allocate memory for alignment\n");
+        exit(1);
+    }
+
+    *count = 0;
+    wav_source_seek(source, 0);
+
+    while ((nbRead = wav_source_read(source, block, WAV_ANALYSIS_BLOCK))) {
+        wav_mix_to_mono(mono, block, nbRead, nbChannels);
+
+        for (size_t i = 0; i < nbRead; ++i) {
+            sum += mono[i];
+
+            if (++nbSummed == factor) {
+                if (*count == capacity) {
+                    capacity *= 2;
+                    signal = (float*)realloc(signal, capacity * sizeof(float));
+                    if (!signal) {
+                        fprintf(stderr, "Cannot allocate memory for alignment\n");
+                        exit(1);
+                    }
+                }
+                signal[(*count)++] = sum / factor;
+                sum = 0.0f;
+                nbSummed = 0;
+            }
+        }
+    }
+
+    free(block);
+    free(mono);
+    return signal;
+}
+
+
+/**
+ * @brief   Read frames of a source as a mono signal at the full rate
+ * @details Frames before the start or after the end of the source are silent.
+ *
+ */
+void wav_align_read (WavSource* source,
+                     int64_t start,
+                     size_t nbFrames,
+                     float* signal)
+{
+    unsigned nbChannels = source->header.NbChannels;
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    size_t done = 0;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for alignment\n");
+        exit(1);
+    }
+
+    memset(signal, 0, nbFrames * sizeof(float));
+    if (start < 0) {
+        done = (size_t)-start < nbFrames ? (size_t)-start : nbFrames;
+        start = 0;
+    }
+    wav_source_seek(source, start);
+
+    while (done < nbFrames) {
+        size_t length = nbFrames - done < WAV_ANALYSIS_BLOCK ? nbFrames - done : WAV_ANALYSIS_BLOCK;
+        size_t nbRead = wav_source_read(source, block, length);
+        if (nbRead == 0)
+            break;
+
+        wav_mix_to_mono(signal + done, block, nbRead, nbChannels);
+        done += nbRead;
+    }
+
+    free(block);
+}
+
+
+/**
+ * @brief   Find the lag maximizing the phase transform cross-correlation
+ * @details The cross-spectrum of the signals is whitened (PHAT weighting)
+ *          before the inverse transform, which turns a delay into a sharp
+ *          peak whatever the spectra of the signals. The transform covers
+ *          both signals, so the correlation does not wrap around.
+ *
+ * @param[in]   a         Signal searched
+ * @param[in]   lengthA   Number of samples of a
+ * @param[in]   b         Signal looked for in a
+ * @param[in]   lengthB   Number of samples of b
+ * @param[in]   minLag    Smallest lag searched, b[n] matching a[n + lag]
+ * @param[in]   maxLag    Largest lag searched
+ * @returns               Lag of the highest correlation
+ *
+ */
+int64_t wav_align_phat (const float* a,
+                        size_t lengthA,
+                        const float* b,
+                        size_t lengthB,
+                        int64_t minLag,
+                        int64_t maxLag)
+{
+    WavFft fft;
+    wav_fft_init(&fft, wav_fft_size(lengthA + lengthB));
+
+    size_t size = fft.size;
+    float* signal = (float*)calloc(size, sizeof(float));
+    float* spectrumA = (float*)malloc((size + 2) * sizeof(float));
+    float* spectrumB = (float*)malloc((size + 2) * sizeof(float));
+
+    if (!signal || !spectrumA || !spectrumB) {
+        fprintf(stderr, "Cannot allocate memory for alignment\n");
+        exit(1);
+    }
+
+    WAV_TRACE_BEGIN("phat");
+    memcpy(signal, a, lengthA * sizeof(float));
+    wav_fft_forward(&fft, signal, spectrumA);
+    memset(signal, 0, lengthA * sizeof(float));
+    memcpy(signal, b, lengthB * sizeof(float));
+    wav_fft_forward(&fft, signal, spectrumB);
+
+    // A conj(B) / |A conj(B)|, empty bins are left out
+    for (size_t k = 0; k <= size / 2; ++k) {
+        float ar = spectrumA[2 * k], ai = spectrumA[2 * k + 1];
+        float br = spectrumB[2 * k], bi = spectrumB[2 * k + 1];
+        float re = ar * br + ai * bi;
+        float im = ai * br - ar * bi;
+        float magnitude = sqrtf(re * re + im * im);
+        float weight = magnitude > 1e-20f ? 1.0f / magnitude : 0.0f;
+
+        spectrumA[2 * k] = re * weight;
+        spectrumA[2 * k + 1] = im * weight;
+    }
+
+    wav_fft_inverse(&fft, spectrumA, spectrumA);
+
+    // Lag k >= 0 is at index k, lag k < 0 at index size + k
+    int64_t best = minLag;
+    float bestValue = -INFINITY;
+    for (int64_t lag = minLag; lag <= maxLag; ++lag) {
+        float value = spectrumA[lag >= 0 ? (size_t)lag : size - (size_t)-lag];
+        if (value > bestValue) {
+            bestValue = value;
+            best = lag;
+        }
+    }
+    WAV_TRACE_END("phat");
+
+    free(signal);
+    free(spectrumA);
+    free(spectrumB);
+    wav_fft_free(&fft);
+    return best;
+}
+
+
+/**
+ * @brief   Find where a recording starts in a reference recording
+ * @details The lag is first searched over the whole recordings decimated
+ *          to about WAV_ALIGN_RATE Hz, then refined to the frame on
+ *          WAV_ALIGN_WINDOW frames of their overlap read at the full rate.
+ *          The sources must be seekable and have the same sample rate.
+ *
+ * @param[in]   reference  Pointer to the reference source
+ * @param[in]   other      Pointer to the source to align
+ * @param[in]   maxLag     Largest lag searched in frames, 0 for any lag
+ * @param[out]  alignment  Pointer to the lag and its confidence
+ * @returns                None
+ *
+ */
+void wav_align_sources (WavSource* reference,
+                        WavSource* other,
+                        uint64_t maxLag,
+                        WavAlignment* alignment)
+{
+    uint32_t rate = reference->header.SampleRate;
+    unsigned factor = rate > WAV_ALIGN_RATE ? rate / WAV_ALIGN_RATE : 1;
+    size_t lengthA, lengthB;
+
+    if (other->header.SampleRate != rate) {
+        fprintf(stderr, "Cannot align recordings of different sample rates\n");
+        exit(1);
+    }
+
+    WAV_TRACE_BEGIN("align");
+    float* a = wav_align_decimate(reference, factor, &lengthA);
+    float* b = wav_align_decimate(other, factor, &lengthB);
+
+    int64_t minLag = lengthB ? -(int64_t)(lengthB - 1) : 0;
+    int64_t maxLagCoarse = lengthA ? (int64_t)lengthA - 1 : 0;
+    if (maxLag) {
+        int64_t limit = (int64_t)(maxLag / factor) + 1;
+        minLag = minLag > -limit ? minLag : -limit;
+        maxLagCoarse = maxLagCoarse < limit ? maxLagCoarse : limit;
+    }
+
+    int64_t coarse = wav_align_phat(a, lengthA, b, lengthB, minLag, maxLagCoarse) * factor;
+    free(a);
+    free(b);
+
+    // Overlap of the recordings in frames of the other one
+    int64_t framesA = (int64_t)lengthA * factor;
+    int64_t framesB = (int64_t)lengthB * factor;
+    int64_t from = coarse < 0 ? -coarse : 0;
+    int64_t to = framesB < framesA - coarse ? framesB : framesA - coarse;
+
+    alignment->lag = coarse;
+    alignment->confidence = 0.0;
+
+    if (to - from >= 2) {
+        int64_t window = to - from < WAV_ALIGN_WINDOW ? to - from : WAV_ALIGN_WINDOW;
+        int64_t start = from + (to - from - window) / 2;
+        int64_t margin = 2 * (int64_t)factor;
+        int64_t startA = start + coarse - margin;
+        size_t lengthFine = window + 2 * margin;
+
+        float* fineA = (float*)malloc(lengthFine * sizeof(float));
+        float* fineB = (float*)malloc(window * sizeof(float));
+        if (!fineA || !fineB) {
+            fprintf(stderr, "Cannot allocate memory for alignment\n");
+            exit(1);
+        }
+
+        wav_align_read(reference, startA, lengthFine, fineA);
+        wav_align_read(other, start, window, fineB);
+
+        int64_t shift = wav_align_phat(fineA, lengthFine, fineB, window, 0, 2 * margin);
+        alignment->lag = startA + shift - start;
+
+        // Normalized correlation of the window at the lag found
+        double sumAB = 0.0, sumAA = 0.0, sumBB = 0.0;
+        for (int64_t i = 0; i < window; ++i) {
+            double x = fineA[shift + i], y = fineB[i];
+            sumAB += x * y;
+            sumAA += x * x;
+            sumBB += y * y;
+        }
+        if (sumAA > 0.0 && sumBB > 0.0 && sumAB > 0.0)
+            alignment->confidence = sumAB / sqrt(sumAA * sumBB);
+
+        free(fineA);
+        free(fineB);
+    }
+    WAV_TRACE_END("align");
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_ALIGN_H__
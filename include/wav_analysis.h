@@ -0,0 +1,374 @@
+/**
+ ******************************************************************************
+ * @file     wav_analysis.h
+ * @brief    Provide statistics, peak overviews and hashes of wav sources
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_ANALYSIS_H__
+#define __WAV_ANALYSIS_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <math.h>
+
+#include "wav_stream.h"
+
+/* Maximum number of channels handled by WavStats */
+#define WAV_STATS_MAX_CHANNELS 32
+
+/* Number of frames read at once by the analysis functions */
+#define WAV_ANALYSIS_BLOCK 4096
+
+/* Statistics of one channel */
+typedef struct WavChannelStats {
+    int16_t     min;
+    int16_t     max;
+    uint64_t    nbClipped;      // Samples at the minimum or maximum code
+    int64_t     sum;
+    double      sumSquares;
+    double      mean;           // Set by wav_stats_finish
+    double      rms;            // Set by wav_stats_finish, in sample units
+} WavChannelStats;
+
+/* Statistics of all the channels of a signal */
+typedef struct WavStats {
+    uint64_t        nbFrames;
+    uint16_t        nbChannels;
+    WavChannelStats channels[WAV_STATS_MAX_CHANNELS];
+} WavStats;
+
+/* Min/max overview of a signal, as used to draw waveforms */
+typedef struct WavPeaks {
+    uint32_t    binFrames;      // Number of frames summarized by a bin
+    uint16_t    nbChannels;
+    uint64_t    nbBins;
+    int16_t*    data;           // [bin][channel][min, max]
+} WavPeaks;
+
+
+/**
+ * @brief   Average the channels of 16-bit frames into a mono signal in [-1, 1)
+ *
+ * @param[out]  dst         Pointer to nbFrames floats
+ * @param[in]   src         Pointer to the interleaved frames
+ * @param[in]   nbFrames    Number of frames
+ * @param[in]   nbChannels  Number of channels of the frames
+ * @returns                 None
+ *
+ */
+void wav_mix_to_mono (float* dst,
+                      const int16_t* src,
+                      size_t nbFrames,
+                      unsigned nbChannels)
+{
+    float scale = 1.0f / (32768.0f * nbChannels);
+
+    for (size_t i = 0; i < nbFrames; ++i) {
+        float sum = 0.0f;
+        for (unsigned c = 0; c < nbChannels; ++c)
+            sum += src[i * nbChannels + c];
+        dst[i] = sum * scale;
+    }
+}
+
+
+/**
+ * @brief   Reset statistics before the first wav_stats_update
+ *
+ */
+void wav_stats_init (WavStats* stats,
+                     uint16_t nbChannels)
+{
+    if (nbChannels > WAV_STATS_MAX_CHANNELS) {
+        fprintf(stderr, "Only %d channels supported by statistics\n", WAV_STATS_MAX_CHANNELS);
+        exit(1);
+    }
+
+    memset(stats, 0, sizeof(WavStats));
+    stats->nbChannels = nbChannels;
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        stats->channels[c].min = INT16_MAX;
+        stats->channels[c].max = INT16_MIN;
+    }
+}
+
+
+/**
+ * @brief   Accumulate the samples of a channel view into its statistics
+ * @details Works on any channel layout: interleaved, planar or mapped
+ *          data. The sum of squares of a call is kept on 64 bits, so
+ *          views are limited to 2^33 samples.
+ *
+ * @param[in,out] channel   Pointer to the statistics of the channel
+ * @param[in]     view      Pointer to the channel view
+ * @returns                 None
+ *
+ */
+void wav_channel_stats_update (WavChannelStats* channel,
+                               const WavChannelView* view)
+{
+    const int16_t* samples = view->base;
+    size_t stride = view->stride;
+    int16_t min = channel->min;
+    int16_t max = channel->max;
+    int64_t sum = 0;
+    int64_t sumSquares = 0;
+    uint64_t nbClipped = 0;
+
+    for (size_t i = 0; i < view->length; ++i) {
+        int32_t sample = samples[i * stride];
+        min = sample < min ? sample : min;
+        max = sample > max ? sample : max;
+        sum += sample;
+        sumSquares += sample * sample;
+        nbClipped += (sample == INT16_MIN) | (sample == INT16_MAX);
+    }
+
+    channel->min = min;
+    channel->max = max;
+    channel->sum += sum;
+    channel->sumSquares += (double)sumSquares;
+    channel->nbClipped += nbClipped;
+}
+
+
+/**
+ * @brief   Accumulate interleaved frames into statistics
+ *
+ * @param[in,out] stats     Pointer to the statistics
+ * @param[in]     frames    Interleaved frames
+ * @param[in]     nbFrames  Number of frames
+ * @returns                 None
+ *
+ */
+void wav_stats_update (WavStats* stats,
+                       const int16_t* frames,
+                       size_t nbFrames)
+{
+    for (unsigned c = 0; c < stats->nbChannels; ++c) {
+        WavChannelView view = { frames + c, stats->nbChannels, nbFrames };
+        wav_channel_stats_update(&stats->channels[c], &view);
+    }
+    stats->nbFrames += nbFrames;
+}
+
+
+/**
+ * @brief   Compute the mean and rms once all frames were accumulated
+ *
+ */
+void wav_stats_finish (WavStats* stats)
+{
+    for (unsigned c = 0; c < stats->nbChannels; ++c) {
+        WavChannelStats* channel = &stats->channels[c];
+
+        if (stats->nbFrames) {
+            channel->mean = (double)channel->sum / stats->nbFrames;
+            channel->rms = sqrt(channel->sumSquares / stats->nbFrames);
+        }
+    }
+}
+
+
+/**
+ * @brief   Compute the statistics of a whole source
+ *
+ * @param[in]   source    Pointer to the source, read from its first frame
+ * @param[out]  stats     Pointer to the statistics
+ * @returns               None
+ *
+ */
+void wav_stats_compute (WavSource* source,
+                        WavStats* stats)
+{
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    size_t nbRead;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    WAV_TRACE_BEGIN("stats");
+    wav_stats_init(stats, source->header.NbChannels);
+    wav_source_seek(source, 0);
+
+    // Blocks are small enough for the 64-bit sums of squares
+    while ((nbRead = wav_source_read(source, block, WAV_ANALYSIS_BLOCK)))
+        wav_stats_update(stats, block, nbRead);
+
+    wav_stats_finish(stats);
+    WAV_TRACE_END("stats");
+    free(block);
+}
+
+
+/* Compute the min/max overview of a whole source, 0 on success or errno value */
+int wav_peaks_compute_checked (WavSource* source,
+                               uint32_t binFrames,
+                               WavPeaks* peaks)
+{
+    unsigned nbChannels = source->header.NbChannels;
+    size_t binSize = nbChannels * 2 * sizeof(int16_t);
+    int known = source->nbFrames != WAV_UNKNOWN_FRAMES;
+
+    if (binFrames == 0)
+        return EINVAL;
+
+    // Sources of unknown length, such as pipes, grow the bins up to their end
+    uint64_t capacity = known ? source->nbFrames / binFrames + (source->nbFrames % binFrames != 0) : 1024;
+
+    peaks->binFrames = binFrames;
+    peaks->nbChannels = nbChannels;
+    peaks->nbBins = 0;
+    peaks->data = (int16_t*)malloc(capacity * binSize + 1);
+
+    // Bins are read by blocks, so that their size does not bound memory
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    int status = peaks->data && block ? 0 : ENOMEM;
+
+    WAV_TRACE_BEGIN("peaks");
+    wav_source_seek(source, 0);
+
+    while (!status && (!known || peaks->nbBins < capacity)) {
+        if (peaks->nbBins == capacity) {
+            int16_t* data = (int16_t*)realloc(peaks->data, 2 * capacity * binSize);
+            if (!data) {
+                status = ENOMEM;
+                break;
+            }
+            peaks->data = data;
+            capacity *= 2;
+        }
+
+        int16_t* minmax = peaks->data + peaks->nbBins * nbChannels * 2;
+        uint32_t binRead = 0;
+        size_t nbRead;
+
+        for (unsigned c = 0; c < nbChannels; ++c) {
+            minmax[2 * c] = INT16_MAX;
+            minmax[2 * c + 1] = INT16_MIN;
+        }
+
+        while (binRead < binFrames) {
+            uint32_t length = binFrames - binRead < WAV_ANALYSIS_BLOCK ? binFrames - binRead : WAV_ANALYSIS_BLOCK;
+
+            if (!(nbRead = wav_source_read(source, block, length)))
+                break;
+            binRead += nbRead;
+
+            for (unsigned c = 0; c < nbChannels; ++c) {
+                WavChannelView view = { block + c, nbChannels, nbRead };
+                int16_t min = minmax[2 * c];
+                int16_t max = minmax[2 * c + 1];
+
+                for (size_t i = 0; i < view.length; ++i) {
+                    int16_t sample = view.base[i * view.stride];
+                    min = sample < min ? sample : min;
+                    max = sample > max ? sample : max;
+                }
+                minmax[2 * c] = min;
+                minmax[2 * c + 1] = max;
+            }
+        }
+
+        if (binRead == 0 && !known)
+            break;
+
+        // Bins past the end of a shorter source than announced are silent
+        if (binRead == 0)
+            memset(minmax, 0, binSize);
+        peaks->nbBins++;
+    }
+
+    WAV_TRACE_END("peaks");
+    free(block);
+    if (status) {
+        free(peaks->data);
+        peaks->data = NULL;
+    }
+    return status;
+}
+
+
+/**
+ * @brief   Compute the min/max overview of a whole source
+ *
+ * @param[in]   source     Pointer to the source, read from its first frame
+ * @param[in]   binFrames  Number of frames summarized by each bin
+ * @param[out]  peaks      Pointer to the overview, to free with wav_peaks_free
+ * @returns                None
+ *
+ */
+void wav_peaks_compute (WavSource* source,
+                        uint32_t binFrames,
+                        WavPeaks* peaks)
+{
+    int status = wav_peaks_compute_checked(source, binFrames, peaks);
+
+    if (status == EINVAL) {
+        fprintf(stderr, "Peak bins must contain at least one frame\n");
+        exit(1);
+    }
+    if (status) {
+        fprintf(stderr, "Cannot allocate memory for peaks\n");
+        exit(1);
+    }
+}
+
+
+void wav_peaks_free (WavPeaks* peaks)
+{
+    free(peaks->data);
+    peaks->data = NULL;
+}
+
+
+/**
+ * @brief   Hash the samples of a whole source
+ * @details The hash only depends on the samples, not on the chunks
+ *          around them, so it identifies the audio content of a file.
+ *
+ * @param[in]   source    Pointer to the source, read from its first frame
+ * @returns               wav_hash_bytes of the samples
+ *
+ */
+uint64_t wav_hash_source (WavSource* source)
+{
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    uint64_t hash = WAV_HASH_INIT;
+    size_t nbRead;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    WAV_TRACE_BEGIN("hash");
+    wav_source_seek(source, 0);
+
+    while ((nbRead = wav_source_read(source, block, WAV_ANALYSIS_BLOCK)))
+        hash = wav_hash_bytes(block, nbRead * source->header.BytePerChunk, hash);
+    WAV_TRACE_END("hash");
+
+    free(block);
+    return hash;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_ANALYSIS_H__
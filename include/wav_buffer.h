@@ -0,0 +1,608 @@
+/**
+ ******************************************************************************
+ * @file     wav_buffer.h
+ * @brief    Provide reference-counted sample buffers shared between users
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_BUFFER_H__
+#define __WAV_BUFFER_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wav_stream.h"
+
+/**
+ * @details Memory holding samples, shared by all the buffers and slices
+ *          made from it. The memory is released when the last of them
+ *          is released. Counts are updated atomically, so buffers can be
+ *          shared between threads.
+ *
+ */
+typedef struct WavStorage {
+    uint32_t    refs;           // Number of buffers using the storage
+    int         mapped;         // 1 if mapped from a file (read-only), 0 if on the heap
+    void*       base;           // Start of the mapping or of the heap block
+    size_t      size;           // Size of the mapping
+} WavStorage;
+
+/**
+ * @details A buffer is a range of frames of a storage. It is a small
+ *          value: copy it with wav_buffer_retain, not with =, so that the
+ *          storage knows about the copy.
+ *
+ */
+typedef struct WavBuffer {
+    WavStorage*     storage;
+    WavHeader       header;     // Format, DataSize matches nbFrames
+    const int16_t*  data;       // First frame of the buffer
+    uint64_t        nbFrames;
+} WavBuffer;
+
+/* Default number of files kept by the open-file cache */
+#define WAV_BUFFER_CACHE_FILES 256
+
+/* Entry of the open-file cache */
+typedef struct WavBufferFile {
+    dev_t       device;
+    ino_t       inode;
+    off_t       size;
+    int64_t     mtime;          // Modification time in nanoseconds
+    uint64_t    lastUse;        // Clock of the cache at the last open
+    WavBuffer   buffer;         // Holds one reference on the storage
+} WavBufferFile;
+
+/* Files opened with wav_buffer_open, shared by the whole process */
+typedef struct WavBufferCache {
+    WavBufferFile*  files;
+    size_t          nbFiles;
+    size_t          capacity;
+    size_t          maxFiles;   // Files kept, the least recently used are released
+    uint64_t        clock;      // Number of opens
+    pthread_mutex_t lock;
+} WavBufferCache;
+
+WavBufferCache wav_buffer_cache = { NULL, 0, 0, WAV_BUFFER_CACHE_FILES, 0, PTHREAD_MUTEX_INITIALIZER };
+
+
+/* Set the number of frames of a buffer and the sizes of its header */
+void wav_buffer_set_frames (WavBuffer* buffer,
+                            uint64_t nbFrames)
+{
+    uint64_t dataSize = nbFrames * buffer->header.BytePerChunk;
+
+    buffer->nbFrames = nbFrames;
+    buffer->header.DataSize = dataSize > UINT32_MAX ? 0 : dataSize;
+    buffer->header.FileSize = buffer->header.DataSize + sizeof(WavHeader) - 8;
+}
+
+
+/* Allocate a buffer on the heap, 0 on success or ENOMEM */
+int wav_buffer_alloc_checked (WavBuffer* buffer,
+                              const WavHeader* format,
+                              uint64_t nbFrames)
+{
+    // Samples follow the storage in the same block
+    size_t size = sizeof(WavStorage) + nbFrames * format->BytePerChunk;
+    WavStorage* storage = (WavStorage*)malloc(size);
+    WAV_INSTR_ADD(nbAllocs, 1);
+    WAV_INSTR_ADD(allocBytes, size);
+
+    if (!storage)
+        return ENOMEM;
+
+    storage->refs = 1;
+    storage->mapped = 0;
+    storage->base = storage;
+    storage->size = size;
+
+    buffer->storage = storage;
+    memcpy(&buffer->header, format, sizeof(WavHeader));
+    buffer->data = (const int16_t*)(storage + 1);
+    wav_buffer_set_frames(buffer, nbFrames);
+    return 0;
+}
+
+
+/**
+ * @brief   Allocate a buffer on the heap
+ * @details The samples are not initialized: fill them through
+ *          wav_buffer_mutable before sharing the buffer.
+ *
+ * @param[out]  buffer    Pointer to the buffer, to release with wav_buffer_release
+ * @param[in]   format    Pointer to the header giving the frame format
+ * @param[in]   nbFrames  Number of frames
+ * @returns               None
+ *
+ */
+void wav_buffer_alloc (WavBuffer* buffer,
+                       const WavHeader* format,
+                       uint64_t nbFrames)
+{
+    if (wav_buffer_alloc_checked(buffer, format, nbFrames)) {
+        fprintf(stderr, "Cannot allocate memory for buffer\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Map the samples of a wav file in a buffer, returning an error on bad files
+ * @details As wav_buffer_map, for callers which must not exit on invalid
+ *          files (servers, bindings).
+ *
+ * @param[out]  buffer    Pointer to the buffer, to release with wav_buffer_release
+ * @param[in]   filename  String of the filename to map
+ * @returns               0 on success, errno value otherwise (EINVAL if not a
+ *                        16-bit PCM wav file, ESPIPE if its length is unknown)
+ *
+ */
+int wav_buffer_map_checked (WavBuffer* buffer,
+                            const char* filename)
+{
+    WavReader* reader;
+    int status = wav_reader_open_checked(filename, &reader);
+
+    if (status)
+        return status;
+
+    WavSource* source = &reader->source;
+    uint64_t nbFrames = source->nbFrames;
+    struct stat info;
+
+    if (fstat(fileno(reader->stream), &info))
+        status = errno;
+    else if (nbFrames == WAV_UNKNOWN_FRAMES)
+        status = ESPIPE;
+
+    if (status) {
+        wav_source_close(source);
+        return status;
+    }
+
+    int64_t end = reader->dataOffset + (int64_t)(nbFrames * source->header.BytePerChunk);
+
+    if (nbFrames && (reader->dataOffset & 1) == 0 && end <= info.st_size) {
+        void* base = mmap(NULL, end, PROT_READ, MAP_SHARED, fileno(reader->stream), 0);
+        WavStorage* storage = base == MAP_FAILED ? NULL : (WavStorage*)malloc(sizeof(WavStorage));
+
+        if (!storage) {
+            status = base == MAP_FAILED ? errno : ENOMEM;
+            if (base != MAP_FAILED)
+                munmap(base, end);
+        }
+        else {
+            storage->refs = 1;
+            storage->mapped = 1;
+            storage->base = base;
+            storage->size = end;
+
+            buffer->storage = storage;
+            memcpy(&buffer->header, &source->header, sizeof(WavHeader));
+            buffer->data = (const int16_t*)((const char*)base + reader->dataOffset);
+            wav_buffer_set_frames(buffer, nbFrames);
+        }
+    }
+    else {
+        // Data announced past the end of the file is not allocated
+        if (end > info.st_size) {
+            int64_t available = info.st_size > reader->dataOffset ? info.st_size - reader->dataOffset : 0;
+            nbFrames = available / source->header.BytePerChunk;
+        }
+        if (!(status = wav_buffer_alloc_checked(buffer, &source->header, nbFrames))) {
+            nbFrames = wav_source_read(source, (int16_t*)buffer->data, nbFrames);
+            wav_buffer_set_frames(buffer, nbFrames);
+        }
+    }
+
+    wav_source_close(source);
+    return status;
+}
+
+
+/**
+ * @brief   Map the samples of a wav file in a buffer
+ * @details Pages are loaded on access and shared with the other
+ *          processes mapping the file. Files whose samples are not
+ *          aligned on 16 bits, or that are empty, are read on the heap.
+ *
+ * @param[out]  buffer    Pointer to the buffer, to release with wav_buffer_release
+ * @param[in]   filename  String of the filename to map
+ * @returns               None
+ *
+ */
+void wav_buffer_map (WavBuffer* buffer,
+                     const char* filename)
+{
+    int status = wav_buffer_map_checked(buffer, filename);
+
+    if (status) {
+        fprintf(stderr, "Cannot map file %s: %s\n", filename,
+                status == EINVAL ? "not a 16-bit PCM wav file" : strerror(status));
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Share a buffer
+ *
+ * @param[out]  dst       Pointer to the new buffer, to release with wav_buffer_release
+ * @param[in]   src       Pointer to the shared buffer
+ * @returns               None
+ *
+ */
+void wav_buffer_retain (WavBuffer* dst,
+                        const WavBuffer* src)
+{
+    __atomic_add_fetch(&src->storage->refs, 1, __ATOMIC_RELAXED);
+    memcpy(dst, src, sizeof(WavBuffer));
+}
+
+
+/**
+ * @brief   Stop using a buffer, releasing the storage after its last user
+ *
+ */
+void wav_buffer_release (WavBuffer* buffer)
+{
+    WavStorage* storage = buffer->storage;
+
+    if (storage && __atomic_sub_fetch(&storage->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (storage->mapped) {
+            munmap(storage->base, storage->size);
+            free(storage);
+        }
+        else {
+            free(storage->base);
+        }
+    }
+
+    buffer->storage = NULL;
+    buffer->data = NULL;
+    buffer->nbFrames = 0;
+}
+
+
+/**
+ * @brief   Share a range of frames of a buffer, without copy
+ * @details The range is clamped to the frames of @p src .
+ *
+ * @param[out]  dst       Pointer to the slice, to release with wav_buffer_release
+ * @param[in]   src       Pointer to the sliced buffer
+ * @param[in]   start     First frame of the slice in @p src
+ * @param[in]   nbFrames  Number of frames of the slice
+ * @returns               None
+ *
+ */
+void wav_buffer_slice (WavBuffer* dst,
+                       const WavBuffer* src,
+                       uint64_t start,
+                       uint64_t nbFrames)
+{
+    start = start < src->nbFrames ? start : src->nbFrames;
+    nbFrames = nbFrames < src->nbFrames - start ? nbFrames : src->nbFrames - start;
+
+    wav_buffer_retain(dst, src);
+    dst->data = src->data + start * src->header.NbChannels;
+    wav_buffer_set_frames(dst, nbFrames);
+}
+
+
+/**
+ * @brief   Get the samples of a buffer for writing
+ * @details Copy on write: the samples are copied to a new heap storage
+ *          if the storage is shared with other buffers or mapped from a
+ *          file, so the other users keep seeing the original samples.
+ *
+ * @param[in,out] buffer    Pointer to the buffer
+ * @returns                 Pointer to the samples, only valid for this buffer
+ *
+ */
+int16_t* wav_buffer_mutable (WavBuffer* buffer)
+{
+    WavStorage* storage = buffer->storage;
+
+    if (storage->mapped || __atomic_load_n(&storage->refs, __ATOMIC_ACQUIRE) > 1) {
+        WavBuffer copy;
+        wav_buffer_alloc(&copy, &buffer->header, buffer->nbFrames);
+        memcpy((int16_t*)copy.data, buffer->data, buffer->nbFrames * buffer->header.BytePerChunk);
+        wav_buffer_release(buffer);
+        memcpy(buffer, &copy, sizeof(WavBuffer));
+    }
+
+    return (int16_t*)buffer->data;
+}
+
+
+/* Entry of the cache for a file, NULL if none; the cache must be locked */
+WavBufferFile* wav_buffer_cache_find (WavBufferCache* cache,
+                                      const struct stat* info)
+{
+    for (size_t i = 0; i < cache->nbFiles; ++i) {
+        if (cache->files[i].device == info->st_dev && cache->files[i].inode == info->st_ino)
+            return &cache->files[i];
+    }
+    return NULL;
+}
+
+
+/* Least recently used entry of a non-empty cache; the cache must be locked */
+WavBufferFile* wav_buffer_cache_lru (WavBufferCache* cache)
+{
+    WavBufferFile* oldest = &cache->files[0];
+
+    for (size_t i = 1; i < cache->nbFiles; ++i) {
+        if (cache->files[i].lastUse < oldest->lastUse)
+            oldest = &cache->files[i];
+    }
+    return oldest;
+}
+
+
+/**
+ * @brief   Open a buffer like wav_buffer_open, returning an error on bad files
+ * @details For callers which must not exit on invalid files (servers,
+ *          bindings): the whole header is validated by the parser of the
+ *          readers, which reports its errors instead of exiting.
+ *
+ * @param[out]  buffer    Pointer to the buffer, to release with wav_buffer_release
+ * @param[in]   filename  String of the filename to open
+ * @returns               0 on success, errno value otherwise (EINVAL if not a
+ *                        16-bit PCM wav file)
+ *
+ */
+int wav_buffer_open_checked (WavBuffer* buffer,
+                             const char* filename)
+{
+    struct stat info;
+
+    if (stat(filename, &info))
+        return errno;
+
+    int64_t mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    WavBufferCache* cache = &wav_buffer_cache;
+    WavBufferFile* file;
+
+    pthread_mutex_lock(&cache->lock);
+    file = wav_buffer_cache_find(cache, &info);
+
+    if (file && file->size == info.st_size && file->mtime == mtime) {
+        file->lastUse = ++cache->clock;
+        wav_buffer_retain(buffer, &file->buffer);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Files are mapped without the lock, so that other files are opened
+    // meanwhile, and looked up again: the first mapping of a file is kept
+    WavBuffer mapped;
+    int status = wav_buffer_map_checked(&mapped, filename);
+
+    if (status)
+        return status;
+
+    WavBuffer dropped;
+    dropped.storage = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    file = wav_buffer_cache_find(cache, &info);
+
+    if (file && file->size == info.st_size && file->mtime == mtime) {
+        memcpy(&dropped, &mapped, sizeof(WavBuffer));
+    }
+    else {
+        if (file) {
+            memcpy(&dropped, &file->buffer, sizeof(WavBuffer));
+        }
+        else if (cache->nbFiles >= cache->maxFiles) {
+            file = wav_buffer_cache_lru(cache);
+            memcpy(&dropped, &file->buffer, sizeof(WavBuffer));
+        }
+        else {
+            if (cache->nbFiles == cache->capacity) {
+                size_t capacity = cache->capacity ? 2 * cache->capacity : 16;
+                WavBufferFile* files = (WavBufferFile*)realloc(cache->files, capacity * sizeof(WavBufferFile));
+
+                if (!files) {
+                    pthread_mutex_unlock(&cache->lock);
+                    wav_buffer_release(&mapped);
+                    return ENOMEM;
+                }
+                cache->files = files;
+                cache->capacity = capacity;
+            }
+            file = &cache->files[cache->nbFiles++];
+        }
+
+        file->device = info.st_dev;
+        file->inode = info.st_ino;
+        file->size = info.st_size;
+        file->mtime = mtime;
+        memcpy(&file->buffer, &mapped, sizeof(WavBuffer));
+    }
+
+    file->lastUse = ++cache->clock;
+    wav_buffer_retain(buffer, &file->buffer);
+    pthread_mutex_unlock(&cache->lock);
+
+    // Unmapped outside the lock too, if no buffer uses it anymore
+    wav_buffer_release(&dropped);
+    return 0;
+}
+
+
+/**
+ * @brief   Open a wav file through the process-wide cache
+ * @details The first open maps the file with wav_buffer_map, later opens
+ *          of the same file share its storage, from any thread and any
+ *          path to the file. Files modified since they were mapped are
+ *          mapped again. Up to WAV_BUFFER_CACHE_FILES files are kept, see
+ *          wav_buffer_cache_limit.
+ *
+ * @param[out]  buffer    Pointer to the buffer, to release with wav_buffer_release
+ * @param[in]   filename  String of the filename to open
+ * @returns               None
+ *
+ */
+void wav_buffer_open (WavBuffer* buffer,
+                      const char* filename)
+{
+    int status = wav_buffer_open_checked(buffer, filename);
+
+    if (status) {
+        fprintf(stderr, "Cannot open file %s: %s\n", filename,
+                status == EINVAL ? "not a 16-bit PCM wav file" : strerror(status));
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Set the number of files kept by the cache
+ * @details Above it, the least recently opened files are released by the
+ *          cache. The buffers using them stay valid, but a new open of
+ *          such a file maps it again.
+ *
+ * @param[in]   maxFiles  Number of files, from 1
+ * @returns               None
+ *
+ */
+void wav_buffer_cache_limit (size_t maxFiles)
+{
+    WavBufferCache* cache = &wav_buffer_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->maxFiles = maxFiles ? maxFiles : 1;
+
+    while (cache->nbFiles > cache->maxFiles) {
+        WavBufferFile* file = wav_buffer_cache_lru(cache);
+        wav_buffer_release(&file->buffer);
+        *file = cache->files[--cache->nbFiles];
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+/**
+ * @brief   Remove the files no longer used from the cache
+ * @details Files still used by a buffer stay cached.
+ *
+ * @returns               Number of files removed
+ *
+ */
+size_t wav_buffer_cache_purge (void)
+{
+    WavBufferCache* cache = &wav_buffer_cache;
+    size_t nbRemoved = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (size_t i = 0; i < cache->nbFiles; ) {
+        WavBufferFile* file = &cache->files[i];
+
+        if (__atomic_load_n(&file->buffer.storage->refs, __ATOMIC_ACQUIRE) == 1) {
+            wav_buffer_release(&file->buffer);
+            cache->files[i] = cache->files[--cache->nbFiles];
+            ++nbRemoved;
+        }
+        else {
+            ++i;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return nbRemoved;
+}
+
+
+/* Source reading a buffer, holding a reference on it */
+typedef struct WavBufferSource {
+    WavSource   source;
+    WavBuffer   buffer;
+} WavBufferSource;
+
+
+size_t wav_buffer_read_frames (WavSource* source,
+                               int16_t* frames,
+                               size_t nbFrames)
+{
+    WavBufferSource* bufferSource = (WavBufferSource*)source;
+    uint64_t remaining = source->nbFrames - source->position;
+
+    if (nbFrames > remaining)
+        nbFrames = remaining;
+
+    memcpy(frames, bufferSource->buffer.data + source->position * source->header.NbChannels,
+           nbFrames * source->header.BytePerChunk);
+    source->position += nbFrames;
+    return nbFrames;
+}
+
+
+void wav_buffer_seek_frame (WavSource* source,
+                            uint64_t frame)
+{
+    source->position = frame;
+}
+
+
+void wav_buffer_close_source (WavSource* source)
+{
+    WavBufferSource* bufferSource = (WavBufferSource*)source;
+
+    wav_buffer_release(&bufferSource->buffer);
+    free(bufferSource);
+}
+
+
+/**
+ * @brief   Read a buffer as a source, e.g. for the analysis functions
+ *
+ * @param[in]   buffer    Pointer to the buffer, shared by the source
+ * @returns               Pointer to the source, to close with wav_source_close
+ *
+ */
+WavSource* wav_buffer_source_open (const WavBuffer* buffer)
+{
+    WavBufferSource* bufferSource = (WavBufferSource*)calloc(1, sizeof(WavBufferSource));
+
+    if (!bufferSource) {
+        fprintf(stderr, "Cannot allocate memory for buffer source\n");
+        exit(1);
+    }
+
+    wav_buffer_retain(&bufferSource->buffer, buffer);
+    memcpy(&bufferSource->source.header, &buffer->header, sizeof(WavHeader));
+    bufferSource->source.nbFrames = buffer->nbFrames;
+    bufferSource->source.read = wav_buffer_read_frames;
+    bufferSource->source.seek = wav_buffer_seek_frame;
+    bufferSource->source.close = wav_buffer_close_source;
+
+    return &bufferSource->source;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_BUFFER_H__
@@ -0,0 +1,482 @@
+/**
+ ******************************************************************************
+ * @file     wav_cache.h
+ * @brief    Provide an on-disk cache of results derived from wav files
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_CACHE_H__
+#define __WAV_CACHE_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wav_analysis.h"
+
+/* Structure at the beginning of each cache entry file */
+typedef struct WavCacheEntryHeader {
+    char        Magic[4];       // "WCHE" Constant
+    uint32_t    Version;        // Format version (1)
+    uint64_t    Key;            // Key of the entry, checked against collisions
+    uint64_t    Size;           // Size of the cached result in bytes
+} WavCacheEntryHeader;
+
+/**
+ * @details Cache directory
+ *
+ *  Each result is stored in its own file named after the hexadecimal key.
+ *  Keys combine the identity of the source file (path, size and either
+ *  the modification time or the hash of the whole file) with the name
+ *  and parameters of the product, so a modified file never hits.
+ *  The modification time of an entry is refreshed on each hit, and the
+ *  least recently used entries are removed when the cache exceeds its budget.
+ *
+ */
+typedef struct WavCache {
+    char*       dirname;
+    uint64_t    budget;         // Maximum size of all entries in bytes
+    uint64_t    used;           // Current size of all entries in bytes
+    int         useContentHash; // Identify files by content instead of mtime
+} WavCache;
+
+
+/* Names of wav_cache_entry_path: temporary files being written are not entries */
+int wav_cache_is_entry (const char* name)
+{
+    size_t length = strspn(name, "0123456789abcdef");
+    return length == 16 && name[length] == '\0';
+}
+
+
+/**
+ * @brief   Open a cache directory, creating it if needed
+ *
+ * @param[out] cache           Pointer to the cache
+ * @param[in]  dirname         String of the cache directory
+ * @param[in]  budget          Maximum size of the cache in bytes
+ * @param[in]  useContentHash  Identify files by the hash of their content
+ * @returns                    None
+ *
+ */
+void wav_cache_open (WavCache* cache,
+                     const char* dirname,
+                     uint64_t budget,
+                     int useContentHash)
+{
+    if (mkdir(dirname, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Cannot create cache directory %s\n", dirname);
+        exit(1);
+    }
+
+    DIR* dir = opendir(dirname);
+    struct dirent* entry;
+
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open directory %s\n", dirname);
+        exit(1);
+    }
+
+    cache->dirname = strdup(dirname);
+    cache->budget = budget;
+    cache->used = 0;
+    cache->useContentHash = useContentHash;
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat info;
+        if (wav_cache_is_entry(entry->d_name) &&
+            !fstatat(dirfd(dir), entry->d_name, &info, 0) && S_ISREG(info.st_mode))
+            cache->used += info.st_size;
+    }
+
+    closedir(dir);
+}
+
+
+void wav_cache_close (WavCache* cache)
+{
+    free(cache->dirname);
+    cache->dirname = NULL;
+}
+
+
+/**
+ * @brief   Compute the key of a product of a file
+ *
+ * @param[in]  cache      Pointer to the cache
+ * @param[in]  filename   String of the source filename
+ * @param[in]  product    Name of the product ("stats", "peaks"...)
+ * @param[in]  params     Bytes of the product parameters (may be NULL)
+ * @param[in]  paramsSize Number of bytes of the parameters
+ * @returns               Key of the product
+ *
+ */
+uint64_t wav_cache_key (const WavCache* cache,
+                        const char* filename,
+                        const char* product,
+                        const void* params,
+                        size_t paramsSize)
+{
+    struct stat info;
+
+    if (stat(filename, &info)) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        exit(1);
+    }
+
+    uint64_t size = info.st_size;
+    uint64_t key = wav_hash_bytes(filename, strlen(filename) + 1, WAV_HASH_INIT);
+    key = wav_hash_bytes(&size, sizeof(size), key);
+
+    if (cache->useContentHash) {
+        FILE* stream = fopen(filename, "rb");
+        uint8_t block[1 << 16];
+        size_t nbRead;
+
+        if (stream == NULL) {
+            fprintf(stderr, "Cannot open file %s\n", filename);
+            exit(1);
+        }
+
+        while ((nbRead = fread(block, 1, sizeof(block), stream)))
+            key = wav_hash_bytes(block, nbRead, key);
+        fclose(stream);
+    }
+    else {
+        int64_t mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        key = wav_hash_bytes(&mtime, sizeof(mtime), key);
+    }
+
+    key = wav_hash_bytes(product, strlen(product) + 1, key);
+    if (params)
+        key = wav_hash_bytes(params, paramsSize, key);
+
+    return key;
+}
+
+
+void wav_cache_entry_path (const WavCache* cache,
+                           uint64_t key,
+                           char* path,
+                           size_t pathSize)
+{
+    snprintf(path, pathSize, "%s/%016llx", cache->dirname, (unsigned long long)key);
+}
+
+
+/**
+ * @brief   Get a cached result
+ *
+ * @param[in]  cache      Pointer to the cache
+ * @param[in]  key        Key given by wav_cache_key
+ * @param[out] data       Pointer to the result, to free after usage
+ * @param[out] size       Size of the result in bytes
+ * @returns               0 on a hit, -1 on a miss
+ *
+ */
+int wav_cache_get (WavCache* cache,
+                   uint64_t key,
+                   void** data,
+                   size_t* size)
+{
+    char path[4096];
+    WavCacheEntryHeader header;
+
+    wav_cache_entry_path(cache, key, path, sizeof(path));
+    FILE* stream = fopen(path, "rb");
+
+    if (stream == NULL)
+        return -1;
+
+    struct stat info;
+
+    if (!fread(&header, sizeof(WavCacheEntryHeader), 1, stream) ||
+        strncmp(header.Magic, "WCHE", 4) || header.Version != 1 || header.Key != key)
+    {
+        fclose(stream);
+        return -1;
+    }
+
+    // A size not matching the file is a corrupted entry, removed as a miss
+    if (fstat(fileno(stream), &info) ||
+        header.Size != (uint64_t)info.st_size - sizeof(WavCacheEntryHeader))
+    {
+        fclose(stream);
+        unlink(path);
+        return -1;
+    }
+
+    *data = malloc(header.Size + 1);
+
+    if (!*data) {
+        fprintf(stderr, "Cannot allocate memory for cache entry\n");
+        exit(1);
+    }
+
+    if (fread(*data, 1, header.Size, stream) != header.Size) {
+        free(*data);
+        *data = NULL;
+        fclose(stream);
+        return -1;
+    }
+
+    fclose(stream);
+    *size = header.Size;
+
+    // Mark the entry as recently used
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 0;
+}
+
+
+/* Entry considered for eviction */
+typedef struct WavCacheVictim {
+    char        name[32];
+    int64_t     mtime;
+    uint64_t    size;
+} WavCacheVictim;
+
+int wav_cache_victim_compare (const void* a,
+                              const void* b)
+{
+    const WavCacheVictim* va = (const WavCacheVictim*)a;
+    const WavCacheVictim* vb = (const WavCacheVictim*)b;
+    return (va->mtime > vb->mtime) - (va->mtime < vb->mtime);
+}
+
+
+/**
+ * @brief   Remove the least recently used entries until the cache fits its budget
+ * @details Only the entries count in the budget and are removed: the
+ *          temporary files of wav_cache_put, maybe written by other
+ *          processes, are left alone.
+ *
+ */
+void wav_cache_evict (WavCache* cache)
+{
+    DIR* dir = opendir(cache->dirname);
+    struct dirent* entry;
+    WavCacheVictim* victims = NULL;
+    size_t nbVictims = 0;
+    size_t capacity = 0;
+
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open directory %s\n", cache->dirname);
+        exit(1);
+    }
+
+    cache->used = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat info;
+
+        if (!wav_cache_is_entry(entry->d_name) ||
+            fstatat(dirfd(dir), entry->d_name, &info, 0) || !S_ISREG(info.st_mode))
+            continue;
+
+        if (nbVictims == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            victims = (WavCacheVictim*)realloc(victims, capacity * sizeof(WavCacheVictim));
+            if (!victims) {
+                fprintf(stderr, "Cannot allocate memory for cache eviction\n");
+                exit(1);
+            }
+        }
+
+        WavCacheVictim* victim = &victims[nbVictims++];
+        strcpy(victim->name, entry->d_name);
+        victim->mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        victim->size = info.st_size;
+        cache->used += info.st_size;
+    }
+
+    if (victims)
+        qsort(victims, nbVictims, sizeof(WavCacheVictim), wav_cache_victim_compare);
+
+    for (size_t i = 0; i < nbVictims && cache->used > cache->budget; ++i) {
+        if (!unlinkat(dirfd(dir), victims[i].name, 0))
+            cache->used -= victims[i].size;
+    }
+
+    closedir(dir);
+    free(victims);
+}
+
+
+/**
+ * @brief   Store a result in the cache
+ * @details The entry is written to a temporary file then renamed, so
+ *          concurrent readers never see a partial entry.
+ *
+ * @param[in]  cache      Pointer to the cache
+ * @param[in]  key        Key given by wav_cache_key
+ * @param[in]  data       Pointer to the result
+ * @param[in]  size       Size of the result in bytes
+ * @returns               None
+ *
+ */
+void wav_cache_put (WavCache* cache,
+                    uint64_t key,
+                    const void* data,
+                    size_t size)
+{
+    char path[4096];
+    char tmpPath[4096 + 32];
+    WavCacheEntryHeader header;
+
+    wav_cache_entry_path(cache, key, path, sizeof(path));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%ld", path, (long)getpid());
+
+    FILE* stream = fopen(tmpPath, "wb");
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", tmpPath);
+        exit(1);
+    }
+
+    memcpy(header.Magic, "WCHE", 4);
+    header.Version = 1;
+    header.Key = key;
+    header.Size = size;
+
+    if (!fwrite(&header, sizeof(WavCacheEntryHeader), 1, stream) ||
+        (size && !fwrite(data, size, 1, stream)))
+    {
+        fprintf(stderr, "Cannot write cache entry into stream\n");
+        exit(1);
+    }
+
+    if (fclose(stream) == EOF || rename(tmpPath, path)) {
+        fprintf(stderr, "Cannot store cache entry %s\n", path);
+        exit(1);
+    }
+
+    cache->used += sizeof(WavCacheEntryHeader) + size;
+    if (cache->used > cache->budget)
+        wav_cache_evict(cache);
+}
+
+
+/**
+ * @brief   Get the statistics of a file, computing them on a miss
+ *
+ */
+void wav_cache_stats (WavCache* cache,
+                      const char* filename,
+                      WavStats* stats)
+{
+    uint64_t key = wav_cache_key(cache, filename, "stats", NULL, 0);
+    void* data = NULL;
+    size_t size;
+
+    if (!wav_cache_get(cache, key, &data, &size) && size == sizeof(WavStats)) {
+        memcpy(stats, data, sizeof(WavStats));
+        free(data);
+        return;
+    }
+    free(data);
+
+    WavReader* reader = wav_reader_open(filename);
+    wav_stats_compute(&reader->source, stats);
+    wav_source_close(&reader->source);
+
+    wav_cache_put(cache, key, stats, sizeof(WavStats));
+}
+
+
+/**
+ * @brief   Get the min/max overview of a file, computing it on a miss
+ *
+ */
+void wav_cache_peaks (WavCache* cache,
+                      const char* filename,
+                      uint32_t binFrames,
+                      WavPeaks* peaks)
+{
+    uint64_t key = wav_cache_key(cache, filename, "peaks", &binFrames, sizeof(binFrames));
+    void* data = NULL;
+    size_t size;
+
+    if (!wav_cache_get(cache, key, &data, &size) && size >= sizeof(WavPeaks)) {
+        memcpy(peaks, data, sizeof(WavPeaks));
+        size_t dataSize = peaks->nbBins * peaks->nbChannels * 2 * sizeof(int16_t);
+
+        if (size == sizeof(WavPeaks) + dataSize) {
+            peaks->data = (int16_t*)malloc(dataSize + 1);
+            if (!peaks->data) {
+                fprintf(stderr, "Cannot allocate memory for peaks\n");
+                exit(1);
+            }
+            memcpy(peaks->data, (uint8_t*)data + sizeof(WavPeaks), dataSize);
+            free(data);
+            return;
+        }
+    }
+    free(data);
+
+    WavReader* reader = wav_reader_open(filename);
+    wav_peaks_compute(&reader->source, binFrames, peaks);
+    wav_source_close(&reader->source);
+
+    // Entry is the structure followed by the min/max values
+    size_t dataSize = peaks->nbBins * peaks->nbChannels * 2 * sizeof(int16_t);
+    uint8_t* entry = (uint8_t*)malloc(sizeof(WavPeaks) + dataSize);
+
+    if (!entry) {
+        fprintf(stderr, "Cannot allocate memory for cache entry\n");
+        exit(1);
+    }
+
+    memcpy(entry, peaks, sizeof(WavPeaks));
+    memcpy(entry + sizeof(WavPeaks), peaks->data, dataSize);
+    wav_cache_put(cache, key, entry, sizeof(WavPeaks) + dataSize);
+    free(entry);
+}
+
+
+/**
+ * @brief   Get the hash of the samples of a file, computing it on a miss
+ *
+ */
+uint64_t wav_cache_hash (WavCache* cache,
+                         const char* filename)
+{
+    uint64_t key = wav_cache_key(cache, filename, "hash", NULL, 0);
+    uint64_t hash;
+    void* data = NULL;
+    size_t size;
+
+    if (!wav_cache_get(cache, key, &data, &size) && size == sizeof(uint64_t)) {
+        memcpy(&hash, data, sizeof(uint64_t));
+        free(data);
+        return hash;
+    }
+    free(data);
+
+    WavReader* reader = wav_reader_open(filename);
+    hash = wav_hash_source(&reader->source);
+    wav_source_close(&reader->source);
+
+    wav_cache_put(cache, key, &hash, sizeof(uint64_t));
+    return hash;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_CACHE_H__
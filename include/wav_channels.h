@@ -0,0 +1,194 @@
+/**
+ ******************************************************************************
+ * @file     wav_channels.h
+ * @brief    Provide speaker layouts and channel reorder/remap of frames
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_CHANNELS_H__
+#define __WAV_CHANNELS_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "wav_stream.h"
+
+/* Speaker positions of dwChannelMask, in the order of the channels of a file */
+#define WAV_SPEAKER_FRONT_LEFT              0x1
+#define WAV_SPEAKER_FRONT_RIGHT             0x2
+#define WAV_SPEAKER_FRONT_CENTER            0x4
+#define WAV_SPEAKER_LOW_FREQUENCY           0x8
+#define WAV_SPEAKER_BACK_LEFT               0x10
+#define WAV_SPEAKER_BACK_RIGHT              0x20
+#define WAV_SPEAKER_FRONT_LEFT_OF_CENTER    0x40
+#define WAV_SPEAKER_FRONT_RIGHT_OF_CENTER   0x80
+#define WAV_SPEAKER_BACK_CENTER             0x100
+#define WAV_SPEAKER_SIDE_LEFT               0x200
+#define WAV_SPEAKER_SIDE_RIGHT              0x400
+
+/* Maximum number of channels of a layout or a map */
+#define WAV_CHANNELS_MAX 32
+
+/* Speaker position of each channel, in file order */
+typedef struct WavLayout {
+    unsigned    nbChannels;
+    uint32_t    speakers[WAV_CHANNELS_MAX];
+} WavLayout;
+
+/**
+ * @details Output channel c is input channel source[c], or silence if
+ *          source[c] is negative. Input channels may be used several
+ *          times (duplicated) or not at all (dropped).
+ *
+ */
+typedef struct WavChannelMap {
+    unsigned    nbInputs;
+    unsigned    nbOutputs;
+    int         source[WAV_CHANNELS_MAX];
+} WavChannelMap;
+
+/* 5.1 orders: SMPTE/ITU (L R C LFE Ls Rs, the order of the channel mask)
+   and Film (L C R Ls Rs LFE) */
+const WavLayout wav_layout_51_smpte = { 6, {
+    WAV_SPEAKER_FRONT_LEFT, WAV_SPEAKER_FRONT_RIGHT, WAV_SPEAKER_FRONT_CENTER,
+    WAV_SPEAKER_LOW_FREQUENCY, WAV_SPEAKER_BACK_LEFT, WAV_SPEAKER_BACK_RIGHT } };
+
+const WavLayout wav_layout_51_film = { 6, {
+    WAV_SPEAKER_FRONT_LEFT, WAV_SPEAKER_FRONT_CENTER, WAV_SPEAKER_FRONT_RIGHT,
+    WAV_SPEAKER_BACK_LEFT, WAV_SPEAKER_BACK_RIGHT, WAV_SPEAKER_LOW_FREQUENCY } };
+
+
+/**
+ * @brief   Get the layout of a channel mask
+ * @details Channels of an extensible file follow the order of the bits of
+ *          its mask. Channels beyond the bits of the mask have no position.
+ *
+ * @param[out]  layout      Pointer to the layout
+ * @param[in]   mask        dwChannelMask, see WavReader.channelMask
+ * @param[in]   nbChannels  Number of channels of the file
+ * @returns                 None
+ *
+ */
+void wav_layout_from_mask (WavLayout* layout,
+                           uint32_t mask,
+                           unsigned nbChannels)
+{
+    if (nbChannels > WAV_CHANNELS_MAX) {
+        fprintf(stderr, "Only %d channels supported by layouts\n", WAV_CHANNELS_MAX);
+        exit(1);
+    }
+
+    layout->nbChannels = nbChannels;
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        uint32_t speaker = mask & -mask;
+        layout->speakers[c] = speaker;
+        mask &= ~speaker;
+    }
+}
+
+
+/**
+ * @brief   Build the map converting a layout into another one
+ * @details Speakers missing from the input are silent, speakers missing
+ *          from the output are dropped.
+ *
+ * @param[out]  map      Pointer to the channel map
+ * @param[in]   input    Pointer to the layout of the input frames
+ * @param[in]   output   Pointer to the layout of the output frames
+ * @returns              None
+ *
+ */
+void wav_channel_map_from_layouts (WavChannelMap* map,
+                                   const WavLayout* input,
+                                   const WavLayout* output)
+{
+    map->nbInputs = input->nbChannels;
+    map->nbOutputs = output->nbChannels;
+
+    for (unsigned c = 0; c < output->nbChannels; ++c) {
+        map->source[c] = -1;
+        for (unsigned i = 0; i < input->nbChannels; ++i) {
+            if (output->speakers[c] && input->speakers[i] == output->speakers[c]) {
+                map->source[c] = i;
+                break;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief   Reorder, drop, duplicate or silence the channels of frames
+ * @details With SSSE3 (make MODE=native), maps between up to 8 channels
+ *          shuffle a whole frame with one byte shuffle, silent channels
+ *          being zeroed by the shuffle itself. Other maps and the last
+ *          frames are copied sample by sample.
+ *
+ * @param[out]  dst       Frames of map->nbOutputs channels, not overlapping src
+ * @param[in]   src       Frames of map->nbInputs channels
+ * @param[in]   nbFrames  Number of frames
+ * @param[in]   map       Pointer to the channel map
+ * @returns               None
+ *
+ */
+void wav_remap_frames (int16_t* dst,
+                       const int16_t* src,
+                       size_t nbFrames,
+                       const WavChannelMap* map)
+{
+    unsigned nbInputs = map->nbInputs;
+    unsigned nbOutputs = map->nbOutputs;
+    size_t i = 0;
+
+#ifdef __SSSE3__
+    if (nbInputs <= 8 && nbOutputs <= 8) {
+        int8_t bytes[16];
+
+        // 16-byte loads and stores must stay in both buffers
+        size_t nbLoads = nbFrames > 8 / nbInputs ? nbFrames - 8 / nbInputs : 0;
+        size_t nbStores = nbFrames > 8 / nbOutputs ? nbFrames - 8 / nbOutputs : 0;
+        size_t nbVector = nbLoads < nbStores ? nbLoads : nbStores;
+
+        memset(bytes, 0x80, sizeof(bytes));
+        for (unsigned c = 0; c < nbOutputs; ++c) {
+            if (map->source[c] >= 0) {
+                bytes[2 * c] = 2 * map->source[c];
+                bytes[2 * c + 1] = 2 * map->source[c] + 1;
+            }
+        }
+        __m128i shuffle = _mm_loadu_si128((const __m128i*)bytes);
+
+        // Each store also writes past the frame, overwritten by the next one
+        for (; i < nbVector; ++i) {
+            __m128i frame = _mm_loadu_si128((const __m128i*)(src + i * nbInputs));
+            _mm_storeu_si128((__m128i*)(dst + i * nbOutputs), _mm_shuffle_epi8(frame, shuffle));
+        }
+    }
+#endif
+
+    for (; i < nbFrames; ++i) {
+        const int16_t* in = src + i * nbInputs;
+        int16_t* out = dst + i * nbOutputs;
+        for (unsigned c = 0; c < nbOutputs; ++c)
+            out[c] = map->source[c] >= 0 ? in[map->source[c]] : 0;
+    }
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_CHANNELS_H__
@@ -0,0 +1,353 @@
+/**
+ ******************************************************************************
+ * @file     wav_compare.h
+ * @brief    Compare the samples of two wav sources: mismatches, errors and SNR
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_COMPARE_H__
+#define __WAV_COMPARE_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wav_analysis.h"
+
+/* Frame of WavDiff.firstFrame when no sample differs */
+#define WAV_DIFF_NONE UINT64_MAX
+
+/* Number of samples accumulated in 16-bit vector lanes before folding them */
+#define WAV_DIFF_CHUNK 32768
+
+/* Differences of one channel */
+typedef struct WavChannelDiff {
+    uint64_t    nbDiffs;            // Samples that differ
+    uint32_t    maxError;           // Largest absolute difference
+    uint64_t    maxErrorFrame;      // First frame of the largest difference
+    uint64_t    sumSquaredErrors;   // Exact up to 2^32 differing samples
+    uint64_t    sumSquares;         // Of the reference, exact up to 2^34 samples
+    double      rmsError;           // Set by wav_diff_finish, in sample units
+    double      snr;                // Set by wav_diff_finish, in dB, INFINITY if equal
+} WavChannelDiff;
+
+/**
+ * @details The first source is the reference: its energy gives the
+ *          signal of the signal-to-noise ratios. Only the frames of both
+ *          sources are compared, extra frames only count in the lengths.
+ *
+ */
+typedef struct WavDiff {
+    uint64_t        nbFrames;       // Frames compared
+    uint64_t        lengthA;        // Frames of the reference
+    uint64_t        lengthB;        // Frames of the compared source
+    uint64_t        firstFrame;     // First differing frame, WAV_DIFF_NONE if none
+    unsigned        firstChannel;   // Channel of the first difference
+    int16_t         firstA;         // Samples of the first difference
+    int16_t         firstB;
+    int             formatMismatch; // Different channels or rates: nothing compared
+    uint16_t        nbChannels;
+    WavChannelDiff  channels[WAV_STATS_MAX_CHANNELS];
+} WavDiff;
+
+
+void wav_diff_init (WavDiff* diff,
+                    uint16_t nbChannels)
+{
+    if (nbChannels > WAV_STATS_MAX_CHANNELS) {
+        fprintf(stderr, "Only %d channels supported by comparisons\n", WAV_STATS_MAX_CHANNELS);
+        exit(1);
+    }
+
+    memset(diff, 0, sizeof(WavDiff));
+    diff->nbChannels = nbChannels;
+    diff->firstFrame = WAV_DIFF_NONE;
+}
+
+
+/* Account one sample of the scalar path */
+void wav_diff_sample (WavDiff* diff,
+                      size_t index,
+                      int16_t a,
+                      int16_t b)
+{
+    unsigned channel = index % diff->nbChannels;
+    WavChannelDiff* stats = &diff->channels[channel];
+    uint32_t error = a > b ? a - b : b - a;
+
+    stats->sumSquares += (int32_t)a * a;
+    if (error == 0)
+        return;
+
+    uint64_t frame = diff->nbFrames + index / diff->nbChannels;
+    if (diff->firstFrame == WAV_DIFF_NONE) {
+        diff->firstFrame = frame;
+        diff->firstChannel = channel;
+        diff->firstA = a;
+        diff->firstB = b;
+    }
+
+    stats->nbDiffs++;
+    stats->sumSquaredErrors += (uint64_t)error * error;
+    if (error > stats->maxError) {
+        stats->maxError = error;
+        stats->maxErrorFrame = frame;
+    }
+}
+
+
+#ifdef __SSE2__
+/**
+ * @details Sample i of a chunk is in lane i % 8 of the vectors, which
+ *          always holds the same channel when the number of channels
+ *          divides 8. Errors are unsigned 16-bit absolute differences
+ *          and their squares 32-bit unsigned products, accumulated in
+ *          64-bit lanes.
+ *
+ */
+void wav_diff_chunk_sse2 (WavDiff* diff,
+                          const int16_t* a,
+                          const int16_t* b,
+                          size_t start,
+                          size_t count)
+{
+    const __m128i bias = _mm_set1_epi16((int16_t)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i equal = zero;           // Equal samples, negated
+    __m128i maximum = _mm_set1_epi16((int16_t)0x8000);  // Biased maximum error
+    __m128i errors[4] = { zero, zero, zero, zero };     // Lanes 0-1, 2-3, 4-5, 6-7
+    __m128i squares[4] = { zero, zero, zero, zero };
+    unsigned nbChannels = diff->nbChannels;
+
+    for (size_t i = start; i < start + count; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i same = _mm_cmpeq_epi16(va, vb);
+
+        if (diff->firstFrame == WAV_DIFF_NONE && _mm_movemask_epi8(same) != 0xFFFF) {
+            unsigned lane = __builtin_ctz(~_mm_movemask_epi8(same)) / 2;
+            diff->firstFrame = diff->nbFrames + (i + lane) / nbChannels;
+            diff->firstChannel = (i + lane) % nbChannels;
+            diff->firstA = a[i + lane];
+            diff->firstB = b[i + lane];
+        }
+        equal = _mm_sub_epi16(equal, same);
+
+        // |a - b| on 16 bits unsigned from saturated differences of biased samples
+        __m128i ua = _mm_xor_si128(va, bias);
+        __m128i ub = _mm_xor_si128(vb, bias);
+        __m128i error = _mm_or_si128(_mm_subs_epu16(ua, ub), _mm_subs_epu16(ub, ua));
+        maximum = _mm_max_epi16(maximum, _mm_xor_si128(error, bias));
+
+        __m128i low = _mm_mullo_epi16(error, error);
+        __m128i high = _mm_mulhi_epu16(error, error);
+        __m128i error03 = _mm_unpacklo_epi16(low, high);
+        __m128i error47 = _mm_unpackhi_epi16(low, high);
+        errors[0] = _mm_add_epi64(errors[0], _mm_unpacklo_epi32(error03, zero));
+        errors[1] = _mm_add_epi64(errors[1], _mm_unpackhi_epi32(error03, zero));
+        errors[2] = _mm_add_epi64(errors[2], _mm_unpacklo_epi32(error47, zero));
+        errors[3] = _mm_add_epi64(errors[3], _mm_unpackhi_epi32(error47, zero));
+
+        low = _mm_mullo_epi16(va, va);
+        high = _mm_mulhi_epi16(va, va);
+        __m128i square03 = _mm_unpacklo_epi16(low, high);
+        __m128i square47 = _mm_unpackhi_epi16(low, high);
+        squares[0] = _mm_add_epi64(squares[0], _mm_unpacklo_epi32(square03, zero));
+        squares[1] = _mm_add_epi64(squares[1], _mm_unpackhi_epi32(square03, zero));
+        squares[2] = _mm_add_epi64(squares[2], _mm_unpacklo_epi32(square47, zero));
+        squares[3] = _mm_add_epi64(squares[3], _mm_unpackhi_epi32(square47, zero));
+    }
+
+    uint16_t equalLanes[8];
+    uint16_t maximumLanes[8];
+    uint64_t errorLanes[8];
+    uint64_t squareLanes[8];
+    _mm_storeu_si128((__m128i*)equalLanes, equal);
+    _mm_storeu_si128((__m128i*)maximumLanes, _mm_xor_si128(maximum, bias));
+    for (unsigned v = 0; v < 4; ++v) {
+        _mm_storeu_si128((__m128i*)(errorLanes + 2 * v), errors[v]);
+        _mm_storeu_si128((__m128i*)(squareLanes + 2 * v), squares[v]);
+    }
+
+    uint64_t chunkFrame = diff->nbFrames + start / nbChannels;
+
+    for (unsigned lane = 0; lane < 8; ++lane) {
+        unsigned channel = lane % nbChannels;
+        WavChannelDiff* stats = &diff->channels[channel];
+
+        stats->nbDiffs += count / 8 - equalLanes[lane];
+        stats->sumSquaredErrors += errorLanes[lane];
+        stats->sumSquares += squareLanes[lane];
+
+        // Rare: find the first frame of a new maximum, or of a maximum
+        // found by another lane of the channel in this chunk
+        if (maximumLanes[lane] > stats->maxError ||
+            (maximumLanes[lane] == stats->maxError && stats->maxError &&
+             stats->maxErrorFrame >= chunkFrame))
+        {
+            uint32_t target = maximumLanes[lane];
+            for (size_t i = start + lane; i < start + count; i += 8) {
+                uint32_t error = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+                if (error == target) {
+                    uint64_t frame = diff->nbFrames + i / nbChannels;
+                    if (target > stats->maxError || frame < stats->maxErrorFrame) {
+                        stats->maxError = target;
+                        stats->maxErrorFrame = frame;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+#endif
+
+
+/**
+ * @brief   Compare interleaved frames and accumulate their differences
+ * @details With SSE2, layouts of 1, 2, 4 or 8 channels are compared 8
+ *          samples at a time, the others sample by sample.
+ *
+ * @param[in,out] diff      Pointer to the differences
+ * @param[in]     a         Frames of the reference
+ * @param[in]     b         Frames compared to the reference
+ * @param[in]     nbFrames  Number of frames
+ * @returns                 None
+ *
+ */
+void wav_diff_update (WavDiff* diff,
+                      const int16_t* a,
+                      const int16_t* b,
+                      size_t nbFrames)
+{
+    size_t count = nbFrames * diff->nbChannels;
+    size_t i = 0;
+
+    WAV_TRACE_BEGIN("diff");
+#ifdef __SSE2__
+    if (8 % diff->nbChannels == 0) {
+        for (; i + 8 <= count; ) {
+            size_t length = (count - i) & ~(size_t)7;
+            length = length < WAV_DIFF_CHUNK ? length : WAV_DIFF_CHUNK;
+            wav_diff_chunk_sse2(diff, a, b, i, length);
+            i += length;
+        }
+    }
+#endif
+
+    for (; i < count; ++i)
+        wav_diff_sample(diff, i, a[i], b[i]);
+
+    diff->nbFrames += nbFrames;
+    WAV_TRACE_END("diff");
+}
+
+
+/**
+ * @brief   Compute the rms errors and SNRs once all frames were compared
+ *
+ */
+void wav_diff_finish (WavDiff* diff)
+{
+    for (unsigned c = 0; c < diff->nbChannels; ++c) {
+        WavChannelDiff* stats = &diff->channels[c];
+
+        stats->rmsError = diff->nbFrames ? sqrt((double)stats->sumSquaredErrors / diff->nbFrames) : 0.0;
+        stats->snr = stats->sumSquaredErrors ?
+                     10.0 * log10((double)stats->sumSquares / stats->sumSquaredErrors) : INFINITY;
+    }
+}
+
+
+/**
+ * @brief   Check if a comparison found any difference
+ *
+ */
+int wav_diff_differs (const WavDiff* diff)
+{
+    return diff->formatMismatch || diff->firstFrame != WAV_DIFF_NONE ||
+           diff->lengthA != diff->lengthB;
+}
+
+
+/**
+ * @brief   Compare two sources, reading both block by block
+ * @details With @p stopAtFirst, the comparison stops at the block of the
+ *          first difference: the errors then cover the frames compared
+ *          so far, and the lengths are those announced by the sources.
+ *
+ * @param[in]   a            Pointer to the reference source, read from its first frame
+ * @param[in]   b            Pointer to the compared source, read from its first frame
+ * @param[in]   stopAtFirst  1 to stop at the first difference
+ * @param[out]  diff         Pointer to the differences
+ * @returns                  None
+ *
+ */
+void wav_diff_sources (WavSource* a,
+                       WavSource* b,
+                       int stopAtFirst,
+                       WavDiff* diff)
+{
+    wav_diff_init(diff, a->header.NbChannels);
+
+    if (a->header.NbChannels != b->header.NbChannels ||
+        a->header.SampleRate != b->header.SampleRate)
+    {
+        diff->formatMismatch = 1;
+        diff->lengthA = a->nbFrames;
+        diff->lengthB = b->nbFrames;
+        return;
+    }
+
+    int16_t* blockA = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * a->header.BytePerChunk);
+    int16_t* blockB = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * b->header.BytePerChunk);
+
+    if (!blockA || !blockB) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    wav_source_seek(a, 0);
+    wav_source_seek(b, 0);
+
+    for (;;) {
+        size_t nbReadA = wav_source_read(a, blockA, WAV_ANALYSIS_BLOCK);
+        size_t nbReadB = wav_source_read(b, blockB, WAV_ANALYSIS_BLOCK);
+        size_t nbFrames = nbReadA < nbReadB ? nbReadA : nbReadB;
+
+        diff->lengthA += nbReadA;
+        diff->lengthB += nbReadB;
+        wav_diff_update(diff, blockA, blockB, nbFrames);
+
+        // Without stopAtFirst, the longer source is read to its end to count its frames
+        if (nbReadA == 0 && nbReadB == 0)
+            break;
+        if (stopAtFirst && (diff->firstFrame != WAV_DIFF_NONE || nbReadA != nbReadB)) {
+            diff->lengthA = a->nbFrames != WAV_UNKNOWN_FRAMES ? a->nbFrames : diff->lengthA;
+            diff->lengthB = b->nbFrames != WAV_UNKNOWN_FRAMES ? b->nbFrames : diff->lengthB;
+            break;
+        }
+    }
+
+    wav_diff_finish(diff);
+    free(blockA);
+    free(blockB);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_COMPARE_H__
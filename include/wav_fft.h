@@ -0,0 +1,263 @@
+/**
+ ******************************************************************************
+ * @file     wav_fft.h
+ * @brief    Provide radix-2 complex and real fast Fourier transforms
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_FFT_H__
+#define __WAV_FFT_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <math.h>
+
+#include "wav.h"
+
+/**
+ * @details Plan of the transforms of a power-of-two size N. Complex data
+ *          is stored as interleaved (re, im) floats. Real transforms go
+ *          through a complex transform of N/2 points, their spectra hold
+ *          the N/2 + 1 bins from 0 to the Nyquist frequency.
+ *
+ *          The twiddles of each stage of the complex transform are stored
+ *          one after the other, so butterflies read them contiguously.
+ *
+ */
+typedef struct WavFft {
+    size_t      size;           // Real size N
+    size_t      half;           // Size N/2 of the complex transform
+    float*      twiddles;       // Stage of h butterflies at [h - 1, 2h - 1): exp(-i pi k / h)
+    float*      realTwiddles;   // exp(-2 i pi k / N), k < N/2
+    uint32_t*   reverse;        // Bit reversal permutation of N/2 points
+} WavFft;
+
+
+/**
+ * @brief   Get the smallest power of two not below a size
+ *
+ */
+size_t wav_fft_size (size_t size)
+{
+    size_t power = 4;
+    while (power < size)
+        power <<= 1;
+    return power;
+}
+
+
+/**
+ * @brief   Prepare the transforms of a size
+ *
+ * @param[out]  fft       Pointer to the plan, to free with wav_fft_free
+ * @param[in]   size      Real size N, power of two from 4
+ * @returns               None
+ *
+ */
+void wav_fft_init (WavFft* fft,
+                   size_t size)
+{
+    size_t half = size / 2;
+    unsigned bits = 0;
+
+    if (size < 4 || (size & (size - 1)) || size > ((size_t)1 << 32)) {
+        fprintf(stderr, "FFT size must be a power of two from 4 to 2^32\n");
+        exit(1);
+    }
+
+    while (((size_t)1 << bits) < half)
+        ++bits;
+
+    fft->size = size;
+    fft->half = half;
+    fft->twiddles = (float*)malloc(2 * half * sizeof(float));
+    fft->realTwiddles = (float*)malloc(2 * half * sizeof(float));
+    fft->reverse = (uint32_t*)malloc(half * sizeof(uint32_t));
+
+    if (!fft->twiddles || !fft->realTwiddles || !fft->reverse) {
+        fprintf(stderr, "Cannot allocate memory for FFT\n");
+        exit(1);
+    }
+
+    for (size_t h = 1; h < half; h <<= 1) {
+        for (size_t k = 0; k < h; ++k) {
+            fft->twiddles[2 * (h - 1 + k)] = cos(M_PI * k / h);
+            fft->twiddles[2 * (h - 1 + k) + 1] = -sin(M_PI * k / h);
+        }
+    }
+
+    for (size_t k = 0; k < half; ++k) {
+        fft->realTwiddles[2 * k] = cos(2 * M_PI * k / size);
+        fft->realTwiddles[2 * k + 1] = -sin(2 * M_PI * k / size);
+    }
+
+    for (size_t i = 0; i < half; ++i) {
+        uint32_t reversed = 0;
+        for (unsigned b = 0; b < bits; ++b)
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        fft->reverse[i] = reversed;
+    }
+}
+
+
+void wav_fft_free (WavFft* fft)
+{
+    free(fft->twiddles);
+    free(fft->realTwiddles);
+    free(fft->reverse);
+    memset(fft, 0, sizeof(WavFft));
+}
+
+
+/**
+ * @brief   Transform N/2 complex points in place
+ * @details The inverse transform is not scaled: a forward then inverse
+ *          transform multiplies the data by N/2.
+ *
+ * @param[in]     fft       Pointer to the plan
+ * @param[in,out] data      N/2 interleaved complex points
+ * @param[in]     inverse   0 for the forward transform, 1 for the inverse one
+ * @returns                 None
+ *
+ */
+void wav_fft_complex (const WavFft* fft,
+                      float* data,
+                      int inverse)
+{
+    size_t n = fft->half;
+    float sign = inverse ? -1.0f : 1.0f;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = fft->reverse[i];
+        if (i < j) {
+            float re = data[2 * i], im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    for (size_t h = 1; h < n; h <<= 1) {
+        const float* twiddles = fft->twiddles + 2 * (h - 1);
+
+        for (size_t start = 0; start < n; start += 2 * h) {
+            float* a = data + 2 * start;
+            float* b = a + 2 * h;
+
+            for (size_t k = 0; k < h; ++k) {
+                float wr = twiddles[2 * k];
+                float wi = sign * twiddles[2 * k + 1];
+                float tr = b[2 * k] * wr - b[2 * k + 1] * wi;
+                float ti = b[2 * k] * wi + b[2 * k + 1] * wr;
+
+                b[2 * k] = a[2 * k] - tr;
+                b[2 * k + 1] = a[2 * k + 1] - ti;
+                a[2 * k] += tr;
+                a[2 * k + 1] += ti;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief   Transform N real samples into their N/2 + 1 complex bins
+ *
+ * @param[in]   fft       Pointer to the plan
+ * @param[in]   input     N real samples
+ * @param[out]  spectrum  N + 2 floats: bins 0 to N/2, may not overlap input
+ * @returns               None
+ *
+ */
+void wav_fft_forward (const WavFft* fft,
+                      const float* input,
+                      float* spectrum)
+{
+    size_t n = fft->half;
+
+    // Even samples as real parts, odd samples as imaginary parts
+    memcpy(spectrum, input, fft->size * sizeof(float));
+    wav_fft_complex(fft, spectrum, 0);
+
+    // Bins k and n - k are computed together from Z[k] and Z[n - k]
+    float zr = spectrum[0], zi = spectrum[1];
+    spectrum[0] = zr + zi;
+    spectrum[1] = 0.0f;
+    spectrum[2 * n] = zr - zi;
+    spectrum[2 * n + 1] = 0.0f;
+
+    for (size_t k = 1; k <= n / 2; ++k) {
+        float ar = spectrum[2 * k], ai = spectrum[2 * k + 1];
+        float br = spectrum[2 * (n - k)], bi = spectrum[2 * (n - k) + 1];
+
+        // Even part (Z[k] + conj Z[n-k]) / 2, odd part (Z[k] - conj Z[n-k]) / 2i
+        float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+        float or_ = 0.5f * (ai + bi), oi = -0.5f * (ar - br);
+        float wr = fft->realTwiddles[2 * k], wi = fft->realTwiddles[2 * k + 1];
+        float tr = or_ * wr - oi * wi, ti = or_ * wi + oi * wr;
+
+        spectrum[2 * k] = er + tr;
+        spectrum[2 * k + 1] = ei + ti;
+        // X[n - k] = conj(E[k]) - conj(W[k] O[k])
+        spectrum[2 * (n - k)] = er - tr;
+        spectrum[2 * (n - k) + 1] = ti - ei;
+    }
+}
+
+
+/**
+ * @brief   Transform N/2 + 1 complex bins back into N real samples
+ * @details The transform is not scaled: the samples come out multiplied by N.
+ *
+ * @param[in]   fft       Pointer to the plan
+ * @param[in]   spectrum  N + 2 floats: bins 0 to N/2
+ * @param[out]  output    N real samples, may be the spectrum itself
+ * @returns               None
+ *
+ */
+void wav_fft_inverse (const WavFft* fft,
+                      const float* spectrum,
+                      float* output)
+{
+    size_t n = fft->half;
+    float xr = spectrum[0], nr = spectrum[2 * n];
+
+    // Rebuild Z[k] = E[k] + i O[k] for k and n - k together
+    for (size_t k = 1; k <= n / 2; ++k) {
+        float ar = spectrum[2 * k], ai = spectrum[2 * k + 1];
+        float br = spectrum[2 * (n - k)], bi = spectrum[2 * (n - k) + 1];
+
+        // E = X[k] + conj X[n-k], O = (X[k] - conj X[n-k]) exp(2 i pi k / N)
+        float er = ar + br, ei = ai - bi;
+        float dr = ar - br, di = ai + bi;
+        float wr = fft->realTwiddles[2 * k], wi = -fft->realTwiddles[2 * k + 1];
+        float or_ = dr * wr - di * wi, oi = dr * wi + di * wr;
+
+        output[2 * k] = er - oi;
+        output[2 * k + 1] = ei + or_;
+        output[2 * (n - k)] = er + oi;
+        output[2 * (n - k) + 1] = or_ - ei;
+    }
+
+    output[0] = xr + nr;
+    output[1] = xr - nr;
+
+    wav_fft_complex(fft, output, 1);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_FFT_H__
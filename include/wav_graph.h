@@ -0,0 +1,695 @@
+/**
+ ******************************************************************************
+ * @file     wav_graph.h
+ * @brief    Provide lazy processing chains fusing element-wise stages
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_GRAPH_H__
+#define __WAV_GRAPH_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <math.h>
+
+#include "wav_stream.h"
+
+/* Number of frames going through the stages at once, small enough for
+   the blocks of a segment to stay in L1 cache */
+#define WAV_GRAPH_BLOCK 256
+
+/* Maximum number of element-wise stages in a segment */
+#define WAV_GRAPH_MAX_OPS 16
+
+/* Maximum number of segments, i.e. of stateful stages plus one */
+#define WAV_GRAPH_MAX_SEGMENTS 8
+
+/* Element-wise stages */
+enum { WAV_GRAPH_GAIN, WAV_GRAPH_MIX, WAV_GRAPH_CLIP, WAV_GRAPH_DITHER };
+
+typedef struct WavGraphOp {
+    int         type;
+    unsigned    nbInputs;
+    unsigned    nbOutputs;
+    float       gain;
+    float*      matrix;         // Mix coefficients [nbOutputs][nbInputs]
+} WavGraphOp;
+
+/**
+ * @details A segment is a producer (the input source or a resampler)
+ *          followed by element-wise stages. The stages of a segment run
+ *          one after the other on a block of WAV_GRAPH_BLOCK frames, so
+ *          samples are loaded from memory once per segment, whatever the
+ *          number of stages. Resamplers keep state across blocks: they
+ *          end a segment and start a new one.
+ *
+ */
+typedef struct WavGraphSegment {
+    unsigned    nbChannels;     // Channels delivered by the producer
+    unsigned    outChannels;    // Channels after the stages
+    unsigned    maxChannels;    // Largest channel count of the segment
+    uint32_t    sampleRate;     // Output rate of the producer
+    uint64_t    nbFrames;       // Output length, WAV_UNKNOWN_FRAMES if unknown
+
+    WavGraphOp  ops[WAV_GRAPH_MAX_OPS];
+    unsigned    nbOps;
+    float*      buffers[2];     // Blocks of maxChannels channels, swapped by mixes
+    int16_t*    samples;        // Input segment: block read from the source
+
+    // Resampling segment: linear interpolation between prev and next
+    uint32_t    inRate;
+    uint32_t    phase;          // Position after prev, in 1/sampleRate of input frames
+    float*      prev;
+    float*      next;
+    int         hasPrev;
+    int         hasNext;
+    int         started;
+    const float* upstream;      // Block of the previous segment being consumed
+    size_t      upstreamFrames;
+    size_t      upstreamIndex;
+} WavGraphSegment;
+
+typedef struct WavGraph {
+    WavSource       source;     // 16-bit output of the graph
+    WavSource*      input;      // Owned source, closed with the graph
+    WavGraphSegment segments[WAV_GRAPH_MAX_SEGMENTS];
+    unsigned        nbSegments;
+    uint64_t        dither;     // State of the dither noise generator
+    int             running;    // Stages can only be added before the first read
+
+    const float*    block;      // Output block not delivered yet
+    size_t          blockFrames;
+    size_t          blockIndex;
+} WavGraph;
+
+
+/* Last segment, where the stages are appended */
+WavGraphSegment* wav_graph_tail (WavGraph* graph)
+{
+    return &graph->segments[graph->nbSegments - 1];
+}
+
+
+/* Refresh the output format after a stage was added */
+void wav_graph_update_format (WavGraph* graph)
+{
+    WavGraphSegment* segment = wav_graph_tail(graph);
+    uint64_t dataSize = segment->nbFrames * segment->outChannels * sizeof(int16_t);
+
+    if (segment->nbFrames == WAV_UNKNOWN_FRAMES || dataSize > UINT32_MAX)
+        dataSize = 0;
+
+    wav_header_init(&graph->source.header, segment->outChannels, segment->sampleRate, 16, dataSize);
+    graph->source.nbFrames = segment->nbFrames;
+}
+
+
+WavGraphOp* wav_graph_add_op (WavGraph* graph,
+                              int type)
+{
+    WavGraphSegment* segment = wav_graph_tail(graph);
+
+    if (graph->running) {
+        fprintf(stderr, "Stages cannot be added once the graph is read\n");
+        exit(1);
+    }
+    if (segment->nbOps == WAV_GRAPH_MAX_OPS) {
+        fprintf(stderr, "Only %d stages supported between resamplers\n", WAV_GRAPH_MAX_OPS);
+        exit(1);
+    }
+
+    WavGraphOp* op = &segment->ops[segment->nbOps++];
+    memset(op, 0, sizeof(WavGraphOp));
+    op->type = type;
+    op->nbInputs = segment->outChannels;
+    op->nbOutputs = segment->outChannels;
+    return op;
+}
+
+
+/**
+ * @brief   Multiply all the samples by a gain
+ *
+ */
+void wav_graph_gain (WavGraph* graph,
+                     float gain)
+{
+    wav_graph_add_op(graph, WAV_GRAPH_GAIN)->gain = gain;
+}
+
+
+/**
+ * @brief   Mix the channels into nbOutputs channels
+ * @details Output channel c is the sum of the input channels i weighted
+ *          by matrix[c * nbInputs + i]. The matrix is copied.
+ *
+ * @param[in,out] graph      Pointer to the graph
+ * @param[in]     nbOutputs  Number of channels after the mix
+ * @param[in]     matrix     Coefficients [nbOutputs][current channel count]
+ * @returns                  None
+ *
+ */
+void wav_graph_mix (WavGraph* graph,
+                    unsigned nbOutputs,
+                    const float* matrix)
+{
+    WavGraphOp* op = wav_graph_add_op(graph, WAV_GRAPH_MIX);
+    WavGraphSegment* segment = wav_graph_tail(graph);
+    size_t size = (size_t)nbOutputs * op->nbInputs * sizeof(float);
+
+    if (nbOutputs == 0) {
+        fprintf(stderr, "Mixes need at least one output channel\n");
+        exit(1);
+    }
+
+    op->nbOutputs = nbOutputs;
+    op->matrix = (float*)malloc(size);
+
+    if (!op->matrix) {
+        fprintf(stderr, "Cannot allocate memory for mix\n");
+        exit(1);
+    }
+
+    memcpy(op->matrix, matrix, size);
+    segment->outChannels = nbOutputs;
+    if (nbOutputs > segment->maxChannels)
+        segment->maxChannels = nbOutputs;
+    wav_graph_update_format(graph);
+}
+
+
+/**
+ * @brief   Keep a single channel, as wav_extract_channel_data
+ *
+ */
+void wav_graph_select (WavGraph* graph,
+                       unsigned channel)
+{
+    unsigned nbChannels = wav_graph_tail(graph)->outChannels;
+    float* matrix = (float*)calloc(nbChannels, sizeof(float));
+
+    if (channel >= nbChannels) {
+        fprintf(stderr, "Only %u channels available\n", nbChannels);
+        exit(1);
+    }
+    if (!matrix) {
+        fprintf(stderr, "Cannot allocate memory for mix\n");
+        exit(1);
+    }
+
+    matrix[channel] = 1.0f;
+    wav_graph_mix(graph, 1, matrix);
+    free(matrix);
+}
+
+
+/**
+ * @brief   Limit the samples to the range of 16-bit samples
+ *
+ */
+void wav_graph_clip (WavGraph* graph)
+{
+    wav_graph_add_op(graph, WAV_GRAPH_CLIP);
+}
+
+
+/**
+ * @brief   Add triangular noise of one 16-bit step before quantization
+ *
+ * @param[in,out] graph      Pointer to the graph
+ * @param[in]     seed       Seed of the noise, for reproducible outputs
+ * @returns                  None
+ *
+ */
+void wav_graph_dither (WavGraph* graph,
+                       uint64_t seed)
+{
+    wav_graph_add_op(graph, WAV_GRAPH_DITHER);
+    graph->dither = seed ? seed : 1;
+}
+
+
+/**
+ * @brief   Convert the sample rate
+ * @details Frames are interpolated linearly, without low-pass filter:
+ *          high frequencies alias when the rate is lowered. This stage
+ *          keeps state, so the stages added after it start a new segment.
+ *
+ * @param[in,out] graph       Pointer to the graph
+ * @param[in]     sampleRate  Sample rate of the output in Hz
+ * @returns                   None
+ *
+ */
+void wav_graph_resample (WavGraph* graph,
+                         uint32_t sampleRate)
+{
+    WavGraphSegment* upstream = wav_graph_tail(graph);
+
+    if (graph->running) {
+        fprintf(stderr, "Stages cannot be added once the graph is read\n");
+        exit(1);
+    }
+    if (graph->nbSegments == WAV_GRAPH_MAX_SEGMENTS) {
+        fprintf(stderr, "Only %d resamplers supported\n", WAV_GRAPH_MAX_SEGMENTS - 1);
+        exit(1);
+    }
+    if (sampleRate == 0) {
+        fprintf(stderr, "Sample rate must be positive\n");
+        exit(1);
+    }
+
+    WavGraphSegment* segment = &graph->segments[graph->nbSegments++];
+    segment->nbChannels = upstream->outChannels;
+    segment->outChannels = upstream->outChannels;
+    segment->maxChannels = upstream->outChannels;
+    segment->inRate = upstream->sampleRate;
+    segment->sampleRate = sampleRate;
+
+    // Output frames k such that k * inRate / sampleRate <= nbFrames - 1
+    if (upstream->nbFrames == WAV_UNKNOWN_FRAMES)
+        segment->nbFrames = WAV_UNKNOWN_FRAMES;
+    else if (upstream->nbFrames == 0)
+        segment->nbFrames = 0;
+    else
+        segment->nbFrames = (upstream->nbFrames - 1) * sampleRate / segment->inRate + 1;
+
+    wav_graph_update_format(graph);
+}
+
+
+size_t wav_graph_pull (WavGraph* graph,
+                       unsigned index,
+                       const float** frames);
+
+
+/* Copy the next frame of the previous segment, 0 at its end */
+int wav_graph_fetch (WavGraph* graph,
+                     unsigned index,
+                     float* frame)
+{
+    WavGraphSegment* segment = &graph->segments[index];
+
+    if (segment->upstreamIndex == segment->upstreamFrames) {
+        segment->upstreamFrames = wav_graph_pull(graph, index - 1, &segment->upstream);
+        segment->upstreamIndex = 0;
+        if (segment->upstreamFrames == 0)
+            return 0;
+    }
+
+    memcpy(frame, segment->upstream + segment->upstreamIndex * segment->nbChannels,
+           segment->nbChannels * sizeof(float));
+    segment->upstreamIndex++;
+    return 1;
+}
+
+
+/* Interpolate up to WAV_GRAPH_BLOCK frames of a resampling segment */
+size_t wav_graph_resample_block (WavGraph* graph,
+                                 unsigned index,
+                                 float* frames)
+{
+    WavGraphSegment* segment = &graph->segments[index];
+    unsigned nbChannels = segment->nbChannels;
+    size_t nbFrames = 0;
+
+    if (!segment->started) {
+        segment->started = 1;
+        segment->hasPrev = wav_graph_fetch(graph, index, segment->prev);
+        segment->hasNext = segment->hasPrev && wav_graph_fetch(graph, index, segment->next);
+    }
+
+    while (nbFrames < WAV_GRAPH_BLOCK && segment->hasPrev) {
+        // The last input frame is only reached exactly
+        if (segment->phase && !segment->hasNext)
+            break;
+
+        float weight = (float)segment->phase / segment->sampleRate;
+        float* frame = frames + nbFrames * nbChannels;
+        for (unsigned c = 0; c < nbChannels; ++c) {
+            float prev = segment->prev[c];
+            frame[c] = segment->phase ? prev + weight * (segment->next[c] - prev) : prev;
+        }
+        ++nbFrames;
+
+        segment->phase += segment->inRate;
+        while (segment->phase >= segment->sampleRate && segment->hasPrev) {
+            float* swap = segment->prev;
+            segment->phase -= segment->sampleRate;
+            segment->prev = segment->next;
+            segment->next = swap;
+            segment->hasPrev = segment->hasNext;
+            segment->hasNext = segment->hasPrev && wav_graph_fetch(graph, index, segment->next);
+        }
+    }
+
+    return nbFrames;
+}
+
+
+/**
+ * @brief   Produce the next block of a segment
+ * @details The producer fills the first buffer of the segment, then all
+ *          the stages run on the block while it is in cache.
+ *
+ * @param[in]   graph     Pointer to the graph
+ * @param[in]   index     Index of the segment
+ * @param[out]  frames    Pointer to the block, valid until the next pull
+ * @returns               Number of frames of the block, 0 at the end
+ *
+ */
+size_t wav_graph_pull (WavGraph* graph,
+                       unsigned index,
+                       const float** frames)
+{
+    WavGraphSegment* segment = &graph->segments[index];
+    float* data = segment->buffers[0];
+    unsigned nbChannels = segment->nbChannels;
+    size_t nbFrames;
+
+    if (index == 0) {
+        nbFrames = wav_source_read(graph->input, segment->samples, WAV_GRAPH_BLOCK);
+        wav_convert_s16_to_f32(data, segment->samples, nbFrames * nbChannels);
+    }
+    else {
+        nbFrames = wav_graph_resample_block(graph, index, data);
+    }
+
+    for (unsigned o = 0; o < segment->nbOps; ++o) {
+        const WavGraphOp* op = &segment->ops[o];
+        size_t count = nbFrames * nbChannels;
+
+        switch (op->type) {
+        case WAV_GRAPH_GAIN:
+            for (size_t i = 0; i < count; ++i)
+                data[i] *= op->gain;
+            break;
+
+        case WAV_GRAPH_MIX: {
+            float* mixed = data == segment->buffers[0] ? segment->buffers[1] : segment->buffers[0];
+            for (size_t i = 0; i < nbFrames; ++i) {
+                const float* in = data + i * op->nbInputs;
+                float* out = mixed + i * op->nbOutputs;
+                for (unsigned c = 0; c < op->nbOutputs; ++c) {
+                    const float* weights = op->matrix + c * op->nbInputs;
+                    float sum = 0.0f;
+                    for (unsigned j = 0; j < op->nbInputs; ++j)
+                        sum += weights[j] * in[j];
+                    out[c] = sum;
+                }
+            }
+            data = mixed;
+            nbChannels = op->nbOutputs;
+            break;
+        }
+
+        case WAV_GRAPH_CLIP:
+            for (size_t i = 0; i < count; ++i) {
+                float sample = data[i] < -1.0f ? -1.0f : data[i];
+                data[i] = sample > 32767.0f / 32768.0f ? 32767.0f / 32768.0f : sample;
+            }
+            break;
+
+        case WAV_GRAPH_DITHER:
+            // Difference of two uniform values: triangular in (-1, 1) steps
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t x = graph->dither;
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                graph->dither = x;
+                float noise = (float)(x & 0xffff) - (float)((x >> 16) & 0xffff);
+                data[i] += noise * (1.0f / 65536.0f / 32768.0f);
+            }
+            break;
+        }
+    }
+
+    *frames = data;
+    return nbFrames;
+}
+
+
+/* Allocate the blocks once the stages are known */
+void wav_graph_start (WavGraph* graph)
+{
+    if (graph->running)
+        return;
+
+    for (unsigned s = 0; s < graph->nbSegments; ++s) {
+        WavGraphSegment* segment = &graph->segments[s];
+        size_t size = (size_t)WAV_GRAPH_BLOCK * segment->maxChannels * sizeof(float);
+
+        segment->buffers[0] = (float*)malloc(size);
+        segment->buffers[1] = (float*)malloc(size);
+        if (s == 0)
+            segment->samples = (int16_t*)malloc(WAV_GRAPH_BLOCK * segment->nbChannels * sizeof(int16_t));
+        else {
+            segment->prev = (float*)malloc(segment->nbChannels * sizeof(float));
+            segment->next = (float*)malloc(segment->nbChannels * sizeof(float));
+        }
+
+        if (!segment->buffers[0] || !segment->buffers[1] ||
+            (s == 0 && !segment->samples) || (s > 0 && (!segment->prev || !segment->next)))
+        {
+            fprintf(stderr, "Cannot allocate memory for graph\n");
+            exit(1);
+        }
+    }
+    graph->running = 1;
+}
+
+
+/**
+ * @brief   Get the next output frames of the graph, without copy
+ *
+ * @param[in]   graph     Pointer to the graph
+ * @param[out]  frames    Pointer to the float frames, valid until the next call
+ * @param[in]   nbFrames  Maximum number of frames to get
+ * @returns               Number of frames (0 at the end of the graph)
+ *
+ */
+size_t wav_graph_next (WavGraph* graph,
+                       const float** frames,
+                       size_t nbFrames)
+{
+    wav_graph_start(graph);
+
+    if (graph->blockIndex == graph->blockFrames) {
+        graph->blockFrames = wav_graph_pull(graph, graph->nbSegments - 1, &graph->block);
+        graph->blockIndex = 0;
+    }
+
+    size_t length = graph->blockFrames - graph->blockIndex;
+    if (length > nbFrames)
+        length = nbFrames;
+
+    *frames = graph->block + graph->blockIndex * graph->source.header.NbChannels;
+    graph->blockIndex += length;
+    graph->source.position += length;
+    return length;
+}
+
+
+/**
+ * @brief   Read float frames from the end of the graph
+ *
+ * @param[in]   graph     Pointer to the graph
+ * @param[out]  frames    Buffer receiving the interleaved float frames
+ * @param[in]   nbFrames  Maximum number of frames to read
+ * @returns               Number of frames read (0 at the end of the graph)
+ *
+ */
+size_t wav_graph_read_f32 (WavGraph* graph,
+                           float* frames,
+                           size_t nbFrames)
+{
+    unsigned nbChannels = graph->source.header.NbChannels;
+    size_t nbRead = 0, length;
+    const float* block;
+
+    while (nbRead < nbFrames && (length = wav_graph_next(graph, &block, nbFrames - nbRead))) {
+        memcpy(frames + nbRead * nbChannels, block, length * nbChannels * sizeof(float));
+        nbRead += length;
+    }
+    return nbRead;
+}
+
+
+/* Source interface: 16-bit frames, rounded and saturated */
+size_t wav_graph_read_frames (WavSource* source,
+                              int16_t* frames,
+                              size_t nbFrames)
+{
+    WavGraph* graph = (WavGraph*)source;
+    unsigned nbChannels = source->header.NbChannels;
+    size_t nbRead = 0, length;
+    const float* block;
+
+    while (nbRead < nbFrames && (length = wav_graph_next(graph, &block, nbFrames - nbRead))) {
+        int16_t* out = frames + nbRead * nbChannels;
+        for (size_t i = 0; i < length * nbChannels; ++i) {
+            long sample = lrintf(block[i] * 32768.0f);
+            out[i] = sample < INT16_MIN ? INT16_MIN : sample > INT16_MAX ? INT16_MAX : sample;
+        }
+        nbRead += length;
+    }
+    return nbRead;
+}
+
+
+/* Seeking restarts the graph, and drops frames up to the target
+   when resamplers are involved */
+void wav_graph_seek_frame (WavSource* source,
+                           uint64_t frame)
+{
+    WavGraph* graph = (WavGraph*)source;
+
+    if (frame == source->position)
+        return;
+
+    wav_graph_start(graph);
+    graph->blockFrames = graph->blockIndex = 0;
+
+    if (graph->nbSegments == 1) {
+        wav_source_seek(graph->input, frame);
+        source->position = frame;
+        return;
+    }
+
+    wav_source_seek(graph->input, 0);
+    for (unsigned s = 1; s < graph->nbSegments; ++s) {
+        WavGraphSegment* segment = &graph->segments[s];
+        segment->phase = 0;
+        segment->started = 0;
+        segment->upstreamFrames = segment->upstreamIndex = 0;
+    }
+    source->position = 0;
+
+    float* block = (float*)malloc((size_t)WAV_GRAPH_BLOCK * source->header.NbChannels * sizeof(float));
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for graph\n");
+        exit(1);
+    }
+
+    while (source->position < frame) {
+        uint64_t length = frame - source->position;
+        if (!wav_graph_read_f32(graph, block, length < WAV_GRAPH_BLOCK ? length : WAV_GRAPH_BLOCK))
+            break;
+    }
+    free(block);
+}
+
+
+void wav_graph_close_stream (WavSource* source)
+{
+    WavGraph* graph = (WavGraph*)source;
+
+    for (unsigned s = 0; s < graph->nbSegments; ++s) {
+        WavGraphSegment* segment = &graph->segments[s];
+        for (unsigned o = 0; o < segment->nbOps; ++o)
+            free(segment->ops[o].matrix);
+        free(segment->buffers[0]);
+        free(segment->buffers[1]);
+        free(segment->samples);
+        free(segment->prev);
+        free(segment->next);
+    }
+
+    wav_source_close(graph->input);
+    free(graph);
+}
+
+
+/**
+ * @brief   Start a processing graph reading a source
+ * @details Stages are added with wav_graph_gain, wav_graph_mix, ... and
+ *          nothing is computed before the graph is read, either as a
+ *          16-bit WavSource or with wav_graph_read_f32.
+ *
+ * @param[in]   input     Pointer to the source, closed with the graph
+ * @returns               Pointer to the graph, to close with wav_source_close
+ *
+ */
+WavGraph* wav_graph_open (WavSource* input)
+{
+    WavGraph* graph = (WavGraph*)calloc(1, sizeof(WavGraph));
+
+    if (!graph) {
+        fprintf(stderr, "Cannot allocate memory for graph\n");
+        exit(1);
+    }
+
+    WavGraphSegment* segment = &graph->segments[0];
+    segment->nbChannels = input->header.NbChannels;
+    segment->outChannels = input->header.NbChannels;
+    segment->maxChannels = input->header.NbChannels;
+    segment->sampleRate = input->header.SampleRate;
+    segment->nbFrames = input->nbFrames;
+
+    graph->input = input;
+    graph->nbSegments = 1;
+    graph->source.read = wav_graph_read_frames;
+    graph->source.seek = wav_graph_seek_frame;
+    graph->source.close = wav_graph_close_stream;
+    wav_graph_update_format(graph);
+
+    return graph;
+}
+
+
+/**
+ * @brief   Write all the frames of a graph
+ * @details Writers opened with a 32-bit float format (AudioFormat 3)
+ *          receive the float frames, others the 16-bit frames.
+ *
+ * @param[in]   graph     Pointer to the graph
+ * @param[in]   writer    Pointer to the writer, with the channels and rate of the graph
+ * @returns               Number of frames written
+ *
+ */
+uint64_t wav_graph_write (WavGraph* graph,
+                          WavWriter* writer)
+{
+    unsigned nbChannels = graph->source.header.NbChannels;
+    int isFloat = writer->header.AudioFormat == 3 && writer->header.BitsPerSample == 32;
+    void* block = malloc((size_t)WAV_GRAPH_BLOCK * nbChannels * sizeof(float));
+    uint64_t nbFrames = 0;
+    size_t nbRead;
+
+    if (writer->header.NbChannels != nbChannels) {
+        fprintf(stderr, "Writer has %u channels, graph %u\n", writer->header.NbChannels, nbChannels);
+        exit(1);
+    }
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for graph\n");
+        exit(1);
+    }
+
+    for (;;) {
+        nbRead = isFloat ? wav_graph_read_f32(graph, (float*)block, WAV_GRAPH_BLOCK) :
+                           wav_source_read(&graph->source, (int16_t*)block, WAV_GRAPH_BLOCK);
+        if (!nbRead)
+            break;
+        wav_writer_write(writer, block, nbRead);
+        nbFrames += nbRead;
+    }
+
+    free(block);
+    return nbFrames;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_GRAPH_H__
@@ -0,0 +1,576 @@
+/**
+ ******************************************************************************
+ * @file     wav_index.h
+ * @brief    Provide a persistent metadata index of a wav corpus
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_INDEX_H__
+#define __WAV_INDEX_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <dirent.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wav.h"
+
+/* Structure at the beginning of an index file */
+typedef struct WavIndexHeader {
+    char        Magic[4];       // "WIDX" Constant
+    uint32_t    Version;        // Format version (1)
+    uint64_t    NbRecords;      // Number of indexed files
+    uint64_t    PathsSize;      // Size of the paths stored after the records
+} WavIndexHeader;
+
+/* Metadata of an indexed file */
+typedef struct WavIndexRecord {
+    uint64_t    PathOffset;     // Position of the path in the paths block
+    uint64_t    FileSize;       // Size of the file in bytes
+    int64_t     MTime;          // Modification time in nanoseconds
+    uint64_t    DataOffset;     // Position of the first sample in the file
+    uint64_t    Hash;           // wav_hash_bytes of the samples (if HasHash)
+    uint32_t    PathLength;
+    uint32_t    SampleRate;
+    uint32_t    DataSize;
+    uint16_t    AudioFormat;
+    uint16_t    NbChannels;
+    uint16_t    BitsPerSample;
+    uint16_t    HasHash;
+    uint32_t    Reserved;
+} WavIndexRecord;
+
+/**
+ * @details Layout of an index file
+ *
+ *  [WavIndexHeader] [WavIndexRecord x NbRecords] [paths]
+ *
+ *  Records are sorted by path, paths are not null-terminated.
+ *
+ */
+
+/* Index loaded in memory */
+typedef struct WavIndex {
+    WavIndexRecord* records;
+    size_t          nbRecords;
+    char*           paths;
+    size_t          pathsSize;
+} WavIndex;
+
+/* Filter of wav_index_query, zero fields match any value */
+typedef struct WavIndexQuery {
+    uint32_t    sampleRate;
+    uint16_t    nbChannels;
+    uint64_t    minFrames;
+    uint64_t    maxFrames;
+} WavIndexQuery;
+
+
+/**
+ * @brief   Get the path of an index record
+ * @details The returned string is not null-terminated, its length is
+ *          given by record->PathLength.
+ *
+ */
+const char* wav_index_path (const WavIndex* index,
+                            const WavIndexRecord* record)
+{
+    return index->paths + record->PathOffset;
+}
+
+
+int wav_index_compare_path (const WavIndex* index,
+                            const WavIndexRecord* record,
+                            const char* path,
+                            size_t pathLength)
+{
+    size_t length = record->PathLength < pathLength ? record->PathLength : pathLength;
+    int cmp = memcmp(wav_index_path(index, record), path, length);
+
+    if (cmp)
+        return cmp;
+    return (record->PathLength > pathLength) - (record->PathLength < pathLength);
+}
+
+
+/**
+ * @brief   Find the record of a file
+ *
+ * @param[in]  index      Pointer to the index
+ * @param[in]  path       Path of the file, as given to the scan
+ * @returns               Pointer to the record, NULL if not indexed
+ *
+ */
+const WavIndexRecord* wav_index_find (const WavIndex* index,
+                                      const char* path)
+{
+    size_t pathLength = strlen(path);
+    size_t low = 0;
+    size_t high = index->nbRecords;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = wav_index_compare_path(index, &index->records[mid], path, pathLength);
+
+        if (cmp == 0)
+            return &index->records[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief   Call a function on every record matching a filter
+ *
+ * @param[in]  index      Pointer to the index
+ * @param[in]  query      Pointer to the filter
+ * @param[in]  callback   Function called with each matching record
+ * @param[in]  user       Pointer given back to the callback
+ * @returns               Number of matching records
+ *
+ */
+size_t wav_index_query (const WavIndex* index,
+                        const WavIndexQuery* query,
+                        void (*callback)(const WavIndex*, const WavIndexRecord*, void*),
+                        void* user)
+{
+    size_t nbMatches = 0;
+
+    for (size_t i = 0; i < index->nbRecords; ++i) {
+        const WavIndexRecord* record = &index->records[i];
+        uint32_t frameSize = record->NbChannels * record->BitsPerSample / 8;
+        uint64_t nbFrames = frameSize ? record->DataSize / frameSize : 0;
+
+        if ((query->sampleRate && record->SampleRate != query->sampleRate) ||
+            (query->nbChannels && record->NbChannels != query->nbChannels) ||
+            (query->minFrames && nbFrames < query->minFrames) ||
+            (query->maxFrames && nbFrames > query->maxFrames))
+            continue;
+
+        if (callback)
+            callback(index, record, user);
+        ++nbMatches;
+    }
+    return nbMatches;
+}
+
+
+/**
+ * @brief   Load an index file
+ *
+ * @param[out] index      Pointer to the index to fill
+ * @param[in]  filename   String of the index filename
+ * @returns               0 on success, -1 if the file does not exist
+ *                        (index is then empty)
+ *
+ */
+int wav_index_load (WavIndex* index,
+                    const char* filename)
+{
+    memset(index, 0, sizeof(WavIndex));
+
+    FILE* stream = fopen(filename, "rb");
+    WavIndexHeader header;
+    struct stat info;
+
+    if (stream == NULL)
+        return -1;
+
+    if (fstat(fileno(stream), &info) || !fread(&header, sizeof(WavIndexHeader), 1, stream) ||
+        strncmp(header.Magic, "WIDX", 4) || header.Version != 1)
+    {
+        fprintf(stderr, "%s is not an index file\n", filename);
+        exit(1);
+    }
+
+    // Sizes must add up to the file size before anything is allocated
+    uint64_t size = (uint64_t)info.st_size - sizeof(WavIndexHeader);
+
+    if (header.NbRecords > size / sizeof(WavIndexRecord) ||
+        header.PathsSize != size - header.NbRecords * sizeof(WavIndexRecord))
+    {
+        fprintf(stderr, "%s is a corrupted index file\n", filename);
+        exit(1);
+    }
+
+    index->nbRecords = header.NbRecords;
+    index->pathsSize = header.PathsSize;
+    index->records = (WavIndexRecord*)malloc(index->nbRecords * sizeof(WavIndexRecord) + 1);
+    index->paths = (char*)malloc(index->pathsSize + 1);
+
+    if (!index->records || !index->paths) {
+        fprintf(stderr, "Cannot allocate memory for index\n");
+        exit(1);
+    }
+
+    if (fread(index->records, sizeof(WavIndexRecord), index->nbRecords, stream) != index->nbRecords ||
+        fread(index->paths, 1, index->pathsSize, stream) != index->pathsSize)
+    {
+        fprintf(stderr, "Cannot read index from stream\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < index->nbRecords; ++i) {
+        const WavIndexRecord* record = &index->records[i];
+
+        if (record->PathOffset > index->pathsSize ||
+            record->PathLength > index->pathsSize - record->PathOffset)
+        {
+            fprintf(stderr, "%s is a corrupted index file\n", filename);
+            exit(1);
+        }
+    }
+
+    if (fclose(stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief   Save an index file
+ *
+ * @param[in]  index      Pointer to the index
+ * @param[in]  filename   String of the index filename
+ * @returns               None
+ *
+ */
+void wav_index_save (const WavIndex* index,
+                     const char* filename)
+{
+    FILE* stream = fopen(filename, "wb");
+    WavIndexHeader header;
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        exit(1);
+    }
+
+    memcpy(header.Magic, "WIDX", 4);
+    header.Version = 1;
+    header.NbRecords = index->nbRecords;
+    header.PathsSize = index->pathsSize;
+
+    if (!fwrite(&header, sizeof(WavIndexHeader), 1, stream) ||
+        fwrite(index->records, sizeof(WavIndexRecord), index->nbRecords, stream) != index->nbRecords ||
+        fwrite(index->paths, 1, index->pathsSize, stream) != index->pathsSize)
+    {
+        fprintf(stderr, "Cannot write index into stream\n");
+        exit(1);
+    }
+
+    if (fclose(stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Release the memory of an index
+ *
+ */
+void wav_index_free (WavIndex* index)
+{
+    free(index->records);
+    free(index->paths);
+    memset(index, 0, sizeof(WavIndex));
+}
+
+
+/**
+ * @brief   Read the format of a wav file without stdio
+ * @details The first 4 KiB are read with a single pread, which covers
+ *          the chunks of almost every file. Further chunk headers are
+ *          read one by one. The file is not validated beyond its chunks.
+ *
+ * @param[in]  fd         Descriptor of the file
+ * @param[out] record     Pointer to the record receiving the format fields
+ * @returns               0 on success, -1 if the file is not a wav file
+ *
+ */
+int wav_index_probe (int fd,
+                     WavIndexRecord* record)
+{
+    uint8_t buffer[4096];
+    ssize_t nbBytes = pread(fd, buffer, sizeof(buffer), 0);
+    uint64_t offset = 12;
+    int fmtFound = 0;
+
+    if (nbBytes < 12 || memcmp(buffer, "RIFF", 4) || memcmp(buffer + 8, "WAVE", 4))
+        return -1;
+
+    for (;;) {
+        uint8_t chunk[24];
+        uint32_t chunkSize;
+        ssize_t chunkBytes = sizeof(chunk);
+
+        // Chunk header and start of the format fields
+        if (offset + sizeof(chunk) <= (uint64_t)nbBytes)
+            memcpy(chunk, buffer + offset, sizeof(chunk));
+        else if ((chunkBytes = pread(fd, chunk, sizeof(chunk), offset)) < 8)
+            return -1;
+
+        memcpy(&chunkSize, chunk + 4, 4);
+
+        if (!memcmp(chunk, "fmt ", 4)) {
+            if (chunkSize < 16 || chunkBytes < 24)
+                return -1;
+            memcpy(&record->AudioFormat, chunk + 8, 2);
+            memcpy(&record->NbChannels, chunk + 10, 2);
+            memcpy(&record->SampleRate, chunk + 12, 4);
+            memcpy(&record->BitsPerSample, chunk + 22, 2);
+            fmtFound = 1;
+        }
+        else if (!memcmp(chunk, "data", 4)) {
+            record->DataSize = chunkSize;
+            record->DataOffset = offset + 8;
+            return fmtFound ? 0 : -1;
+        }
+
+        offset += 8 + chunkSize + (chunkSize & 1);
+    }
+}
+
+
+/* Index being rebuilt by wav_index_refresh */
+typedef struct WavIndexBuilder {
+    const WavIndex* previous;
+    WavIndex        index;
+    size_t          capacity;
+    size_t          pathsCapacity;
+    int             withHash;
+    size_t          nbProbed;
+} WavIndexBuilder;
+
+
+void wav_index_add_file (WavIndexBuilder* builder,
+                         const char* path,
+                         const struct stat* info)
+{
+    WavIndexRecord record;
+    const WavIndexRecord* previous = wav_index_find(builder->previous, path);
+    int64_t mtime = (int64_t)info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec;
+
+    if (previous && previous->FileSize == (uint64_t)info->st_size &&
+        previous->MTime == mtime && (previous->HasHash || !builder->withHash))
+    {
+        // Unchanged file: reuse its record without opening it
+        memcpy(&record, previous, sizeof(WavIndexRecord));
+    }
+    else {
+        int fd = open(path, O_RDONLY);
+
+        memset(&record, 0, sizeof(WavIndexRecord));
+        if (fd < 0)
+            return;
+
+        if (wav_index_probe(fd, &record)) {
+            close(fd);
+            return;
+        }
+
+        if (builder->withHash) {
+            uint8_t block[1 << 16];
+            uint64_t hash = WAV_HASH_INIT;
+            uint64_t position = record.DataOffset;
+            uint64_t end = record.DataOffset + record.DataSize;
+            ssize_t nbRead;
+
+            while (position < end &&
+                   (nbRead = pread(fd, block, end - position < sizeof(block) ?
+                                              end - position : sizeof(block), position)) > 0)
+            {
+                hash = wav_hash_bytes(block, nbRead, hash);
+                position += nbRead;
+            }
+            record.Hash = hash;
+            record.HasHash = 1;
+        }
+
+        close(fd);
+        record.FileSize = info->st_size;
+        record.MTime = mtime;
+        builder->nbProbed++;
+    }
+
+    size_t pathLength = strlen(path);
+    WavIndex* index = &builder->index;
+
+    if (index->nbRecords == builder->capacity) {
+        builder->capacity = builder->capacity ? 2 * builder->capacity : 1024;
+        index->records = (WavIndexRecord*)realloc(index->records,
+                                                  builder->capacity * sizeof(WavIndexRecord));
+    }
+
+    if (index->pathsSize + pathLength > builder->pathsCapacity) {
+        while (index->pathsSize + pathLength > builder->pathsCapacity)
+            builder->pathsCapacity = builder->pathsCapacity ? 2 * builder->pathsCapacity : 65536;
+        index->paths = (char*)realloc(index->paths, builder->pathsCapacity);
+    }
+
+    if (!index->records || !index->paths) {
+        fprintf(stderr, "Cannot allocate memory for index\n");
+        exit(1);
+    }
+
+    record.PathOffset = index->pathsSize;
+    record.PathLength = pathLength;
+    memcpy(index->paths + index->pathsSize, path, pathLength);
+    index->pathsSize += pathLength;
+    memcpy(&index->records[index->nbRecords++], &record, sizeof(WavIndexRecord));
+}
+
+
+void wav_index_scan_dir (WavIndexBuilder* builder,
+                         const char* dirname)
+{
+    DIR* dir = opendir(dirname);
+    struct dirent* entry;
+
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open directory %s\n", dirname);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        size_t length = strlen(dirname) + strlen(entry->d_name) + 2;
+        char* path = (char*)malloc(length);
+        struct stat info;
+
+        if (!path) {
+            fprintf(stderr, "Cannot allocate memory for path\n");
+            exit(1);
+        }
+        snprintf(path, length, "%s/%s", dirname, entry->d_name);
+
+        // Symbolic links are only followed to files, so that loops are never entered
+        int found = !lstat(path, &info);
+        if (found && S_ISLNK(info.st_mode))
+            found = !stat(path, &info) && !S_ISDIR(info.st_mode);
+
+        if (found) {
+            size_t nameLength = strlen(entry->d_name);
+            const char* extension = entry->d_name + (nameLength > 4 ? nameLength - 4 : 0);
+
+            if (S_ISDIR(info.st_mode))
+                wav_index_scan_dir(builder, path);
+            else if (S_ISREG(info.st_mode) && !strcasecmp(extension, ".wav"))
+                wav_index_add_file(builder, path, &info);
+        }
+        free(path);
+    }
+
+    closedir(dir);
+}
+
+
+/* Sort key of a record, qsort having no context argument */
+typedef struct WavIndexSortKey {
+    const char* path;
+    uint32_t    length;
+    size_t      record;
+} WavIndexSortKey;
+
+int wav_index_sort_compare (const void* a,
+                            const void* b)
+{
+    const WavIndexSortKey* ka = (const WavIndexSortKey*)a;
+    const WavIndexSortKey* kb = (const WavIndexSortKey*)b;
+    int cmp = memcmp(ka->path, kb->path, ka->length < kb->length ? ka->length : kb->length);
+
+    if (cmp)
+        return cmp;
+    return (ka->length > kb->length) - (ka->length < kb->length);
+}
+
+
+void wav_index_sort (WavIndex* index)
+{
+    WavIndexSortKey* keys = (WavIndexSortKey*)malloc(index->nbRecords * sizeof(WavIndexSortKey) + 1);
+    WavIndexRecord* records = (WavIndexRecord*)malloc(index->nbRecords * sizeof(WavIndexRecord) + 1);
+
+    if (!keys || !records) {
+        fprintf(stderr, "Cannot allocate memory for index\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < index->nbRecords; ++i) {
+        keys[i].path = wav_index_path(index, &index->records[i]);
+        keys[i].length = index->records[i].PathLength;
+        keys[i].record = i;
+    }
+
+    qsort(keys, index->nbRecords, sizeof(WavIndexSortKey), wav_index_sort_compare);
+
+    for (size_t i = 0; i < index->nbRecords; ++i)
+        memcpy(&records[i], &index->records[keys[i].record], sizeof(WavIndexRecord));
+
+    free(index->records);
+    free(keys);
+    index->records = records;
+}
+
+
+/**
+ * @brief   Scan directories and update an index
+ * @details Files whose size and modification time did not change since
+ *          the previous index are not opened again. Files which
+ *          disappeared are removed from the index.
+ *
+ * @param[in,out] index     Pointer to the index (empty or loaded)
+ * @param[in]     dirnames  Array of the directories to scan recursively
+ * @param[in]     nbDirs    Number of directories
+ * @param[in]     withHash  Store the content hash of the samples
+ * @returns                 Number of files which were (re)probed
+ *
+ */
+size_t wav_index_refresh (WavIndex* index,
+                          const char* const* dirnames,
+                          size_t nbDirs,
+                          int withHash)
+{
+    WavIndexBuilder builder;
+
+    memset(&builder, 0, sizeof(WavIndexBuilder));
+    builder.previous = index;
+    builder.withHash = withHash;
+
+    for (size_t i = 0; i < nbDirs; ++i)
+        wav_index_scan_dir(&builder, dirnames[i]);
+
+    wav_index_sort(&builder.index);
+
+    wav_index_free(index);
+    memcpy(index, &builder.index, sizeof(WavIndex));
+
+    return builder.nbProbed;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_INDEX_H__
@@ -0,0 +1,369 @@
+/**
+ ******************************************************************************
+ * @file     wav_loader.h
+ * @brief    Provide random fixed-length float batches from a wav corpus
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_LOADER_H__
+#define __WAV_LOADER_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "wav_stream.h"
+
+/* Parameters of a loader */
+typedef struct WavLoaderConfig {
+    size_t      batchSize;      // Number of crops per batch
+    size_t      nbFrames;       // Length of each crop in frames
+    unsigned    nbChannels;     // Files with another channel count are skipped
+    unsigned    nbThreads;      // Number of background workers
+    unsigned    prefetch;       // Number of batches prepared in advance
+    uint64_t    seed;           // Seed of the crop sampling
+} WavLoaderConfig;
+
+/* Batch of crops stored as a contiguous [batch, channels, frames] tensor */
+typedef struct WavBatch {
+    float*      data;           // Samples scaled to [-1, 1)
+    size_t*     files;          // Index of the file of each crop
+    uint64_t*   offsets;        // First frame of each crop in its file
+} WavBatch;
+
+/* Corpus file found by the header scan */
+typedef struct WavLoaderFile {
+    char*       filename;
+    int64_t     dataOffset;
+    uint64_t    nbFrames;
+    uint64_t    cumFrames;      // Number of frames in the previous files
+} WavLoaderFile;
+
+typedef struct WavLoader {
+    WavLoaderConfig config;
+    WavLoaderFile*  files;
+    size_t          nbFiles;
+    uint64_t        totalFrames;
+
+    WavBatch*       batches;    // Ring of config.prefetch batches
+    int*            states;     // State of each batch of the ring
+    uint64_t        nextFill;   // Sequence number of the next batch to fill
+    uint64_t        nextRead;   // Sequence number of the next batch to return
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t*      threads;
+    int             stop;
+} WavLoader;
+
+enum { WAV_BATCH_FREE, WAV_BATCH_FILLING, WAV_BATCH_READY, WAV_BATCH_IN_USE };
+
+
+/* SplitMix64 generator, deterministic for a given seed and batch */
+uint64_t wav_loader_random (uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/**
+ * @brief   Fill a batch with random crops
+ * @details Files are drawn proportionally to their length. Only the frames
+ *          of the crop are read. Crops of files shorter than the crop
+ *          length are padded with zeros.
+ *
+ * @param[in]   loader    Pointer to the loader
+ * @param[out]  batch     Pointer to the batch to fill
+ * @param[in]   sequence  Sequence number of the batch
+ * @param[in]   scratch   Buffer of nbFrames interleaved frames
+ * @returns               None
+ *
+ */
+void wav_loader_fill (WavLoader* loader,
+                      WavBatch* batch,
+                      uint64_t sequence,
+                      int16_t* scratch)
+{
+    const WavLoaderConfig* config = &loader->config;
+    size_t nbChannels = config->nbChannels;
+    uint64_t state = config->seed ^ (sequence * 0xd1b54a32d192ed03ULL);
+
+    for (size_t item = 0; item < config->batchSize; ++item) {
+        // Pick a frame of the corpus and find its file
+        uint64_t frame = wav_loader_random(&state) % loader->totalFrames;
+        size_t low = 0, high = loader->nbFiles - 1;
+        while (low < high) {
+            size_t mid = (low + high + 1) / 2;
+            if (loader->files[mid].cumFrames <= frame)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+
+        WavLoaderFile* file = &loader->files[low];
+        uint64_t length = file->nbFrames < config->nbFrames ? file->nbFrames : config->nbFrames;
+        uint64_t offset = file->nbFrames > config->nbFrames ?
+                          wav_loader_random(&state) % (file->nbFrames - config->nbFrames + 1) : 0;
+
+        int fd = open(file->filename, O_RDONLY);
+        size_t nbBytes = length * nbChannels * sizeof(int16_t);
+
+        if (fd < 0 || pread(fd, scratch, nbBytes,
+                            file->dataOffset + offset * nbChannels * sizeof(int16_t)) != (ssize_t)nbBytes)
+        {
+            fprintf(stderr, "Cannot read crop from %s\n", file->filename);
+            exit(1);
+        }
+        close(fd);
+
+        // Deinterleave and scale to float
+        float* dst = batch->data + item * nbChannels * config->nbFrames;
+        for (size_t c = 0; c < nbChannels; ++c) {
+            float* channel = dst + c * config->nbFrames;
+            for (size_t i = 0; i < length; ++i)
+                channel[i] = scratch[i * nbChannels + c] * (1.0f / 32768.0f);
+            for (size_t i = length; i < config->nbFrames; ++i)
+                channel[i] = 0.0f;
+        }
+
+        batch->files[item] = low;
+        batch->offsets[item] = offset;
+    }
+}
+
+
+void* wav_loader_worker (void* arg)
+{
+    WavLoader* loader = (WavLoader*)arg;
+    int16_t* scratch = (int16_t*)malloc(loader->config.nbFrames *
+                                        loader->config.nbChannels * sizeof(int16_t));
+
+    if (!scratch) {
+        fprintf(stderr, "Cannot allocate memory for loader\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&loader->lock);
+
+    for (;;) {
+        unsigned slot = loader->nextFill % loader->config.prefetch;
+
+        while (!loader->stop && loader->states[slot] != WAV_BATCH_FREE) {
+            pthread_cond_wait(&loader->cond, &loader->lock);
+            slot = loader->nextFill % loader->config.prefetch;
+        }
+
+        if (loader->stop)
+            break;
+
+        uint64_t sequence = loader->nextFill++;
+        loader->states[slot] = WAV_BATCH_FILLING;
+        pthread_mutex_unlock(&loader->lock);
+
+        WAV_TRACE_BEGIN("batch");
+        wav_loader_fill(loader, &loader->batches[slot], sequence, scratch);
+        WAV_TRACE_END("batch");
+
+        pthread_mutex_lock(&loader->lock);
+        loader->states[slot] = WAV_BATCH_READY;
+        pthread_cond_broadcast(&loader->cond);
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+    free(scratch);
+    return NULL;
+}
+
+
+/**
+ * @brief   Index a corpus and start the background workers
+ * @details Only the headers of the files are read by the scan.
+ *
+ * @param[in]   filenames  Array of the wav files of the corpus
+ * @param[in]   nbFiles    Number of wav files
+ * @param[in]   config     Pointer to the loader parameters
+ * @returns                Pointer to the loader, to release with wav_loader_close
+ *
+ */
+WavLoader* wav_loader_open (const char* const* filenames,
+                            size_t nbFiles,
+                            const WavLoaderConfig* config)
+{
+    WavLoader* loader = (WavLoader*)calloc(1, sizeof(WavLoader));
+
+    if (!loader) {
+        fprintf(stderr, "Cannot allocate memory for loader\n");
+        exit(1);
+    }
+
+    memcpy(&loader->config, config, sizeof(WavLoaderConfig));
+    if (loader->config.nbThreads == 0)
+        loader->config.nbThreads = 1;
+    if (loader->config.prefetch == 0)
+        loader->config.prefetch = 1;
+
+    loader->files = (WavLoaderFile*)malloc(nbFiles * sizeof(WavLoaderFile));
+
+    if (!loader->files) {
+        fprintf(stderr, "Cannot allocate memory for loader\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbFiles; ++i) {
+        WavReader* reader = wav_reader_open(filenames[i]);
+
+        if (reader->source.header.NbChannels == config->nbChannels && reader->source.nbFrames) {
+            WavLoaderFile* file = &loader->files[loader->nbFiles++];
+            file->filename = strdup(filenames[i]);
+            file->dataOffset = reader->dataOffset;
+            file->nbFrames = reader->source.nbFrames;
+            file->cumFrames = loader->totalFrames;
+            loader->totalFrames += file->nbFrames;
+        }
+        else {
+            fprintf(stderr, "Skipping %s: %u channels expected\n", filenames[i], config->nbChannels);
+        }
+
+        wav_source_close(&reader->source);
+    }
+
+    if (loader->nbFiles == 0) {
+        fprintf(stderr, "No usable file in corpus\n");
+        exit(1);
+    }
+
+    size_t batchLength = config->batchSize * config->nbChannels * config->nbFrames;
+    loader->batches = (WavBatch*)calloc(loader->config.prefetch, sizeof(WavBatch));
+    loader->states = (int*)calloc(loader->config.prefetch, sizeof(int));
+    loader->threads = (pthread_t*)calloc(loader->config.nbThreads, sizeof(pthread_t));
+
+    if (!loader->batches || !loader->states || !loader->threads) {
+        fprintf(stderr, "Cannot allocate memory for loader\n");
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < loader->config.prefetch; ++i) {
+        WavBatch* batch = &loader->batches[i];
+        batch->data = (float*)malloc(batchLength * sizeof(float));
+        batch->files = (size_t*)malloc(config->batchSize * sizeof(size_t));
+        batch->offsets = (uint64_t*)malloc(config->batchSize * sizeof(uint64_t));
+
+        if (!batch->data || !batch->files || !batch->offsets) {
+            fprintf(stderr, "Cannot allocate memory for batch\n");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+
+    for (unsigned i = 0; i < loader->config.nbThreads; ++i) {
+        if (pthread_create(&loader->threads[i], NULL, wav_loader_worker, loader)) {
+            fprintf(stderr, "Cannot start loader thread\n");
+            exit(1);
+        }
+    }
+
+    return loader;
+}
+
+
+/**
+ * @brief   Get the next batch
+ * @details Batches are returned in sequence order, so a given seed always
+ *          produces the same batches. The batch stays valid until
+ *          wav_loader_release, which must be called before the next call.
+ *
+ * @param[in]   loader    Pointer to the loader
+ * @returns               Pointer to the batch
+ *
+ */
+WavBatch* wav_loader_next (WavLoader* loader)
+{
+    unsigned slot = loader->nextRead % loader->config.prefetch;
+
+    pthread_mutex_lock(&loader->lock);
+    while (loader->states[slot] != WAV_BATCH_READY)
+        pthread_cond_wait(&loader->cond, &loader->lock);
+    loader->states[slot] = WAV_BATCH_IN_USE;
+    pthread_mutex_unlock(&loader->lock);
+
+    return &loader->batches[slot];
+}
+
+
+/**
+ * @brief   Give back the batch returned by wav_loader_next
+ *
+ * @param[in]   loader    Pointer to the loader
+ * @returns               None
+ *
+ */
+void wav_loader_release (WavLoader* loader)
+{
+    unsigned slot = loader->nextRead % loader->config.prefetch;
+
+    pthread_mutex_lock(&loader->lock);
+    loader->states[slot] = WAV_BATCH_FREE;
+    loader->nextRead++;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+
+/**
+ * @brief   Stop the workers and release the loader
+ *
+ * @param[in]   loader    Pointer to the loader
+ * @returns               None
+ *
+ */
+void wav_loader_close (WavLoader* loader)
+{
+    pthread_mutex_lock(&loader->lock);
+    loader->stop = 1;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+
+    for (unsigned i = 0; i < loader->config.nbThreads; ++i)
+        pthread_join(loader->threads[i], NULL);
+
+    pthread_cond_destroy(&loader->cond);
+    pthread_mutex_destroy(&loader->lock);
+
+    for (unsigned i = 0; i < loader->config.prefetch; ++i) {
+        free(loader->batches[i].data);
+        free(loader->batches[i].files);
+        free(loader->batches[i].offsets);
+    }
+
+    for (size_t i = 0; i < loader->nbFiles; ++i)
+        free(loader->files[i].filename);
+
+    free(loader->threads);
+    free(loader->states);
+    free(loader->batches);
+    free(loader->files);
+    free(loader);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_LOADER_H__
@@ -0,0 +1,390 @@
+/**
+ ******************************************************************************
+ * @file     wav_pack.h
+ * @brief    Provide a packed archive format for large sets of short wav clips
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_PACK_H__
+#define __WAV_PACK_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wav_stream.h"
+
+/* Alignment of the sample data of each clip inside the pack */
+#define WAV_PACK_ALIGN 16
+
+/* Structure at the beginning of a pack file */
+typedef struct WavPackHeader {
+    char        Magic[4];       // "WPAK" Constant
+    uint32_t    Version;        // Format version (1)
+    uint64_t    NbClips;        // Number of clips stored in the pack
+    uint64_t    NbSlots;        // Size of the hash table (power of 2)
+    uint64_t    IndexOffset;    // Position of the hash table
+    uint64_t    NamesOffset;    // Position of the clip names
+} WavPackHeader;
+
+/* Slot of the hash table indexing the clips by name */
+typedef struct WavPackEntry {
+    uint64_t    NameHash;       // wav_hash_bytes of the name
+    uint64_t    NameOffset;     // Position of the name from NamesOffset
+    uint32_t    NameLength;     // Length of the name (0 for an empty slot)
+    uint16_t    NbChannels;
+    uint16_t    BitsPerSample;
+    uint32_t    SampleRate;
+    uint32_t    DataSize;       // Size of the sample data in bytes
+    uint64_t    DataOffset;     // Position of the sample data in the pack
+} WavPackEntry;
+
+/**
+ * @details Layout of a pack file
+ *
+ *  [WavPackHeader] [data clip 0] [data clip 1] ... [WavPackEntry x NbSlots] [names]
+ *
+ *  Sample data is stored exactly as in the data chunk of the wav file,
+ *  each clip starting on a WAV_PACK_ALIGN boundary.
+ *  Clips are found by open addressing with linear probing on NameHash.
+ *
+ */
+
+/* Pack file mapped in memory */
+typedef struct WavPack {
+    const uint8_t*        base;
+    size_t                size;
+    const WavPackHeader*  header;
+    const WavPackEntry*   entries;
+    const char*           names;
+} WavPack;
+
+
+/**
+ * @brief   Build a pack file from a list of wav files
+ *
+ * @param[in]  packname   String of the pack filename to write
+ * @param[in]  filenames  Array of the wav files to store
+ * @param[in]  names      Array of the names used for lookup (filenames if NULL)
+ * @param[in]  nbClips    Number of wav files
+ * @returns               None
+ *
+ */
+void wav_pack_build (const char* packname,
+                     const char* const* filenames,
+                     const char* const* names,
+                     size_t nbClips)
+{
+    FILE* stream = fopen(packname, "wb");
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", packname);
+        exit(1);
+    }
+
+    // Hash table at most half full to keep probe sequences short
+    uint64_t nbSlots = 16;
+    while (nbSlots < 2 * (uint64_t)nbClips)
+        nbSlots *= 2;
+
+    WavPackEntry* entries = (WavPackEntry*)calloc(nbSlots, sizeof(WavPackEntry));
+    int16_t* block = (int16_t*)malloc(1 << 16);
+
+    if (!entries || !block) {
+        fprintf(stderr, "Cannot allocate memory for pack index\n");
+        exit(1);
+    }
+
+    WavPackHeader header;
+    memset(&header, 0, sizeof(WavPackHeader));
+    memcpy(header.Magic, "WPAK", 4);
+    header.Version = 1;
+    header.NbClips = nbClips;
+    header.NbSlots = nbSlots;
+
+    // Header is written again once the offsets are known
+    uint64_t offset = sizeof(WavPackHeader);
+    uint64_t namesSize = 0;
+    static const uint8_t padding[WAV_PACK_ALIGN] = { 0 };
+
+    if (!fwrite(&header, sizeof(WavPackHeader), 1, stream)) {
+        fprintf(stderr, "Cannot write pack header into stream\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbClips; ++i) {
+        const char* name = names ? names[i] : filenames[i];
+        size_t nameLength = strlen(name);
+
+        if (nameLength == 0) {
+            fprintf(stderr, "Empty clip name for %s\n", filenames[i]);
+            exit(1);
+        }
+
+        // Find the free slot of the clip
+        uint64_t hash = wav_hash_bytes(name, nameLength, WAV_HASH_INIT);
+        uint64_t slot = hash & (nbSlots - 1);
+        while (entries[slot].NameLength) {
+            if (entries[slot].NameHash == hash) {
+                const char* other = names ? names[entries[slot].NameOffset >> 32]
+                                          : filenames[entries[slot].NameOffset >> 32];
+                if (!strcmp(other, name)) {
+                    fprintf(stderr, "Duplicate clip name %s\n", name);
+                    exit(1);
+                }
+            }
+            slot = (slot + 1) & (nbSlots - 1);
+        }
+
+        // Copy sample data block by block
+        WavReader* reader = wav_reader_open(filenames[i]);
+        size_t frameSize = reader->source.header.BytePerChunk;
+        size_t nbRead;
+        uint64_t dataSize = 0;
+
+        while ((nbRead = wav_source_read(&reader->source, block, (1 << 16) / frameSize))) {
+            if (!fwrite(block, nbRead * frameSize, 1, stream)) {
+                fprintf(stderr, "Cannot write data into stream\n");
+                exit(1);
+            }
+            dataSize += nbRead * frameSize;
+        }
+
+        WavPackEntry* entry = &entries[slot];
+        entry->NameHash = hash;
+        // Clip index kept in the high bits until names are written
+        entry->NameOffset = ((uint64_t)i << 32);
+        entry->NameLength = nameLength;
+        entry->NbChannels = reader->source.header.NbChannels;
+        entry->BitsPerSample = reader->source.header.BitsPerSample;
+        entry->SampleRate = reader->source.header.SampleRate;
+        entry->DataSize = dataSize;
+        entry->DataOffset = offset;
+
+        wav_source_close(&reader->source);
+
+        size_t pad = (WAV_PACK_ALIGN - dataSize % WAV_PACK_ALIGN) % WAV_PACK_ALIGN;
+        if (pad && !fwrite(padding, pad, 1, stream)) {
+            fprintf(stderr, "Cannot write data into stream\n");
+            exit(1);
+        }
+        offset += dataSize + pad;
+    }
+
+    // Names are stored in clip order
+    uint64_t* nameOffsets = (uint64_t*)malloc((nbClips + 1) * sizeof(uint64_t));
+
+    if (!nameOffsets) {
+        fprintf(stderr, "Cannot allocate memory for pack index\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbClips; ++i) {
+        nameOffsets[i] = namesSize;
+        namesSize += strlen(names ? names[i] : filenames[i]);
+    }
+
+    for (uint64_t slot = 0; slot < nbSlots; ++slot) {
+        if (entries[slot].NameLength)
+            entries[slot].NameOffset = nameOffsets[entries[slot].NameOffset >> 32];
+    }
+
+    header.IndexOffset = offset;
+    header.NamesOffset = offset + nbSlots * sizeof(WavPackEntry);
+
+    if (fwrite(entries, sizeof(WavPackEntry), nbSlots, stream) != nbSlots) {
+        fprintf(stderr, "Cannot write pack index into stream\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbClips; ++i) {
+        const char* name = names ? names[i] : filenames[i];
+        if (!fwrite(name, strlen(name), 1, stream)) {
+            fprintf(stderr, "Cannot write pack index into stream\n");
+            exit(1);
+        }
+    }
+
+    if (fseeko(stream, 0, SEEK_SET) ||
+        !fwrite(&header, sizeof(WavPackHeader), 1, stream))
+    {
+        fprintf(stderr, "Cannot write pack header into stream\n");
+        exit(1);
+    }
+
+    if (fclose(stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+
+    free(nameOffsets);
+    free(block);
+    free(entries);
+}
+
+
+/**
+ * @brief   Map a pack file in memory
+ *
+ * @param[out] pack       Pointer to the pack to initialize
+ * @param[in]  packname   String of the pack filename to read
+ * @returns               None
+ *
+ */
+void wav_pack_open (WavPack* pack,
+                    const char* packname)
+{
+    int fd = open(packname, O_RDONLY);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info)) {
+        fprintf(stderr, "Cannot open file %s\n", packname);
+        exit(1);
+    }
+
+    if ((size_t)info.st_size < sizeof(WavPackHeader)) {
+        fprintf(stderr, "%s is not a pack file\n", packname);
+        exit(1);
+    }
+
+    pack->size = info.st_size;
+    pack->base = (const uint8_t*)mmap(NULL, pack->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (pack->base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map file %s\n", packname);
+        exit(1);
+    }
+
+    pack->header = (const WavPackHeader*)pack->base;
+
+    // Sizes are compared to what remains after the offsets, which cannot overflow
+    const WavPackHeader* header = pack->header;
+    uint64_t nbSlots = header->NbSlots;
+
+    if (strncmp(header->Magic, "WPAK", 4) || header->Version != 1 ||
+        nbSlots == 0 || (nbSlots & (nbSlots - 1)) ||
+        header->NamesOffset > pack->size || header->IndexOffset > pack->size ||
+        nbSlots > (pack->size - header->IndexOffset) / sizeof(WavPackEntry))
+    {
+        fprintf(stderr, "%s is not a pack file\n", packname);
+        exit(1);
+    }
+
+    pack->entries = (const WavPackEntry*)(pack->base + header->IndexOffset);
+    pack->names = (const char*)(pack->base + header->NamesOffset);
+}
+
+
+/* Exit unless the name and the clip of an entry lie inside the pack */
+void wav_pack_entry_check (const WavPack* pack,
+                           const WavPackEntry* entry)
+{
+    uint64_t namesSize = pack->size - pack->header->NamesOffset;
+
+    if (entry->NameOffset > namesSize || entry->NameLength > namesSize - entry->NameOffset ||
+        entry->DataOffset > pack->size || entry->DataSize > pack->size - entry->DataOffset)
+    {
+        fprintf(stderr, "Corrupted entry in slot %llu of pack file\n",
+                (unsigned long long)(entry - pack->entries));
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Unmap a pack file
+ *
+ * @param[in]  pack       Pointer to the pack
+ * @returns               None
+ *
+ */
+void wav_pack_close (WavPack* pack)
+{
+    if (munmap((void*)pack->base, pack->size)) {
+        fprintf(stderr, "Cannot unmap pack file\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief   Get the header and samples of a clip stored in a pack
+ * @details Samples point directly into the mapped pack: no copy and
+ *          no system call are made. They stay valid until wav_pack_close.
+ *
+ * @param[in]  pack       Pointer to the pack
+ * @param[in]  entry      Pointer to an entry of the pack
+ * @param[out] header     Pointer to the wavfile header of the clip
+ * @param[out] data       Pointer to the samples of the clip (NULL to ignore)
+ * @returns               None
+ *
+ */
+void wav_pack_entry_view (const WavPack* pack,
+                          const WavPackEntry* entry,
+                          WavHeader* header,
+                          const int16_t** data)
+{
+    wav_header_init(header, entry->NbChannels, entry->SampleRate,
+                    entry->BitsPerSample, entry->DataSize);
+
+    if (data)
+        *data = (const int16_t*)(pack->base + entry->DataOffset);
+}
+
+
+/**
+ * @brief   Find a clip by name in a pack
+ *
+ * @param[in]  pack       Pointer to the pack
+ * @param[in]  name       Name of the clip
+ * @param[out] header     Pointer to the wavfile header of the clip
+ * @param[out] data       Pointer to the samples of the clip (NULL to ignore)
+ * @returns               0 if the clip was found, -1 otherwise
+ *
+ */
+int wav_pack_find (const WavPack* pack,
+                   const char* name,
+                   WavHeader* header,
+                   const int16_t** data)
+{
+    size_t nameLength = strlen(name);
+    uint64_t hash = wav_hash_bytes(name, nameLength, WAV_HASH_INIT);
+    uint64_t mask = pack->header->NbSlots - 1;
+    uint64_t slot = hash & mask;
+
+    // Probes stop at an empty slot, or after the whole table if it has none
+    for (uint64_t probe = 0; probe <= mask && pack->entries[slot].NameLength; ++probe, slot = (slot + 1) & mask) {
+        const WavPackEntry* entry = &pack->entries[slot];
+
+        if (entry->NameHash != hash || entry->NameLength != nameLength)
+            continue;
+
+        // Only the entries compared are checked, so that opening stays cheap
+        wav_pack_entry_check(pack, entry);
+        if (!memcmp(pack->names + entry->NameOffset, name, nameLength)) {
+            wav_pack_entry_view(pack, entry, header, data);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_PACK_H__
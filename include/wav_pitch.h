@@ -0,0 +1,501 @@
+/**
+ ******************************************************************************
+ * @file     wav_pitch.h
+ * @brief    Track the pitch of wav sources with the YIN or MPM estimators
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_PITCH_H__
+#define __WAV_PITCH_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <pthread.h>
+
+#include "wav_analysis.h"
+#include "wav_fft.h"
+
+/* Estimators */
+#define WAV_PITCH_YIN   0   // Cumulative mean normalized difference (de Cheveigné and Kawahara)
+#define WAV_PITCH_MPM   1   // Normalized square difference with key maxima (McLeod and Wyvill)
+
+/* Smallest clarity of a voiced MPM estimate */
+#define WAV_PITCH_MPM_CLARITY 0.5f
+
+/* Default thresholds of the estimators */
+#define WAV_PITCH_YIN_THRESHOLD 0.15f
+#define WAV_PITCH_MPM_THRESHOLD 0.9f
+
+typedef struct WavPitchConfig {
+    int         method;         // WAV_PITCH_YIN or WAV_PITCH_MPM
+    float       minFrequency;   // Lowest pitch searched in Hz
+    float       maxFrequency;   // Highest pitch searched in Hz
+    uint32_t    window;         // Integration window in frames, 0 for the default
+    uint32_t    hop;            // Frames between estimates, 0 for 10 ms
+    float       threshold;      // YIN: largest difference of a dip; MPM: key maximum ratio; 0 for the default
+} WavPitchConfig;
+
+/* Pitch of the analysis frame centered on a time */
+typedef struct WavPitchEstimate {
+    double      time;           // Center of the frame in seconds
+    float       frequency;      // Hz, 0 if unvoiced
+    float       confidence;     // Periodicity of the frame, 0 to 1
+} WavPitchEstimate;
+
+typedef struct WavPitchTrack {
+    WavPitchEstimate*   estimates;
+    size_t              nbEstimates;
+} WavPitchTrack;
+
+/**
+ * @details Difference functions are computed with FFT correlations:
+ *          YIN correlates the window with the window and the longest lag
+ *          that follow it, MPM takes the autocorrelation of the window.
+ *          Buffers are allocated once per tracker.
+ *
+ */
+typedef struct WavPitchTracker {
+    WavPitchConfig  config;
+    uint32_t        sampleRate;
+    uint32_t        minLag;
+    uint32_t        maxLag;
+    uint32_t        window;
+    uint32_t        frameLength;    // Samples of an analysis frame
+    WavFft          fft;
+    float*          input;          // fft.size samples
+    float*          spectrum;       // fft.size + 2 floats
+    float*          spectrumB;
+    float*          function;       // Difference or NSDF, maxLag + 2 values
+} WavPitchTracker;
+
+
+void wav_pitch_config_default (WavPitchConfig* config)
+{
+    config->method = WAV_PITCH_YIN;
+    config->minFrequency = 60.0f;
+    config->maxFrequency = 1000.0f;
+    config->window = 0;
+    config->hop = 0;
+    config->threshold = 0.0f;
+}
+
+
+/**
+ * @brief   Prepare a tracker for a sample rate
+ * @details The default window is the longest period for YIN and two
+ *          longest periods for MPM, the shortest windows holding a period.
+ *          The default threshold depends on the estimator as well.
+ *
+ * @param[out]  tracker     Pointer to the tracker, to close with wav_pitch_close
+ * @param[in]   config      Pointer to the configuration
+ * @param[in]   sampleRate  Sample rate of the signal in Hz
+ * @returns                 None
+ *
+ */
+void wav_pitch_open (WavPitchTracker* tracker,
+                     const WavPitchConfig* config,
+                     uint32_t sampleRate)
+{
+    if (config->minFrequency <= 0 || config->maxFrequency <= config->minFrequency ||
+        config->maxFrequency > sampleRate / 2)
+    {
+        fprintf(stderr, "Invalid pitch range %g to %g Hz\n", config->minFrequency, config->maxFrequency);
+        exit(1);
+    }
+
+    memcpy(&tracker->config, config, sizeof(WavPitchConfig));
+    tracker->sampleRate = sampleRate;
+    tracker->minLag = (uint32_t)floorf(sampleRate / config->maxFrequency);
+    tracker->maxLag = (uint32_t)ceilf(sampleRate / config->minFrequency);
+    tracker->minLag = tracker->minLag > 2 ? tracker->minLag : 2;
+
+    if (!tracker->config.hop)
+        tracker->config.hop = sampleRate / 100;
+    if (!tracker->config.threshold)
+        tracker->config.threshold = config->method == WAV_PITCH_MPM ? WAV_PITCH_MPM_THRESHOLD
+                                                                    : WAV_PITCH_YIN_THRESHOLD;
+
+    size_t size;
+    if (config->method == WAV_PITCH_MPM) {
+        tracker->window = config->window ? config->window : 2 * tracker->maxLag;
+        tracker->maxLag = tracker->maxLag < tracker->window - 1 ? tracker->maxLag : tracker->window - 1;
+        tracker->frameLength = tracker->window;
+        size = wav_fft_size(2 * tracker->window);
+    }
+    else {
+        tracker->window = config->window ? config->window : tracker->maxLag;
+        tracker->frameLength = tracker->window + tracker->maxLag;
+        size = wav_fft_size(tracker->frameLength);
+    }
+
+    wav_fft_init(&tracker->fft, size);
+    tracker->input = (float*)calloc(size, sizeof(float));
+    tracker->spectrum = (float*)malloc((size + 2) * sizeof(float));
+    tracker->spectrumB = (float*)malloc((size + 2) * sizeof(float));
+    tracker->function = (float*)malloc((tracker->maxLag + 2) * sizeof(float));
+
+    if (!tracker->input || !tracker->spectrum || !tracker->spectrumB || !tracker->function) {
+        fprintf(stderr, "Cannot allocate memory for pitch tracker\n");
+        exit(1);
+    }
+}
+
+
+void wav_pitch_close (WavPitchTracker* tracker)
+{
+    wav_fft_free(&tracker->fft);
+    free(tracker->input);
+    free(tracker->spectrum);
+    free(tracker->spectrumB);
+    free(tracker->function);
+}
+
+
+/* Vertex of the parabola through f[t - 1], f[t], f[t + 1], as a lag */
+float wav_pitch_interpolate (const float* function,
+                             uint32_t lag)
+{
+    float left = function[lag - 1], center = function[lag], right = function[lag + 1];
+    float curvature = left - 2 * center + right;
+
+    if (curvature == 0.0f)
+        return lag;
+    return lag + 0.5f * (left - right) / curvature;
+}
+
+
+/* YIN of a frame of window + maxLag samples */
+void wav_pitch_yin (WavPitchTracker* tracker,
+                    const float* frame,
+                    WavPitchEstimate* estimate)
+{
+    size_t size = tracker->fft.size;
+    uint32_t window = tracker->window;
+    uint32_t maxLag = tracker->maxLag;
+    float* d = tracker->function;
+
+    // r(t) = sum of x[j] x[j + t] for j < window, from conj(FFT(window)) FFT(frame)
+    memcpy(tracker->input, frame, tracker->frameLength * sizeof(float));
+    memset(tracker->input + tracker->frameLength, 0, (size - tracker->frameLength) * sizeof(float));
+    wav_fft_forward(&tracker->fft, tracker->input, tracker->spectrumB);
+    memset(tracker->input + window, 0, (tracker->frameLength - window) * sizeof(float));
+    wav_fft_forward(&tracker->fft, tracker->input, tracker->spectrum);
+
+    float* a = tracker->spectrum;
+    const float* b = tracker->spectrumB;
+    for (size_t k = 0; k <= size / 2; ++k) {
+        float re = a[2 * k] * b[2 * k] + a[2 * k + 1] * b[2 * k + 1];
+        float im = a[2 * k] * b[2 * k + 1] - a[2 * k + 1] * b[2 * k];
+        a[2 * k] = re;
+        a[2 * k + 1] = im;
+    }
+    wav_fft_inverse(&tracker->fft, a, tracker->input);
+
+    // d(t) = E(0) + E(t) - 2 r(t), with E(t) the energy of x[t, t + window)
+    double energy0 = 0.0;
+    for (uint32_t j = 0; j < window; ++j)
+        energy0 += (double)frame[j] * frame[j];
+
+    double energy = energy0;
+    double sum = 0.0;
+    float scale = 2.0f / size;
+    d[0] = 1.0f;
+
+    for (uint32_t t = 1; t <= maxLag; ++t) {
+        energy += (double)frame[t + window - 1] * frame[t + window - 1] - (double)frame[t - 1] * frame[t - 1];
+        double difference = energy0 + energy - scale * tracker->input[t];
+        difference = difference > 0.0 ? difference : 0.0;
+
+        // Cumulative mean normalized difference
+        sum += difference;
+        d[t] = sum > 0.0 ? (float)(difference * t / sum) : 1.0f;
+    }
+    d[maxLag + 1] = d[maxLag];
+
+    // First dip under the threshold, followed to its minimum
+    uint32_t best = 0;
+    for (uint32_t t = tracker->minLag; t <= maxLag; ++t) {
+        if (d[t] < tracker->config.threshold) {
+            while (t + 1 <= maxLag && d[t + 1] < d[t])
+                ++t;
+            best = t;
+            break;
+        }
+    }
+
+    if (best == 0) {
+        float minimum = 1.0f;
+        for (uint32_t t = tracker->minLag; t <= maxLag; ++t)
+            minimum = d[t] < minimum ? d[t] : minimum;
+        estimate->frequency = 0.0f;
+        estimate->confidence = 1.0f - minimum > 0.0f ? 1.0f - minimum : 0.0f;
+        return;
+    }
+
+    estimate->frequency = tracker->sampleRate / wav_pitch_interpolate(d, best);
+    estimate->confidence = 1.0f - d[best] > 0.0f ? 1.0f - d[best] : 0.0f;
+}
+
+
+/* MPM of a frame of window samples */
+void wav_pitch_mpm (WavPitchTracker* tracker,
+                    const float* frame,
+                    WavPitchEstimate* estimate)
+{
+    size_t size = tracker->fft.size;
+    uint32_t window = tracker->window;
+    uint32_t maxLag = tracker->maxLag;
+    float* n = tracker->function;
+
+    // Autocorrelation of the window from its power spectrum
+    memcpy(tracker->input, frame, window * sizeof(float));
+    memset(tracker->input + window, 0, (size - window) * sizeof(float));
+    wav_fft_forward(&tracker->fft, tracker->input, tracker->spectrum);
+
+    float* a = tracker->spectrum;
+    for (size_t k = 0; k <= size / 2; ++k) {
+        a[2 * k] = a[2 * k] * a[2 * k] + a[2 * k + 1] * a[2 * k + 1];
+        a[2 * k + 1] = 0.0f;
+    }
+    wav_fft_inverse(&tracker->fft, a, tracker->input);
+
+    // n(t) = 2 r(t) / m(t), m(t) the energy of x[0, window - t) and x[t, window)
+    double m = 0.0;
+    for (uint32_t j = 0; j < window; ++j)
+        m += 2.0 * frame[j] * frame[j];
+
+    double scale = 2.0 / size;
+    n[0] = 1.0f;
+    for (uint32_t t = 1; t <= maxLag; ++t) {
+        m -= (double)frame[t - 1] * frame[t - 1] + (double)frame[window - t] * frame[window - t];
+        n[t] = m > 0.0 ? (float)(scale * tracker->input[t] / m) : 0.0f;
+    }
+    n[maxLag + 1] = n[maxLag];
+
+    // Key maxima: highest value between a positive and a negative zero crossing
+    uint32_t keys[64];
+    unsigned nbKeys = 0;
+    float highest = 0.0f;
+    uint32_t t = 1;
+
+    while (t < maxLag && n[t] > 0.0f)
+        ++t;
+    while (t < maxLag && nbKeys < 64) {
+        while (t < maxLag && n[t] <= 0.0f)
+            ++t;
+
+        uint32_t key = 0;
+        for (; t < maxLag && n[t] > 0.0f; ++t) {
+            if (t >= tracker->minLag && (key == 0 || n[t] > n[key]) && n[t] >= n[t - 1] && n[t] >= n[t + 1])
+                key = t;
+        }
+        if (key) {
+            keys[nbKeys++] = key;
+            highest = n[key] > highest ? n[key] : highest;
+        }
+    }
+
+    // The confidence is the clarity of the chosen key, under WAV_PITCH_MPM_CLARITY if unvoiced
+    estimate->frequency = 0.0f;
+    estimate->confidence = 0.0f;
+
+    for (unsigned k = 0; k < nbKeys; ++k) {
+        if (n[keys[k]] >= tracker->config.threshold * highest) {
+            if (n[keys[k]] >= WAV_PITCH_MPM_CLARITY)
+                estimate->frequency = tracker->sampleRate / wav_pitch_interpolate(n, keys[k]);
+            estimate->confidence = n[keys[k]] < 1.0f ? n[keys[k]] : 1.0f;
+            break;
+        }
+    }
+}
+
+
+/**
+ * @brief   Estimate the pitch of one analysis frame
+ *
+ * @param[in]   tracker   Pointer to the tracker
+ * @param[in]   frame     tracker->frameLength mono samples
+ * @param[out]  estimate  Pointer to the estimate, time is left unchanged
+ * @returns               None
+ *
+ */
+void wav_pitch_frame (WavPitchTracker* tracker,
+                      const float* frame,
+                      WavPitchEstimate* estimate)
+{
+    if (tracker->config.method == WAV_PITCH_MPM)
+        wav_pitch_mpm(tracker, frame, estimate);
+    else
+        wav_pitch_yin(tracker, frame, estimate);
+}
+
+
+/**
+ * @brief   Track the pitch of a whole source
+ * @details The source is read block by block and mixed to mono; an
+ *          estimate is made every hop frames, as long as a whole analysis
+ *          frame is available.
+ *
+ * @param[in]   source    Pointer to the source, read from its first frame
+ * @param[in]   config    Pointer to the configuration
+ * @param[out]  track     Pointer to the estimates, to free with wav_pitch_track_free
+ * @returns               None
+ *
+ */
+void wav_pitch_track (WavSource* source,
+                      const WavPitchConfig* config,
+                      WavPitchTrack* track)
+{
+    WavPitchTracker tracker;
+    unsigned nbChannels = source->header.NbChannels;
+
+    wav_pitch_open(&tracker, config, source->header.SampleRate);
+
+    uint32_t hop = tracker.config.hop;
+    uint32_t frameLength = tracker.frameLength;
+    size_t capacity = frameLength + WAV_ANALYSIS_BLOCK;
+    float* signal = (float*)malloc(capacity * sizeof(float));
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    size_t nbEstimates = source->nbFrames != WAV_UNKNOWN_FRAMES && source->nbFrames >= frameLength ?
+                         (source->nbFrames - frameLength) / hop + 1 : 1024;
+
+    track->nbEstimates = 0;
+    track->estimates = (WavPitchEstimate*)malloc(nbEstimates * sizeof(WavPitchEstimate));
+
+    if (!signal || !block || !track->estimates) {
+        fprintf(stderr, "Cannot allocate memory for pitch tracking\n");
+        exit(1);
+    }
+
+    WAV_TRACE_BEGIN("pitch");
+    wav_source_seek(source, 0);
+
+    // signal[0] is frame offset of the source, next frame at position
+    uint64_t offset = 0;
+    uint64_t position = 0;
+    size_t length = 0;
+    size_t nbRead;
+
+    while ((nbRead = wav_source_read(source, block, WAV_ANALYSIS_BLOCK))) {
+        // Drop the samples before the next analysis frame
+        size_t drop = position - offset < length ? position - offset : length;
+        memmove(signal, signal + drop, (length - drop) * sizeof(float));
+        length -= drop;
+        offset += drop;
+
+        wav_mix_to_mono(signal + length, block, nbRead, nbChannels);
+        length += nbRead;
+
+        while (position >= offset && position - offset + frameLength <= length) {
+            if (track->nbEstimates == nbEstimates) {
+                nbEstimates *= 2;
+                track->estimates = (WavPitchEstimate*)realloc(track->estimates,
+                                                              nbEstimates * sizeof(WavPitchEstimate));
+                if (!track->estimates) {
+                    fprintf(stderr, "Cannot allocate memory for pitch tracking\n");
+                    exit(1);
+                }
+            }
+
+            WavPitchEstimate* estimate = &track->estimates[track->nbEstimates++];
+            wav_pitch_frame(&tracker, signal + (position - offset), estimate);
+            estimate->time = (position + tracker.window / 2.0) / source->header.SampleRate;
+            position += hop;
+        }
+    }
+    WAV_TRACE_END("pitch");
+
+    free(block);
+    free(signal);
+    wav_pitch_close(&tracker);
+}
+
+
+void wav_pitch_track_free (WavPitchTrack* track)
+{
+    free(track->estimates);
+    track->estimates = NULL;
+    track->nbEstimates = 0;
+}
+
+
+/* Files of wav_pitch_batch, taken in turn by the threads */
+typedef struct WavPitchBatch {
+    const char* const*      files;
+    size_t                  nbFiles;
+    const WavPitchConfig*   config;
+    WavPitchTrack*          tracks;
+    size_t                  next;
+} WavPitchBatch;
+
+
+void* wav_pitch_worker (void* arg)
+{
+    WavPitchBatch* batch = (WavPitchBatch*)arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->nbFiles) {
+        WavReader* reader = wav_reader_open(batch->files[i]);
+        wav_pitch_track(&reader->source, batch->config, &batch->tracks[i]);
+        wav_source_close(&reader->source);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief   Track the pitch of many files with a pool of threads
+ *
+ * @param[in]   files      Array of filenames
+ * @param[in]   nbFiles    Number of files
+ * @param[in]   config     Pointer to the configuration shared by all files
+ * @param[in]   nbThreads  Number of threads, 0 for one per CPU
+ * @param[out]  tracks     Array of nbFiles tracks, to free with wav_pitch_track_free
+ * @returns                None
+ *
+ */
+void wav_pitch_batch (const char* const* files,
+                      size_t nbFiles,
+                      const WavPitchConfig* config,
+                      unsigned nbThreads,
+                      WavPitchTrack* tracks)
+{
+    WavPitchBatch batch = { files, nbFiles, config, tracks, 0 };
+
+    if (nbThreads == 0)
+        nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nbThreads = nbThreads < nbFiles ? nbThreads : nbFiles;
+
+    pthread_t* threads = (pthread_t*)calloc(nbThreads + 1, sizeof(pthread_t));
+    if (!threads) {
+        fprintf(stderr, "Cannot allocate memory for threads\n");
+        exit(1);
+    }
+
+    for (unsigned t = 0; t < nbThreads; ++t) {
+        if (pthread_create(&threads[t], NULL, wav_pitch_worker, &batch)) {
+            fprintf(stderr, "Cannot start pitch thread\n");
+            exit(1);
+        }
+    }
+
+    for (unsigned t = 0; t < nbThreads; ++t)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_PITCH_H__
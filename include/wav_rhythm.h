@@ -0,0 +1,374 @@
+/**
+ ******************************************************************************
+ * @file     wav_rhythm.h
+ * @brief    Detect onsets and estimate the tempo of streamed signals
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_RHYTHM_H__
+#define __WAV_RHYTHM_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include "wav_analysis.h"
+#include "wav_stft.h"
+
+/* Frames of novelty averaged before and after a frame for its threshold */
+#define WAV_RHYTHM_BEFORE   16
+#define WAV_RHYTHM_AFTER    3
+
+/* Frames around an onset where novelty must be lower, and between onsets */
+#define WAV_RHYTHM_PEAK     3
+#define WAV_RHYTHM_WAIT     3
+
+/* Novelty values kept, power of two above WAV_RHYTHM_BEFORE + WAV_RHYTHM_AFTER */
+#define WAV_RHYTHM_RING     32
+
+/* Frames of the running average of the novelty, about 3 s at the default hop */
+#define WAV_RHYTHM_LEVEL    256
+
+typedef struct WavRhythmConfig {
+    uint32_t    frameSize;      // Samples of the STFT frames, power of two
+    uint32_t    hop;            // Samples between STFT frames
+    float       threshold;      // Novelty above the local mean of an onset, times the average novelty
+    float       minTempo;       // Slowest tempo searched in beats per minute
+    float       maxTempo;       // Fastest tempo searched
+} WavRhythmConfig;
+
+typedef struct WavOnset {
+    double      time;           // Seconds
+    float       strength;       // Novelty above the local mean
+} WavOnset;
+
+/* Onsets and beat grid of a signal: beats at firstBeat + k 60 / tempo seconds */
+typedef struct WavRhythm {
+    WavOnset*   onsets;
+    size_t      nbOnsets;
+    double      tempo;          // Beats per minute, 0 if not found
+    double      firstBeat;      // Seconds, below one beat period
+    float       confidence;     // Autocorrelation of the novelty at the beat period, 0 to 1
+} WavRhythm;
+
+/**
+ * @details Novelty is the spectral flux of the frames: the increase of
+ *          their log magnitudes, summed over the bins. A frame is decided
+ *          WAV_RHYTHM_AFTER frames after its own. Its novelty above the
+ *          local mean is an onset when higher than the threshold times the
+ *          running average of the novelty, so that the threshold does not
+ *          depend on the level or the density of the signal, and feeds a
+ *          running autocorrelation over the lags of the tempo range.
+ *          Memory is bounded by the frame size and the slowest tempo,
+ *          apart from the onsets found.
+ *
+ */
+typedef struct WavRhythmTracker {
+    WavRhythmConfig config;
+    uint32_t        sampleRate;
+    WavStft         stft;
+    float*          magnitudes;     // Log magnitudes of the last frame
+    float*          previous;       // Log magnitudes of the frame before
+    float           novelty[WAV_RHYTHM_RING];
+    uint64_t        nbNovelty;      // Frames of novelty computed
+    uint64_t        nbDecided;      // Frames decided
+    uint64_t        lastOnset;      // Frame of the last onset plus one, 0 if none
+    double          level;          // Running average of the novelty
+    uint32_t        minLag;         // Autocorrelation lags in frames
+    uint32_t        maxLag;
+    float*          envelope;       // Last maxLag + 1 novelties above the local mean
+    double*         correlation;    // Autocorrelation of envelope, maxLag + 1 sums
+    WavOnset*       onsets;
+    size_t          nbOnsets;
+    size_t          capacity;
+} WavRhythmTracker;
+
+
+void wav_rhythm_config_default (WavRhythmConfig* config)
+{
+    config->frameSize = 2048;
+    config->hop = 512;
+    config->threshold = 1.0f;
+    config->minTempo = 60.0f;
+    config->maxTempo = 200.0f;
+}
+
+
+/**
+ * @brief   Prepare a tracker for a sample rate
+ *
+ * @param[out]  tracker     Pointer to the tracker, to close with wav_rhythm_close
+ * @param[in]   config      Pointer to the configuration
+ * @param[in]   sampleRate  Sample rate of the signal in Hz
+ * @returns                 None
+ *
+ */
+void wav_rhythm_open (WavRhythmTracker* tracker,
+                      const WavRhythmConfig* config,
+                      uint32_t sampleRate)
+{
+    double frameRate = (double)sampleRate / config->hop;
+
+    if (config->minTempo <= 0 || config->maxTempo <= config->minTempo ||
+        60.0 * frameRate / config->maxTempo < 2.0)
+    {
+        fprintf(stderr, "Invalid tempo range %g to %g bpm\n", config->minTempo, config->maxTempo);
+        exit(1);
+    }
+
+    memset(tracker, 0, sizeof(WavRhythmTracker));
+    memcpy(&tracker->config, config, sizeof(WavRhythmConfig));
+    tracker->sampleRate = sampleRate;
+    wav_stft_init(&tracker->stft, config->frameSize, config->hop);
+
+    tracker->minLag = (uint32_t)floor(60.0 * frameRate / config->maxTempo);
+    tracker->maxLag = (uint32_t)ceil(60.0 * frameRate / config->minTempo) + 1;
+    tracker->magnitudes = (float*)malloc((config->frameSize / 2 + 1) * sizeof(float));
+    tracker->previous = (float*)calloc(config->frameSize / 2 + 1, sizeof(float));
+    tracker->envelope = (float*)calloc(tracker->maxLag + 1, sizeof(float));
+    tracker->correlation = (double*)calloc(tracker->maxLag + 1, sizeof(double));
+
+    if (!tracker->magnitudes || !tracker->previous || !tracker->envelope || !tracker->correlation) {
+        fprintf(stderr, "Cannot allocate memory for rhythm tracker\n");
+        exit(1);
+    }
+}
+
+
+void wav_rhythm_close (WavRhythmTracker* tracker)
+{
+    wav_stft_free(&tracker->stft);
+    free(tracker->magnitudes);
+    free(tracker->previous);
+    free(tracker->envelope);
+    free(tracker->correlation);
+    free(tracker->onsets);
+}
+
+
+/* Decide whether frame t is an onset, with novelty known up to frame last */
+void wav_rhythm_decide (WavRhythmTracker* tracker,
+                        uint64_t t,
+                        uint64_t last)
+{
+    const float* novelty = tracker->novelty;
+    uint64_t from = t > WAV_RHYTHM_BEFORE ? t - WAV_RHYTHM_BEFORE : 0;
+    uint64_t to = t + WAV_RHYTHM_AFTER < last ? t + WAV_RHYTHM_AFTER : last;
+    float value = novelty[t % WAV_RHYTHM_RING];
+    float mean = 0.0f;
+    int peak = 1;
+
+    for (uint64_t i = from; i <= to; ++i) {
+        float other = novelty[i % WAV_RHYTHM_RING];
+        mean += other;
+        // Ties go to the first frame of a plateau
+        if ((i + WAV_RHYTHM_PEAK >= t && i < t && other >= value) ||
+            (i > t && i <= t + WAV_RHYTHM_PEAK && other > value))
+            peak = 0;
+    }
+    mean /= (float)(to - from + 1);
+
+    float strength = value - mean > 0.0f ? value - mean : 0.0f;
+
+    // The threshold follows the level of the signal: a plain mean at first, then an exponential one
+    double weight = t + 1 < WAV_RHYTHM_LEVEL ? 1.0 / (t + 1) : 1.0 / WAV_RHYTHM_LEVEL;
+    tracker->level += (value - tracker->level) * weight;
+
+    if (peak && strength > tracker->config.threshold * tracker->level &&
+        (tracker->lastOnset == 0 || t + 1 - tracker->lastOnset >= WAV_RHYTHM_WAIT))
+    {
+        if (tracker->nbOnsets == tracker->capacity) {
+            tracker->capacity = tracker->capacity ? 2 * tracker->capacity : 256;
+            tracker->onsets = (WavOnset*)realloc(tracker->onsets, tracker->capacity * sizeof(WavOnset));
+            if (!tracker->onsets) {
+                fprintf(stderr, "Cannot allocate memory for onsets\n");
+                exit(1);
+            }
+        }
+
+        WavOnset* onset = &tracker->onsets[tracker->nbOnsets++];
+        onset->time = ((double)t * tracker->config.hop + tracker->config.frameSize / 2) / tracker->sampleRate;
+        onset->strength = strength;
+        tracker->lastOnset = t + 1;
+    }
+
+    // Running autocorrelation of the envelope
+    uint32_t size = tracker->maxLag + 1;
+    float* envelope = tracker->envelope;
+    uint32_t maxLag = t < tracker->maxLag ? (uint32_t)t : tracker->maxLag;
+    uint32_t index = t % size;
+
+    envelope[index] = strength;
+    for (uint32_t lag = 0; lag <= maxLag; ++lag)
+        tracker->correlation[lag] += (double)strength * envelope[index >= lag ? index - lag : index + size - lag];
+
+    tracker->nbDecided = t + 1;
+}
+
+
+/**
+ * @brief   Analyze a block of a mono signal
+ *
+ * @param[in]   tracker   Pointer to the tracker
+ * @param[in]   samples   Samples from -1 to 1
+ * @param[in]   count     Number of samples
+ * @returns               None
+ *
+ */
+void wav_rhythm_push (WavRhythmTracker* tracker,
+                      const float* samples,
+                      size_t count)
+{
+    uint32_t nbBins = tracker->config.frameSize / 2 + 1;
+
+    while (wav_stft_analyze(&tracker->stft, &samples, &count)) {
+        float* magnitudes = tracker->magnitudes;
+        wav_stft_magnitudes(&tracker->stft, magnitudes);
+
+        // Log compression makes the flux less dependent on the level
+        float flux = 0.0f;
+        for (uint32_t k = 0; k < nbBins; ++k) {
+            magnitudes[k] = logf(1.0f + magnitudes[k]);
+            float increase = magnitudes[k] - tracker->previous[k];
+            flux += increase > 0.0f ? increase : 0.0f;
+        }
+
+        tracker->novelty[tracker->nbNovelty % WAV_RHYTHM_RING] = tracker->nbNovelty ? flux / nbBins : 0.0f;
+        tracker->magnitudes = tracker->previous;
+        tracker->previous = magnitudes;
+
+        if (tracker->nbNovelty >= WAV_RHYTHM_AFTER)
+            wav_rhythm_decide(tracker, tracker->nbNovelty - WAV_RHYTHM_AFTER, tracker->nbNovelty);
+        tracker->nbNovelty++;
+    }
+}
+
+
+/**
+ * @brief   Decide the last frames and estimate the tempo
+ * @details The tempo is the lag of the highest autocorrelation, weighted by
+ *          a log-normal preference for 120 bpm against octave errors and
+ *          interpolated between frames. The first beat is the circular mean
+ *          of the onset times modulo the beat period, weighted by strength.
+ *          The onsets are moved to the result and the tracker can be closed.
+ *
+ * @param[in]   tracker   Pointer to the tracker
+ * @param[out]  rhythm    Pointer to the result, to free with wav_rhythm_free
+ * @returns               None
+ *
+ */
+void wav_rhythm_finish (WavRhythmTracker* tracker,
+                        WavRhythm* rhythm)
+{
+    while (tracker->nbDecided < tracker->nbNovelty)
+        wav_rhythm_decide(tracker, tracker->nbDecided, tracker->nbNovelty - 1);
+
+    const double* correlation = tracker->correlation;
+    double frameRate = (double)tracker->sampleRate / tracker->config.hop;
+    uint32_t best = 0;
+    double bestScore = 0.0;
+
+    for (uint32_t lag = tracker->minLag > 1 ? tracker->minLag : 1; lag < tracker->maxLag; ++lag) {
+        double octaves = log2(60.0 * frameRate / lag / 120.0);
+        double score = correlation[lag] * exp(-0.5 * octaves * octaves);
+        if (score > bestScore) {
+            bestScore = score;
+            best = lag;
+        }
+    }
+
+    rhythm->onsets = tracker->onsets;
+    rhythm->nbOnsets = tracker->nbOnsets;
+    rhythm->tempo = 0.0;
+    rhythm->firstBeat = 0.0;
+    rhythm->confidence = 0.0f;
+    tracker->onsets = NULL;
+    tracker->nbOnsets = tracker->capacity = 0;
+
+    if (best == 0)
+        return;
+
+    double lag = best;
+    double curvature = correlation[best - 1] - 2 * correlation[best] + correlation[best + 1];
+    if (curvature < 0.0)
+        lag += 0.5 * (correlation[best - 1] - correlation[best + 1]) / curvature;
+
+    double period = lag / frameRate;
+    double sumCos = 0.0, sumSin = 0.0;
+    for (size_t i = 0; i < rhythm->nbOnsets; ++i) {
+        double angle = 2 * M_PI * rhythm->onsets[i].time / period;
+        sumCos += rhythm->onsets[i].strength * cos(angle);
+        sumSin += rhythm->onsets[i].strength * sin(angle);
+    }
+
+    double phase = atan2(sumSin, sumCos);
+    rhythm->tempo = 60.0 / period;
+    rhythm->firstBeat = (phase < 0.0 ? phase + 2 * M_PI : phase) / (2 * M_PI) * period;
+    rhythm->confidence = correlation[0] > 0.0 ? (float)(correlation[best] / correlation[0]) : 0.0f;
+}
+
+
+void wav_rhythm_free (WavRhythm* rhythm)
+{
+    free(rhythm->onsets);
+    rhythm->onsets = NULL;
+    rhythm->nbOnsets = 0;
+}
+
+
+/**
+ * @brief   Detect the onsets and the tempo of a whole source
+ * @details The source is read block by block and mixed to mono.
+ *
+ * @param[in]   source    Pointer to the source, read from its first frame
+ * @param[in]   config    Pointer to the configuration
+ * @param[out]  rhythm    Pointer to the result, to free with wav_rhythm_free
+ * @returns               None
+ *
+ */
+void wav_rhythm_source (WavSource* source,
+                        const WavRhythmConfig* config,
+                        WavRhythm* rhythm)
+{
+    WavRhythmTracker tracker;
+    unsigned nbChannels = source->header.NbChannels;
+    int16_t* block = (int16_t*)malloc(WAV_ANALYSIS_BLOCK * source->header.BytePerChunk);
+    float* signal = (float*)malloc(WAV_ANALYSIS_BLOCK * sizeof(float));
+    size_t nbRead;
+
+    if (!block || !signal) {
+        fprintf(stderr, "Cannot allocate memory for rhythm analysis\n");
+        exit(1);
+    }
+
+    wav_rhythm_open(&tracker, config, source->header.SampleRate);
+
+    WAV_TRACE_BEGIN("rhythm");
+    wav_source_seek(source, 0);
+
+    while ((nbRead = wav_source_read(source, block, WAV_ANALYSIS_BLOCK))) {
+        wav_mix_to_mono(signal, block, nbRead, nbChannels);
+        wav_rhythm_push(&tracker, signal, nbRead);
+    }
+
+    wav_rhythm_finish(&tracker, rhythm);
+    WAV_TRACE_END("rhythm");
+
+    wav_rhythm_close(&tracker);
+    free(signal);
+    free(block);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_RHYTHM_H__
@@ -0,0 +1,599 @@
+/**
+ ******************************************************************************
+ * @file     wav_server.h
+ * @brief    Serve ranges, statistics and overviews of wav files over a Unix socket
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_SERVER_H__
+#define __WAV_SERVER_H__
+
+/* memfd_create and file seals: include this header before the system headers */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "wav_analysis.h"
+#include "wav_buffer.h"
+
+/* Maximum length of a path in a request, including the terminating zero */
+#define WAV_SERVER_PATH_MAX 1024
+
+/* Number of statistics and overviews kept by the server */
+#define WAV_SERVER_RESULTS 64
+
+/* Number of frames given at once to wav_stats_update */
+#define WAV_SERVER_STATS_BLOCK (1 << 20)
+
+/* Request types */
+#define WAV_SERVER_RANGE    1   // Frames [start, start + nbFrames) of the file
+#define WAV_SERVER_STATS    2   // WavStats of the whole file
+#define WAV_SERVER_PEAKS    3   // Min/max overview of binFrames frames per bin
+
+/**
+ * @details Requests and replies are fixed-size messages. The payload of
+ *          a reply is not sent on the socket: it is written once in a
+ *          sealed memfd whose descriptor is passed with the reply
+ *          (SCM_RIGHTS), and mapped read-only by the client.
+ *
+ */
+typedef struct WavServerRequest {
+    uint32_t    type;
+    uint32_t    binFrames;      // WAV_SERVER_PEAKS only
+    uint64_t    start;          // WAV_SERVER_RANGE only
+    uint64_t    nbFrames;       // WAV_SERVER_RANGE only, clamped to the file
+    char        path[WAV_SERVER_PATH_MAX];
+} WavServerRequest;
+
+typedef struct WavServerReply {
+    int32_t     status;         // 0 on success, errno value otherwise
+    uint32_t    reserved;
+    WavHeader   header;         // Format of the file
+    uint64_t    nbFrames;       // Number of frames of the file
+    uint64_t    size;           // Size of the payload, no descriptor if 0
+} WavServerReply;
+
+/**
+ * @details Statistics and overviews are computed once per mapping of a
+ *          file and their memfd is shared by all the clients. A result
+ *          keeps its buffer, so a file modified since is mapped again and
+ *          gets new results, while the old ones age out.
+ *
+ */
+typedef struct WavServerResult {
+    WavBuffer   buffer;         // Mapping the result was computed on
+    uint32_t    type;
+    uint32_t    binFrames;
+    int         fd;             // Sealed memfd of the payload
+    uint64_t    size;
+    uint64_t    lastUse;
+} WavServerResult;
+
+typedef struct WavServer {
+    int             listener;
+    WavServerResult results[WAV_SERVER_RESULTS];
+    size_t          nbResults;
+    uint64_t        clock;
+    pthread_mutex_t lock;
+} WavServer;
+
+typedef struct WavServerClient {
+    WavServer*  server;
+    int         fd;
+} WavServerClient;
+
+
+/**
+ * @brief   Copy a payload into a new sealed memfd
+ *
+ * @param[in]   data      Payload
+ * @param[in]   size      Size of the payload in bytes
+ * @returns               Descriptor of the memfd, negative errno value on failure
+ *
+ */
+int wav_server_memfd (const void* data,
+                      uint64_t size)
+{
+    int fd = memfd_create("wav_server", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    const char* bytes = (const char*)data;
+    int status;
+
+    if (fd < 0)
+        return -errno;
+
+    while (size) {
+        ssize_t nbWritten = write(fd, bytes, size);
+        if (nbWritten <= 0) {
+            status = nbWritten ? errno : EIO;
+            close(fd);
+            return -status;
+        }
+        bytes += nbWritten;
+        size -= nbWritten;
+    }
+
+    // Clients may rely on the content: it can no longer change
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        status = errno;
+        close(fd);
+        return -status;
+    }
+    return fd;
+}
+
+
+/**
+ * @brief   Get the memfd of the statistics or overview of a buffer
+ * @details Results are looked up by storage, which a result keeps alive,
+ *          so a storage address cannot be reused while it is cached.
+ *          The least recently used result is replaced when all are taken.
+ *
+ * @returns               Duplicated descriptor to close, negative errno value on failure
+ *
+ */
+int wav_server_result (WavServer* server,
+                       const WavBuffer* buffer,
+                       uint32_t type,
+                       uint32_t binFrames,
+                       uint64_t* size)
+{
+    pthread_mutex_lock(&server->lock);
+    for (size_t r = 0; r < server->nbResults; ++r) {
+        WavServerResult* result = &server->results[r];
+        if (result->buffer.storage == buffer->storage && result->type == type &&
+            result->binFrames == binFrames)
+        {
+            int fd = dup(result->fd);
+            result->lastUse = ++server->clock;
+            *size = result->size;
+            pthread_mutex_unlock(&server->lock);
+            return fd < 0 ? -errno : fd;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    // Computed without the lock: concurrent misses compute it twice at worst
+    int fd;
+    if (type == WAV_SERVER_STATS) {
+        WavStats stats;
+
+        wav_stats_init(&stats, buffer->header.NbChannels);
+        for (uint64_t i = 0; i < buffer->nbFrames; i += WAV_SERVER_STATS_BLOCK) {
+            uint64_t nbFrames = buffer->nbFrames - i;
+            nbFrames = nbFrames < WAV_SERVER_STATS_BLOCK ? nbFrames : WAV_SERVER_STATS_BLOCK;
+            wav_stats_update(&stats, buffer->data + i * buffer->header.NbChannels, nbFrames);
+        }
+        wav_stats_finish(&stats);
+
+        *size = sizeof(WavStats);
+        fd = wav_server_memfd(&stats, *size);
+    }
+    else {
+        WavSource* source = wav_buffer_source_open(buffer);
+        WavPeaks peaks;
+        int status = wav_peaks_compute_checked(source, binFrames, &peaks);
+
+        wav_source_close(source);
+        if (status)
+            return -status;
+
+        *size = peaks.nbBins * peaks.nbChannels * 2 * sizeof(int16_t);
+        fd = wav_server_memfd(peaks.data, *size);
+        wav_peaks_free(&peaks);
+    }
+
+    if (fd < 0)
+        return fd;
+
+    pthread_mutex_lock(&server->lock);
+    WavServerResult* result = &server->results[0];
+    if (server->nbResults < WAV_SERVER_RESULTS) {
+        result = &server->results[server->nbResults++];
+    }
+    else {
+        for (size_t r = 1; r < WAV_SERVER_RESULTS; ++r) {
+            if (server->results[r].lastUse < result->lastUse)
+                result = &server->results[r];
+        }
+        close(result->fd);
+        wav_buffer_release(&result->buffer);
+    }
+
+    wav_buffer_retain(&result->buffer, buffer);
+    result->type = type;
+    result->binFrames = binFrames;
+    result->fd = fd;
+    result->size = *size;
+    result->lastUse = ++server->clock;
+    fd = dup(fd);
+    pthread_mutex_unlock(&server->lock);
+    return fd < 0 ? -errno : fd;
+}
+
+
+/**
+ * @brief   Answer one request
+ *
+ * @param[in]   server    Pointer to the server
+ * @param[in]   request   Pointer to the request
+ * @param[out]  reply     Pointer to the reply
+ * @returns               Descriptor of the payload to send and close, -1 if none
+ *
+ */
+int wav_server_answer (WavServer* server,
+                       const WavServerRequest* request,
+                       WavServerReply* reply)
+{
+    WavBuffer buffer;
+    int fd = -1;
+
+    memset(reply, 0, sizeof(WavServerReply));
+
+    if (request->type < WAV_SERVER_RANGE || request->type > WAV_SERVER_PEAKS ||
+        (request->type == WAV_SERVER_PEAKS && request->binFrames == 0))
+    {
+        reply->status = EINVAL;
+        return -1;
+    }
+
+    reply->status = wav_buffer_open_checked(&buffer, request->path);
+    if (reply->status)
+        return -1;
+
+    memcpy(&reply->header, &buffer.header, sizeof(WavHeader));
+    reply->nbFrames = buffer.nbFrames;
+
+    if (request->type == WAV_SERVER_RANGE) {
+        WavBuffer slice;
+
+        wav_buffer_slice(&slice, &buffer, request->start, request->nbFrames);
+        reply->size = slice.nbFrames * slice.header.BytePerChunk;
+        if (reply->size && (fd = wav_server_memfd(slice.data, reply->size)) < 0)
+            reply->status = -fd;
+        wav_buffer_release(&slice);
+    }
+    else {
+        // Bins longer than the file all give the same single bin
+        uint32_t binFrames = request->binFrames;
+        if (binFrames > buffer.nbFrames)
+            binFrames = buffer.nbFrames ? buffer.nbFrames : 1;
+
+        fd = wav_server_result(server, &buffer, request->type, binFrames, &reply->size);
+        if (fd < 0)
+            reply->status = -fd;
+        else if (reply->size == 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (reply->status) {
+        reply->size = 0;
+        fd = -1;
+    }
+
+    wav_buffer_release(&buffer);
+    return fd;
+}
+
+
+/**
+ * @brief   Send a reply, with the descriptor of its payload if any
+ *
+ * @returns               0 on success, -1 if the client is gone
+ *
+ */
+int wav_server_send (int socket,
+                     const WavServerReply* reply,
+                     int fd)
+{
+    union {
+        char            buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    struct iovec iov = { (void*)reply, sizeof(WavServerReply) };
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == sizeof(WavServerReply) ? 0 : -1;
+}
+
+
+void* wav_server_client (void* arg)
+{
+    WavServerClient* client = (WavServerClient*)arg;
+    WavServerRequest request;
+    WavServerReply reply;
+
+    while (recv(client->fd, &request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+        request.path[WAV_SERVER_PATH_MAX - 1] = '\0';
+
+        WAV_TRACE_BEGIN("server request");
+        int fd = wav_server_answer(client->server, &request, &reply);
+        int sent = wav_server_send(client->fd, &reply, fd);
+        WAV_TRACE_END("server request");
+
+        if (fd >= 0)
+            close(fd);
+        if (sent)
+            break;
+    }
+
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+
+/**
+ * @brief   Create the socket of a server
+ * @details A stale socket file left by a previous server is replaced.
+ *
+ * @param[out]  server    Pointer to the server, to close with wav_server_close
+ * @param[in]   path      Path of the Unix socket
+ * @returns               None
+ *
+ */
+void wav_server_open (WavServer* server,
+                      const char* path)
+{
+    struct sockaddr_un address;
+
+    memset(server, 0, sizeof(WavServer));
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+
+    server->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+
+    if (server->listener < 0 ||
+        bind(server->listener, (struct sockaddr*)&address, sizeof(address)) ||
+        listen(server->listener, SOMAXCONN))
+    {
+        fprintf(stderr, "Cannot listen on socket %s\n", path);
+        exit(1);
+    }
+
+    pthread_mutex_init(&server->lock, NULL);
+}
+
+
+/**
+ * @brief   Serve clients, one thread per connection, until the socket is closed
+ *
+ */
+void wav_server_run (WavServer* server)
+{
+    pthread_attr_t attributes;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        int fd = accept4(server->listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        WavServerClient* client = (WavServerClient*)malloc(sizeof(WavServerClient));
+        pthread_t thread;
+
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->server = server;
+        client->fd = fd;
+
+        if (pthread_create(&thread, &attributes, wav_server_client, client)) {
+            close(fd);
+            free(client);
+        }
+    }
+
+    pthread_attr_destroy(&attributes);
+}
+
+
+void wav_server_close (WavServer* server)
+{
+    for (size_t r = 0; r < server->nbResults; ++r) {
+        close(server->results[r].fd);
+        wav_buffer_release(&server->results[r].buffer);
+    }
+    close(server->listener);
+    pthread_mutex_destroy(&server->lock);
+    wav_buffer_cache_purge();
+}
+
+
+/**
+ * @brief   Connect to a server
+ *
+ * @param[in]   path      Path of the Unix socket of the server
+ * @returns               Descriptor of the connection, to close with close
+ *
+ */
+int wav_client_connect (const char* path)
+{
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address))) {
+        fprintf(stderr, "Cannot connect to server %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+
+/**
+ * @brief   Send a request and map the payload of its reply
+ * @details Requests of a connection are answered in order; several
+ *          threads must use their own connection.
+ *
+ * @param[in]   fd        Descriptor of the connection
+ * @param[in]   request   Pointer to the request
+ * @param[out]  reply     Pointer to the reply, check reply->status
+ * @returns               Read-only payload of reply->size bytes, to unmap
+ *                        with wav_client_unmap, NULL if empty or on error
+ *
+ */
+const void* wav_client_query (int fd,
+                              const WavServerRequest* request,
+                              WavServerReply* reply)
+{
+    union {
+        char            buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    struct iovec iov = { reply, sizeof(WavServerReply) };
+    struct msghdr message;
+    int payload = -1;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    if (send(fd, request, sizeof(WavServerRequest), MSG_NOSIGNAL) != sizeof(WavServerRequest) ||
+        recvmsg(fd, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(WavServerReply))
+    {
+        fprintf(stderr, "Connection to server lost\n");
+        exit(1);
+    }
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        memcpy(&payload, CMSG_DATA(header), sizeof(int));
+
+    if (payload < 0)
+        return NULL;
+
+    void* data = mmap(NULL, reply->size, PROT_READ, MAP_SHARED, payload, 0);
+    close(payload);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map reply of server\n");
+        exit(1);
+    }
+    return data;
+}
+
+
+void wav_client_unmap (const void* payload,
+                       const WavServerReply* reply)
+{
+    if (payload)
+        munmap((void*)payload, reply->size);
+}
+
+
+/**
+ * @brief   Read frames of a file through the server
+ *
+ * @returns               Interleaved frames, reply->size / BytePerChunk of them
+ *
+ */
+const int16_t* wav_client_range (int fd,
+                                 const char* path,
+                                 uint64_t start,
+                                 uint64_t nbFrames,
+                                 WavServerReply* reply)
+{
+    WavServerRequest request;
+
+    memset(&request, 0, sizeof(WavServerRequest));
+    request.type = WAV_SERVER_RANGE;
+    request.start = start;
+    request.nbFrames = nbFrames;
+    strncpy(request.path, path, WAV_SERVER_PATH_MAX - 1);
+    return (const int16_t*)wav_client_query(fd, &request, reply);
+}
+
+
+/**
+ * @brief   Get the statistics of a file through the server
+ *
+ */
+const WavStats* wav_client_stats (int fd,
+                                  const char* path,
+                                  WavServerReply* reply)
+{
+    WavServerRequest request;
+
+    memset(&request, 0, sizeof(WavServerRequest));
+    request.type = WAV_SERVER_STATS;
+    strncpy(request.path, path, WAV_SERVER_PATH_MAX - 1);
+    return (const WavStats*)wav_client_query(fd, &request, reply);
+}
+
+
+/**
+ * @brief   Get the min/max overview of a file through the server
+ *
+ * @returns               [bin][channel][min, max], reply->size / (4 * NbChannels) bins
+ *
+ */
+const int16_t* wav_client_peaks (int fd,
+                                 const char* path,
+                                 uint32_t binFrames,
+                                 WavServerReply* reply)
+{
+    WavServerRequest request;
+
+    memset(&request, 0, sizeof(WavServerRequest));
+    request.type = WAV_SERVER_PEAKS;
+    request.binFrames = binFrames;
+    strncpy(request.path, path, WAV_SERVER_PATH_MAX - 1);
+    return (const int16_t*)wav_client_query(fd, &request, reply);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_SERVER_H__
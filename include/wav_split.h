@@ -0,0 +1,280 @@
+/**
+ ******************************************************************************
+ * @file     wav_split.h
+ * @brief    Split the channels of a wav source into mono files in one pass
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_SPLIT_H__
+#define __WAV_SPLIT_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wav_stream.h"
+
+/* Number of frames read at once by the splitter */
+#define WAV_SPLIT_BLOCK 65536
+
+/* Number of blocks in flight: one being read while the other is written */
+#define WAV_SPLIT_SLOTS 2
+
+/**
+ * @details The caller thread reads and deinterleaves the blocks, the
+ *          writer threads append the planes of their outputs. Each
+ *          writer thread counts the blocks it wrote, so a slot is reused
+ *          once every thread is done with it.
+ *
+ */
+typedef struct WavSplitter {
+    WavWriter**     writers;        // One per channel, NULL if skipped
+    unsigned        nbChannels;
+    unsigned        nbThreads;
+
+    int16_t*        planes[WAV_SPLIT_SLOTS];    // [channel][WAV_SPLIT_BLOCK]
+    size_t          nbFrames[WAV_SPLIT_SLOTS];  // 0 marks the end of the source
+    uint64_t        nbBlocks;                   // Number of blocks produced
+    uint64_t*       nbWritten;                  // Blocks written by each thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} WavSplitter;
+
+typedef struct WavSplitWorker {
+    WavSplitter*    splitter;
+    unsigned        index;
+} WavSplitWorker;
+
+
+/**
+ * @brief   Deinterleave frames into one contiguous plane per channel
+ * @details Stereo frames, the most common case, are split 8 at a time
+ *          with SSE2 when available.
+ *
+ * @param[out]  planes      Array of nbChannels destination pointers
+ * @param[in]   frames      Interleaved frames
+ * @param[in]   nbFrames    Number of frames
+ * @param[in]   nbChannels  Number of channels
+ * @returns                 None
+ *
+ */
+void wav_deinterleave_block (int16_t* const* planes,
+                             const int16_t* frames,
+                             size_t nbFrames,
+                             unsigned nbChannels)
+{
+    size_t i = 0;
+
+    if (nbChannels == 1 && planes[0]) {
+        memcpy(planes[0], frames, nbFrames * sizeof(int16_t));
+        return;
+    }
+
+    if (nbChannels == 2 && planes[0] && planes[1]) {
+        int16_t* left = planes[0];
+        int16_t* right = planes[1];
+
+#ifdef __SSE2__
+        // Sign-extend each half of the 32-bit frames, then pack them back
+        for (; i + 8 <= nbFrames; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(frames + 2 * i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(frames + 2 * i + 8));
+            __m128i evenA = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+            __m128i evenB = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+            _mm_storeu_si128((__m128i*)(left + i), _mm_packs_epi32(evenA, evenB));
+            _mm_storeu_si128((__m128i*)(right + i),
+                             _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+        }
+#endif
+        for (; i < nbFrames; ++i) {
+            left[i] = frames[2 * i];
+            right[i] = frames[2 * i + 1];
+        }
+        return;
+    }
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        int16_t* plane = planes[c];
+        if (plane == NULL)
+            continue;
+        for (i = 0; i < nbFrames; ++i)
+            plane[i] = frames[i * nbChannels + c];
+    }
+}
+
+
+void* wav_split_worker (void* arg)
+{
+    WavSplitWorker* worker = (WavSplitWorker*)arg;
+    WavSplitter* splitter = worker->splitter;
+
+    for (uint64_t block = 0; ; ++block) {
+        unsigned slot = block % WAV_SPLIT_SLOTS;
+
+        pthread_mutex_lock(&splitter->lock);
+        while (splitter->nbBlocks <= block)
+            pthread_cond_wait(&splitter->cond, &splitter->lock);
+        size_t nbFrames = splitter->nbFrames[slot];
+        pthread_mutex_unlock(&splitter->lock);
+
+        if (nbFrames == 0)
+            break;
+
+        // Thread t writes the channels t, t + nbThreads, ...
+        WAV_TRACE_BEGIN("split write");
+        for (unsigned c = worker->index; c < splitter->nbChannels; c += splitter->nbThreads) {
+            if (splitter->writers[c])
+                wav_writer_write(splitter->writers[c],
+                                 splitter->planes[slot] + (size_t)c * WAV_SPLIT_BLOCK, nbFrames);
+        }
+        WAV_TRACE_END("split write");
+
+        pthread_mutex_lock(&splitter->lock);
+        splitter->nbWritten[worker->index] = block + 1;
+        pthread_cond_broadcast(&splitter->cond);
+        pthread_mutex_unlock(&splitter->lock);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief   Write each channel of a source to its own mono wav file
+ * @details The source is read once, in blocks of WAV_SPLIT_BLOCK frames,
+ *          while the previous block is written by the writer threads, so
+ *          the memory used does not depend on the length of the source.
+ *
+ * @param[in]   source     Pointer to the source, read from its first frame
+ * @param[in]   outputs    Array of one filename per channel, NULL to skip a channel
+ * @param[in]   nbThreads  Number of writer threads, 0 for one per channel
+ * @returns                Number of frames written to each output
+ *
+ */
+uint64_t wav_split_source (WavSource* source,
+                           const char* const* outputs,
+                           unsigned nbThreads)
+{
+    WavSplitter splitter;
+    unsigned nbChannels = source->header.NbChannels;
+    uint64_t nbFrames = 0;
+
+    if (nbThreads == 0 || nbThreads > nbChannels)
+        nbThreads = nbChannels;
+
+    memset(&splitter, 0, sizeof(WavSplitter));
+    splitter.nbChannels = nbChannels;
+    splitter.nbThreads = nbThreads;
+    splitter.writers = (WavWriter**)calloc(nbChannels, sizeof(WavWriter*));
+    splitter.nbWritten = (uint64_t*)calloc(nbThreads, sizeof(uint64_t));
+
+    int16_t* block = (int16_t*)malloc((size_t)WAV_SPLIT_BLOCK * source->header.BytePerChunk);
+    int16_t** planes = (int16_t**)calloc(nbChannels, sizeof(int16_t*));
+    pthread_t* threads = (pthread_t*)calloc(nbThreads, sizeof(pthread_t));
+    WavSplitWorker* workers = (WavSplitWorker*)calloc(nbThreads, sizeof(WavSplitWorker));
+
+    if (!splitter.writers || !splitter.nbWritten || !block || !planes || !threads || !workers) {
+        fprintf(stderr, "Cannot allocate memory for splitter\n");
+        exit(1);
+    }
+
+    for (unsigned s = 0; s < WAV_SPLIT_SLOTS; ++s) {
+        splitter.planes[s] = (int16_t*)malloc((size_t)WAV_SPLIT_BLOCK * nbChannels * sizeof(int16_t));
+        if (!splitter.planes[s]) {
+            fprintf(stderr, "Cannot allocate memory for splitter\n");
+            exit(1);
+        }
+    }
+
+    WavHeader format;
+    wav_header_init(&format, 1, source->header.SampleRate, 16, 0);
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        if (outputs[c])
+            splitter.writers[c] = wav_writer_open(outputs[c], &format);
+    }
+
+    pthread_mutex_init(&splitter.lock, NULL);
+    pthread_cond_init(&splitter.cond, NULL);
+
+    for (unsigned t = 0; t < nbThreads; ++t) {
+        workers[t].splitter = &splitter;
+        workers[t].index = t;
+        if (pthread_create(&threads[t], NULL, wav_split_worker, &workers[t])) {
+            fprintf(stderr, "Cannot start splitter thread\n");
+            exit(1);
+        }
+    }
+
+    wav_source_seek(source, 0);
+
+    for (uint64_t index = 0; ; ++index) {
+        unsigned slot = index % WAV_SPLIT_SLOTS;
+        size_t nbRead = wav_source_read(source, block, WAV_SPLIT_BLOCK);
+
+        // Wait for the writers to release the slot
+        pthread_mutex_lock(&splitter.lock);
+        for (unsigned t = 0; t < nbThreads; ++t) {
+            while (splitter.nbWritten[t] + WAV_SPLIT_SLOTS <= index)
+                pthread_cond_wait(&splitter.cond, &splitter.lock);
+        }
+        pthread_mutex_unlock(&splitter.lock);
+
+        WAV_INSTR_BEGIN(WAV_STAGE_EXTRACT);
+        for (unsigned c = 0; c < nbChannels; ++c)
+            planes[c] = outputs[c] ? splitter.planes[slot] + (size_t)c * WAV_SPLIT_BLOCK : NULL;
+        wav_deinterleave_block(planes, block, nbRead, nbChannels);
+        WAV_INSTR_END(WAV_STAGE_EXTRACT);
+
+        pthread_mutex_lock(&splitter.lock);
+        splitter.nbFrames[slot] = nbRead;
+        splitter.nbBlocks = index + 1;
+        pthread_cond_broadcast(&splitter.cond);
+        pthread_mutex_unlock(&splitter.lock);
+
+        if (nbRead == 0)
+            break;
+        nbFrames += nbRead;
+    }
+
+    for (unsigned t = 0; t < nbThreads; ++t)
+        pthread_join(threads[t], NULL);
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        if (splitter.writers[c])
+            wav_writer_close(splitter.writers[c]);
+    }
+
+    pthread_cond_destroy(&splitter.cond);
+    pthread_mutex_destroy(&splitter.lock);
+
+    for (unsigned s = 0; s < WAV_SPLIT_SLOTS; ++s)
+        free(splitter.planes[s]);
+    free(workers);
+    free(threads);
+    free(planes);
+    free(block);
+    free(splitter.nbWritten);
+    free(splitter.writers);
+    return nbFrames;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_SPLIT_H__
@@ -0,0 +1,158 @@
+/**
+ ******************************************************************************
+ * @file     wav_stft.h
+ * @brief    Provide a streaming short-time Fourier transform
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_STFT_H__
+#define __WAV_STFT_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include "wav_fft.h"
+
+/**
+ * @details Frame t covers the samples [t hop, t hop + frameSize) of the
+ *          signal and is weighted by a Hann window. Samples are pushed in
+ *          blocks of any size; only one frame is kept, so memory does not
+ *          depend on the length of the signal.
+ *
+ */
+typedef struct WavStft {
+    WavFft      fft;
+    uint32_t    frameSize;      // Power of two
+    uint32_t    hop;            // Samples between frames, up to frameSize
+    float*      window;         // Hann window, frameSize values
+    float*      frame;          // Samples of the next frame
+    float*      input;          // Windowed frame
+    float*      spectrum;       // Bins of the last frame, frameSize + 2 floats
+    uint32_t    filled;         // Samples in frame
+    uint64_t    nbFrames;       // Frames analyzed
+} WavStft;
+
+
+/**
+ * @brief   Prepare a transform
+ *
+ * @param[out]  stft        Pointer to the transform, to free with wav_stft_free
+ * @param[in]   frameSize   Samples of a frame, power of two from 4
+ * @param[in]   hop         Samples between frames, from 1 to frameSize
+ * @returns                 None
+ *
+ */
+void wav_stft_init (WavStft* stft,
+                    uint32_t frameSize,
+                    uint32_t hop)
+{
+    if (hop == 0 || hop > frameSize) {
+        fprintf(stderr, "STFT hop must be from 1 to the frame size\n");
+        exit(1);
+    }
+
+    wav_fft_init(&stft->fft, frameSize);
+    stft->frameSize = frameSize;
+    stft->hop = hop;
+    stft->window = (float*)malloc(frameSize * sizeof(float));
+    stft->frame = (float*)malloc(frameSize * sizeof(float));
+    stft->input = (float*)malloc(frameSize * sizeof(float));
+    stft->spectrum = (float*)malloc((frameSize + 2) * sizeof(float));
+    stft->filled = 0;
+    stft->nbFrames = 0;
+
+    if (!stft->window || !stft->frame || !stft->input || !stft->spectrum) {
+        fprintf(stderr, "Cannot allocate memory for STFT\n");
+        exit(1);
+    }
+
+    // Periodic Hann window, whose overlaps add to a constant at hops of frameSize / 2^k
+    for (uint32_t i = 0; i < frameSize; ++i)
+        stft->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / frameSize);
+}
+
+
+void wav_stft_free (WavStft* stft)
+{
+    wav_fft_free(&stft->fft);
+    free(stft->window);
+    free(stft->frame);
+    free(stft->input);
+    free(stft->spectrum);
+}
+
+
+/**
+ * @brief   Consume samples until a frame is complete and transform it
+ * @details Call in a loop until it returns 0, which means all the samples
+ *          were consumed and the next frame needs more of them:
+ *
+ *          while (wav_stft_analyze(&stft, &samples, &count))
+ *              use(stft.spectrum);
+ *
+ * @param[in,out] stft      Pointer to the transform
+ * @param[in,out] samples   Pointer to the samples, advanced past those consumed
+ * @param[in,out] count     Pointer to the number of samples, decreased likewise
+ * @returns                 1 if stft->spectrum holds a new frame, 0 otherwise
+ *
+ */
+int wav_stft_analyze (WavStft* stft,
+                      const float** samples,
+                      size_t* count)
+{
+    uint32_t frameSize = stft->frameSize;
+
+    // The previous frame is shifted out once the caller has used it
+    if (stft->filled == frameSize) {
+        memmove(stft->frame, stft->frame + stft->hop, (frameSize - stft->hop) * sizeof(float));
+        stft->filled -= stft->hop;
+    }
+
+    size_t length = frameSize - stft->filled < *count ? frameSize - stft->filled : *count;
+    memcpy(stft->frame + stft->filled, *samples, length * sizeof(float));
+    stft->filled += length;
+    *samples += length;
+    *count -= length;
+
+    if (stft->filled < frameSize)
+        return 0;
+
+    for (uint32_t i = 0; i < frameSize; ++i)
+        stft->input[i] = stft->frame[i] * stft->window[i];
+    wav_fft_forward(&stft->fft, stft->input, stft->spectrum);
+    stft->nbFrames++;
+    return 1;
+}
+
+
+/**
+ * @brief   Get the magnitudes of the bins of the last frame
+ *
+ * @param[in]   stft        Pointer to the transform
+ * @param[out]  magnitudes  frameSize / 2 + 1 values
+ * @returns                 None
+ *
+ */
+void wav_stft_magnitudes (const WavStft* stft,
+                          float* magnitudes)
+{
+    const float* spectrum = stft->spectrum;
+
+    for (uint32_t k = 0; k <= stft->frameSize / 2; ++k)
+        magnitudes[k] = sqrtf(spectrum[2 * k] * spectrum[2 * k] + spectrum[2 * k + 1] * spectrum[2 * k + 1]);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_STFT_H__
@@ -0,0 +1,712 @@
+/**
+ ******************************************************************************
+ * @file     wav_stream.h
+ * @brief    Provide a streaming interface to read and write wav files frame by frame
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_STREAM_H__
+#define __WAV_STREAM_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "wav.h"
+
+/**
+ * @brief   Generic source of interleaved 16-bit frames
+ * @details Every streaming object of the library (file readers, timelines...)
+ *          starts with this structure, so that a pointer to any of them can
+ *          be used wherever a WavSource* is expected.
+ *
+ */
+typedef struct WavSource {
+    WavHeader   header;     // Format of the delivered frames
+    uint64_t    nbFrames;   // Total number of frames available
+    uint64_t    position;   // Index of the next frame to read
+
+    size_t    (*read)  (struct WavSource* source, int16_t* frames, size_t nbFrames);
+    void      (*seek)  (struct WavSource* source, uint64_t frame);
+    void      (*close) (struct WavSource* source);
+} WavSource;
+
+/* Streaming reader over a wav file */
+typedef struct WavReader {
+    WavSource   source;
+    FILE*       stream;
+    int64_t     dataOffset; // Position of the first sample in the file
+    uint32_t    channelMask;// Speaker positions of WAVE_FORMAT_EXTENSIBLE, 0 if not given
+} WavReader;
+
+/* Number of frames of a source whose length is not known (pipes) */
+#define WAV_UNKNOWN_FRAMES UINT64_MAX
+
+/* Size written in the headers of streams that cannot be rewound, and
+   read as "until the end of the stream" with 0 */
+#define WAV_UNKNOWN_SIZE 0xFFFFFFFF
+
+/* AudioFormat of the fmt chunks carrying a channel mask and a sub-format */
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+
+/* Streaming writer into a wav file */
+typedef struct WavWriter {
+    WavHeader   header;     // Header written at close, with the final sizes
+    FILE*       stream;
+    int64_t     headerOffset;// Position of the header in the stream
+    uint64_t    nbFrames;   // Number of frames written so far
+} WavWriter;
+
+
+/**
+ * @brief   Skip bytes of a stream, reading them if it cannot seek
+ *
+ * @param[in]   stream    Stream to advance
+ * @param[in]   size      Number of bytes to skip
+ * @returns               0 on success, -1 if the stream ended before
+ *
+ */
+int wav_stream_skip (FILE* stream,
+                     uint64_t size)
+{
+    char buffer[4096];
+
+    // A failed seek may drop the buffered bytes, so pipes are not tried
+    if (ftello(stream) >= 0)
+        return fseeko(stream, (int64_t)size, SEEK_CUR) ? -1 : 0;
+
+    while (size) {
+        size_t length = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (fread(buffer, 1, length, stream) != length)
+            return -1;
+        size -= length;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief   Parse the chunks of a wav stream, returning an error on bad files
+ * @details Same parsing and checks as wav_parse_header, for callers which
+ *          must not exit on invalid files (servers, bindings).
+ *
+ * @param[in]   stream       Stream positioned at the beginning of the file
+ * @param[out]  header       Pointer to the wavfile header
+ * @param[out]  channelMask  Channel mask of an extensible format, 0 otherwise (may be NULL)
+ * @param[out]  dataOffset   Offset of the first sample in the stream, -1 on pipes
+ * @returns                  NULL on success, message of the error otherwise
+ *
+ */
+const char* wav_parse_header_checked (FILE* stream,
+                                      WavHeader* header,
+                                      uint32_t* channelMask,
+                                      int64_t* dataOffset)
+{
+    char chunkID[4];
+    uint32_t chunkSize;
+    int fmtFound = 0;
+
+    if (channelMask)
+        *channelMask = 0;
+
+    if (fread(header->FileTypeChunkID, 1, 12, stream) != 12)
+        return "Cannot read wav header from stream";
+
+    if (strncmp(header->FileTypeChunkID, "RIFF", 4) ||
+        strncmp(header->FileFormatID, "WAVE", 4))
+        return "Stream is not a wav file";
+
+    for (;;) {
+        if (fread(chunkID, 1, 4, stream) != 4 ||
+            fread(&chunkSize, 4, 1, stream) != 1)
+            return "Cannot find data chunk in stream";
+
+        if (!strncmp(chunkID, "fmt ", 4)) {
+            if (chunkSize < 16 || fread(&header->AudioFormat, 1, 16, stream) != 16)
+                return "Cannot read format chunk from stream";
+            chunkSize -= 16;
+
+            // cbSize, wValidBitsPerSample, dwChannelMask, SubFormat GUID
+            if (header->AudioFormat == WAV_FORMAT_EXTENSIBLE && chunkSize >= 24) {
+                uint8_t extension[24];
+                if (fread(extension, 1, 24, stream) != 24)
+                    return "Cannot read format extension from stream";
+                if (channelMask)
+                    memcpy(channelMask, extension + 4, 4);
+                memcpy(&header->AudioFormat, extension + 8, 2);
+                chunkSize -= 24;
+            }
+
+            // Skip the rest of the extension and RIFF padding byte
+            chunkSize += chunkSize & 1;
+            if (wav_stream_skip(stream, chunkSize))
+                return "Cannot skip format extension";
+            fmtFound = 1;
+        }
+        else if (!strncmp(chunkID, "data", 4)) {
+            header->DataSize = chunkSize;
+            break;
+        }
+        else if (wav_stream_skip(stream, (uint64_t)chunkSize + (chunkSize & 1))) {
+            return "Cannot skip chunk in stream";
+        }
+    }
+
+    if (!fmtFound)
+        return "Format chunk missing before data chunk";
+
+    // Verify that the Pulse-code modulation encoding is used
+    // to sample the data (extensible formats without a sub-format fail here)
+    if (header->AudioFormat != 1 || header->BitsPerSample != 16)
+        return "Only 16-bit PCM encoding supported";
+
+    if (header->NbChannels == 0 ||
+        header->BytePerChunk != header->NbChannels * header->BitsPerSample / 8)
+        return "Inconsistent channel layout in format chunk";
+
+    memcpy(header->FormatChunkID, "fmt ", 4);
+    memcpy(header->DataChunkID, "data", 4);
+    header->FmtChunkSize = 16;
+    header->FileSize = header->DataSize + sizeof(WavHeader) - 8;
+
+    *dataOffset = ftello(stream);
+    return NULL;
+}
+
+
+/**
+ * @brief   Parse the chunks of a wav stream until the data chunk
+ * @details Unknown chunks (LIST, fact...) are skipped and the header
+ *          is filled in its canonical 44-byte form, so that it can be
+ *          given to wav_write as is. The stream is left positioned
+ *          on the first sample. WAVE_FORMAT_EXTENSIBLE formats are
+ *          replaced by their sub-format. Chunks are skipped by reading
+ *          them when the stream cannot seek, so pipes can be parsed.
+ *
+ * @param[in]   stream       Stream positioned at the beginning of the file
+ * @param[out]  header       Pointer to the wavfile header
+ * @param[out]  channelMask  Channel mask of an extensible format, 0 otherwise (may be NULL)
+ * @returns                  Offset of the first sample in the stream, -1 on pipes
+ *
+ */
+int64_t wav_parse_header (FILE* stream,
+                          WavHeader* header,
+                          uint32_t* channelMask)
+{
+    int64_t dataOffset;
+
+    WAV_INSTR_BEGIN(WAV_STAGE_HEADER);
+    const char* error = wav_parse_header_checked(stream, header, channelMask, &dataOffset);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    WAV_INSTR_END(WAV_STAGE_HEADER);
+    return dataOffset;
+}
+
+
+/**
+ * @brief   Read frames from a source
+ *
+ * @param[in]   source    Pointer to the source
+ * @param[out]  frames    Buffer receiving the interleaved frames
+ * @param[in]   nbFrames  Maximum number of frames to read
+ * @returns               Number of frames read (0 at the end of the source)
+ *
+ */
+size_t wav_source_read (WavSource* source,
+                        int16_t* frames,
+                        size_t nbFrames)
+{
+    return source->read(source, frames, nbFrames);
+}
+
+
+/**
+ * @brief   Move the read position of a source
+ *
+ * @param[in]   source    Pointer to the source
+ * @param[in]   frame     Index of the next frame to read (clamped to the end)
+ * @returns               None
+ *
+ */
+void wav_source_seek (WavSource* source,
+                      uint64_t frame)
+{
+    source->seek(source, frame < source->nbFrames ? frame : source->nbFrames);
+}
+
+
+/**
+ * @brief   Close a source and release its memory
+ *
+ * @param[in]   source    Pointer to the source
+ * @returns               None
+ *
+ */
+void wav_source_close (WavSource* source)
+{
+    if (source)
+        source->close(source);
+}
+
+
+size_t wav_reader_read_frames (WavSource* source,
+                               int16_t* frames,
+                               size_t nbFrames)
+{
+    WavReader* reader = (WavReader*)source;
+    uint64_t remaining = source->nbFrames - source->position;
+
+    if (nbFrames > remaining)
+        nbFrames = remaining;
+
+    WAV_INSTR_BEGIN(WAV_STAGE_READ);
+    size_t nbRead = fread(frames, source->header.BytePerChunk, nbFrames, reader->stream);
+    WAV_INSTR_END(WAV_STAGE_READ);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    WAV_INSTR_ADD(bytesRead, nbRead * source->header.BytePerChunk);
+
+    source->position += nbRead;
+    return nbRead;
+}
+
+
+void wav_reader_seek_frame (WavSource* source,
+                            uint64_t frame)
+{
+    WavReader* reader = (WavReader*)source;
+    int64_t offset = reader->dataOffset + (int64_t)frame * source->header.BytePerChunk;
+
+    if (frame == source->position)
+        return;
+
+    // Pipes can only move forward, by reading the frames in between
+    if (reader->dataOffset >= 0 ? fseeko(reader->stream, offset, SEEK_SET) :
+        frame < source->position ||
+        wav_stream_skip(reader->stream, (frame - source->position) * source->header.BytePerChunk))
+    {
+        fprintf(stderr, "Cannot seek in stream\n");
+        exit(1);
+    }
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    source->position = frame;
+}
+
+
+void wav_reader_close_stream (WavSource* source)
+{
+    WavReader* reader = (WavReader*)source;
+
+    WAV_INSTR_BEGIN(WAV_STAGE_CLOSE);
+    if (fclose(reader->stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+    WAV_INSTR_END(WAV_STAGE_CLOSE);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    free(reader);
+}
+
+
+/**
+ * @brief   Stream the wav file of an open stream, returning an error on bad files
+ * @details As wav_reader_open_stream. The stream is closed on errors.
+ *
+ * @param[in]   stream    Stream positioned on the RIFF header
+ * @param[out]  reader    Pointer to the reader, to close with wav_source_close
+ * @param[out]  message   Message of the error (may be NULL)
+ * @returns               0 on success, errno value otherwise (EINVAL if not a
+ *                        16-bit PCM wav file)
+ *
+ */
+int wav_reader_open_stream_checked (FILE* stream,
+                                    WavReader** reader,
+                                    const char** message)
+{
+    WavReader* result = (WavReader*)calloc(1, sizeof(WavReader));
+    const char* error = "Cannot allocate memory for reader";
+    int status = ENOMEM;
+
+    WAV_INSTR_ADD(nbAllocs, 1);
+    WAV_INSTR_ADD(allocBytes, sizeof(WavReader));
+
+    if (result) {
+        result->stream = stream;
+        error = wav_parse_header_checked(stream, &result->source.header, &result->channelMask,
+                                         &result->dataOffset);
+        status = EINVAL;
+    }
+
+    if (!error) {
+        WavHeader* header = &result->source.header;
+        result->source.nbFrames = header->DataSize / header->BytePerChunk;
+
+        // Placeholder sizes of streamed files: the data goes to the end.
+        // A size of 0 is only a placeholder on pipes, files may be empty.
+        int seekable = result->dataOffset >= 0;
+        if (header->DataSize == WAV_UNKNOWN_SIZE || (header->DataSize == 0 && !seekable)) {
+            if (seekable && !fseeko(stream, 0, SEEK_END)) {
+                int64_t end = ftello(stream);
+                result->source.nbFrames = (end - result->dataOffset) / header->BytePerChunk;
+                if (fseeko(stream, result->dataOffset, SEEK_SET)) {
+                    error = "Cannot seek in stream";
+                    status = errno;
+                }
+            }
+            else {
+                result->source.nbFrames = WAV_UNKNOWN_FRAMES;
+            }
+        }
+    }
+
+    if (message)
+        *message = error;
+
+    if (error) {
+        fclose(stream);
+        free(result);
+        return status;
+    }
+
+    result->source.read = wav_reader_read_frames;
+    result->source.seek = wav_reader_seek_frame;
+    result->source.close = wav_reader_close_stream;
+
+    *reader = result;
+    return 0;
+}
+
+
+/**
+ * @brief   Stream the wav file of an open stream
+ * @details Only the header is read, samples are read on demand with
+ *          wav_source_read. The reader owns the stream and closes it.
+ *          All the readers share this function and the chunk parser.
+ *          A data size of WAV_UNKNOWN_SIZE, or of 0 on a pipe, means that
+ *          the samples go to the end of the stream: nbFrames is then
+ *          WAV_UNKNOWN_FRAMES on pipes, which are read until their end.
+ *
+ * @param[in]   stream    Stream positioned on the RIFF header
+ * @returns               Pointer to the reader, to close with wav_source_close
+ *
+ */
+WavReader* wav_reader_open_stream (FILE* stream)
+{
+    WavReader* reader;
+    const char* message;
+
+    WAV_INSTR_BEGIN(WAV_STAGE_HEADER);
+    if (wav_reader_open_stream_checked(stream, &reader, &message)) {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
+    WAV_INSTR_END(WAV_STAGE_HEADER);
+
+    return reader;
+}
+
+
+/**
+ * @brief   Stream the wav file of an open file descriptor
+ * @details The descriptor is duplicated, so the caller still owns @p fd
+ *          and closes it. The file is read from its current offset.
+ *
+ * @param[in]   fd        Readable file descriptor
+ * @returns               Pointer to the reader, to close with wav_source_close
+ *
+ */
+WavReader* wav_reader_open_fd (int fd)
+{
+    int copy = dup(fd);
+    FILE* stream = copy < 0 ? NULL : fdopen(copy, "rb");
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file descriptor %d\n", fd);
+        exit(1);
+    }
+
+    return wav_reader_open_stream(stream);
+}
+
+
+/**
+ * @brief   Open a wav file for streaming
+ * @details Only the header is read, samples are read on demand with
+ *          wav_source_read, so memory usage does not depend on the file length.
+ *
+ * @param[in]   filename  String of the filename to read, "-" for stdin
+ * @returns               Pointer to the reader, to close with wav_source_close
+ *
+ */
+WavReader* wav_reader_open (const char* filename)
+{
+    if (!strcmp(filename, "-"))
+        return wav_reader_open_fd(STDIN_FILENO);
+
+    WAV_INSTR_BEGIN(WAV_STAGE_OPEN);
+    FILE* stream = fopen(filename, "rb");
+    WAV_INSTR_END(WAV_STAGE_OPEN);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        exit(1);
+    }
+
+    return wav_reader_open_stream(stream);
+}
+
+
+/**
+ * @brief   Open a wav file for streaming, returning an error on bad files
+ * @details As wav_reader_open, for callers which must not exit on invalid
+ *          files (servers, bindings).
+ *
+ * @param[in]   filename  String of the filename to read
+ * @param[out]  reader    Pointer to the reader, to close with wav_source_close
+ * @returns               0 on success, errno value otherwise (EINVAL if not a
+ *                        16-bit PCM wav file)
+ *
+ */
+int wav_reader_open_checked (const char* filename,
+                             WavReader** reader)
+{
+    FILE* stream = fopen(filename, "rbe");
+
+    if (stream == NULL)
+        return errno;
+
+    return wav_reader_open_stream_checked(stream, reader, NULL);
+}
+
+
+/**
+ * @brief   Stream a wav file held in memory
+ * @details The buffer is not copied and must stay valid until the reader
+ *          is closed.
+ *
+ * @param[in]   data      Pointer to the bytes of the wav file
+ * @param[in]   size      Number of bytes of the wav file
+ * @returns               Pointer to the reader, to close with wav_source_close
+ *
+ */
+WavReader* wav_reader_open_memory (const void* data,
+                                   size_t size)
+{
+    FILE* stream = fmemopen((void*)data, size, "rb");
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open memory buffer\n");
+        exit(1);
+    }
+
+    return wav_reader_open_stream(stream);
+}
+
+
+/**
+ * @brief   Write a wav file frame by frame into an open stream
+ * @details The sizes of the header are written by wav_writer_close, which
+ *          seeks back to the beginning of the stream. Streams that cannot
+ *          seek, such as pipes, keep WAV_UNKNOWN_SIZE sizes. The writer
+ *          owns the stream and closes it.
+ *
+ * @param[in]   stream    Stream positioned where to write the file
+ * @param[in]   format    Pointer to the header giving the frame format
+ * @returns               Pointer to the writer, to close with wav_writer_close
+ *
+ */
+WavWriter* wav_writer_open_stream (FILE* stream,
+                                   const WavHeader* format)
+{
+    WavWriter* writer = (WavWriter*)calloc(1, sizeof(WavWriter));
+    WAV_INSTR_ADD(nbAllocs, 1);
+    WAV_INSTR_ADD(allocBytes, sizeof(WavWriter));
+
+    if (!writer) {
+        fprintf(stderr, "Cannot allocate memory for writer\n");
+        exit(1);
+    }
+
+    writer->stream = stream;
+    writer->headerOffset = ftello(stream);
+    memcpy(&writer->header, format, sizeof(WavHeader));
+    writer->header.DataSize = 0;
+    writer->header.FileSize = sizeof(WavHeader) - 8;
+
+    // Pipes keep the placeholder sizes, read by wav_reader_open_stream
+    if (writer->headerOffset < 0) {
+        writer->header.DataSize = WAV_UNKNOWN_SIZE;
+        writer->header.FileSize = WAV_UNKNOWN_SIZE;
+    }
+
+    if (!fwrite(&writer->header, sizeof(WavHeader), 1, writer->stream)) {
+        fprintf(stderr, "Cannot write wav header into stream\n");
+        exit(1);
+    }
+
+    return writer;
+}
+
+
+/**
+ * @brief   Write a wav file frame by frame into an open file descriptor
+ * @details The descriptor is duplicated, so the caller still owns @p fd
+ *          and closes it. The file is written from its current offset.
+ *
+ * @param[in]   fd        Writable file descriptor
+ * @param[in]   format    Pointer to the header giving the frame format
+ * @returns               Pointer to the writer, to close with wav_writer_close
+ *
+ */
+WavWriter* wav_writer_open_fd (int fd,
+                               const WavHeader* format)
+{
+    int copy = dup(fd);
+    FILE* stream = copy < 0 ? NULL : fdopen(copy, "wb");
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file descriptor %d\n", fd);
+        exit(1);
+    }
+
+    return wav_writer_open_stream(stream, format);
+}
+
+
+/**
+ * @brief   Create a wav file to write frame by frame
+ * @details The sizes of the header are written by wav_writer_close.
+ *
+ * @param[in]   filename  String of the filename to write, "-" for stdout
+ * @param[in]   format    Pointer to the header giving the frame format
+ * @returns               Pointer to the writer, to close with wav_writer_close
+ *
+ */
+WavWriter* wav_writer_open (const char* filename,
+                            const WavHeader* format)
+{
+    if (!strcmp(filename, "-"))
+        return wav_writer_open_fd(STDOUT_FILENO, format);
+
+    WAV_INSTR_BEGIN(WAV_STAGE_OPEN);
+    FILE* stream = fopen(filename, "wb");
+    WAV_INSTR_END(WAV_STAGE_OPEN);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        exit(1);
+    }
+
+    return wav_writer_open_stream(stream, format);
+}
+
+
+/**
+ * @brief   Write a wav file frame by frame into a memory buffer
+ * @details The buffer grows as frames are written. @p data and @p size
+ *          are set by wav_writer_close, the buffer is then owned by the
+ *          caller and released with free.
+ *
+ * @param[out]  data      Pointer receiving the bytes of the wav file
+ * @param[out]  size      Pointer receiving the number of bytes
+ * @param[in]   format    Pointer to the header giving the frame format
+ * @returns               Pointer to the writer, to close with wav_writer_close
+ *
+ */
+WavWriter* wav_writer_open_memory (char** data,
+                                   size_t* size,
+                                   const WavHeader* format)
+{
+    FILE* stream = open_memstream(data, size);
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open memory buffer\n");
+        exit(1);
+    }
+
+    return wav_writer_open_stream(stream, format);
+}
+
+
+/**
+ * @brief   Append interleaved frames to a wav file
+ *
+ * @param[in]   writer    Pointer to the writer
+ * @param[in]   frames    Frames in the format given at open
+ * @param[in]   nbFrames  Number of frames to write
+ * @returns               None
+ *
+ */
+void wav_writer_write (WavWriter* writer,
+                       const void* frames,
+                       size_t nbFrames)
+{
+    WAV_INSTR_BEGIN(WAV_STAGE_WRITE);
+    if (nbFrames && fwrite(frames, writer->header.BytePerChunk, nbFrames, writer->stream) != nbFrames) {
+        fprintf(stderr, "Cannot write data into stream\n");
+        exit(1);
+    }
+    WAV_INSTR_END(WAV_STAGE_WRITE);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    WAV_INSTR_ADD(bytesWritten, nbFrames * writer->header.BytePerChunk);
+
+    writer->nbFrames += nbFrames;
+}
+
+
+/**
+ * @brief   Write the final sizes in the header and close the file
+ *
+ * @param[in]   writer    Pointer to the writer
+ * @returns               None
+ *
+ */
+void wav_writer_close (WavWriter* writer)
+{
+    writer->header.DataSize = writer->nbFrames * writer->header.BytePerChunk;
+    writer->header.FileSize = writer->header.DataSize + sizeof(WavHeader) - 8;
+
+    // Memory streams end at the position of the last write: go back there
+    int64_t end = ftello(writer->stream);
+
+    if (writer->headerOffset >= 0 &&
+        (fseeko(writer->stream, writer->headerOffset, SEEK_SET) ||
+         !fwrite(&writer->header, sizeof(WavHeader), 1, writer->stream) ||
+         fseeko(writer->stream, end, SEEK_SET)))
+    {
+        fprintf(stderr, "Cannot write wav header into stream\n");
+        exit(1);
+    }
+
+    WAV_INSTR_BEGIN(WAV_STAGE_CLOSE);
+    if (fclose(writer->stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+    WAV_INSTR_END(WAV_STAGE_CLOSE);
+    WAV_INSTR_ADD(nbIoCalls, 1);
+    free(writer);
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_STREAM_H__
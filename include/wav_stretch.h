@@ -0,0 +1,564 @@
+/**
+ ******************************************************************************
+ * @file     wav_stretch.h
+ * @brief    Change the speed and the pitch of streamed signals by WSOLA
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_STRETCH_H__
+#define __WAV_STRETCH_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wav_stream.h"
+
+/* Frames read from the input of a stretching source at once */
+#define WAV_STRETCH_BLOCK 1024
+
+/**
+ * @details Waveform similarity overlap-add: segments of frameLength input
+ *          frames, weighted by a Hann window, are added every hop output
+ *          frames. Each segment is taken around its nominal input position,
+ *          moved by up to tolerance frames to best match the continuation
+ *          of the previous segment, so waveforms stay in phase without
+ *          any spectral processing. Stretching by pitch / speed then
+ *          resampling by pitch changes the speed and the pitch
+ *          independently.
+ *
+ *          Input positions count hop silent frames put before the signal,
+ *          so the first segment covers its start with a full window.
+ *          Samples are interleaved floats, as read from graphs.
+ *
+ */
+typedef struct WavStretch {
+    unsigned    nbChannels;
+    double      speed;          // Playback speed, 2 plays twice as fast
+    double      pitch;          // Frequency ratio of the pitch shift
+    uint32_t    frameLength;    // Frames of a segment, 20 ms
+    uint32_t    hop;            // Output frames between segments, frameLength / 2
+    uint32_t    tolerance;      // Frames a segment can move from its nominal position
+    float*      window;         // Hann window repeated for each channel
+    float*      input;          // Input frames [inputStart, inputStart + inputFrames)
+    float*      mono;           // Mix of the channels of the input frames
+    uint64_t    inputStart;
+    size_t      inputFrames;
+    size_t      inputCapacity;
+    double      position;       // Nominal input position of the next segment
+    int64_t     previous;       // Input position of the last segment, -1 before the first
+    float*      accumulator;    // Overlap-add of the segments, frameLength frames
+    float*      stretched;      // Frames stretched but not resampled yet
+    size_t      nbStretched;
+    uint32_t    skip;           // Stretched frames of the silence before the signal
+    double      phase;          // Resampling position in the stretched frames
+    double      expected;       // Output frames of the input pushed
+    uint64_t    nbOutput;       // Output frames pulled
+    int         flushed;
+} WavStretch;
+
+
+/* Sum of a[i] b[i] */
+float wav_stretch_dot (const float* a,
+                       const float* b,
+                       size_t n)
+{
+    float sum = 0.0f;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    float lanes[4];
+
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+    for (; i < n; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+
+/* accumulator[i] += window[i] input[i] */
+void wav_stretch_overlap_add (float* accumulator,
+                              const float* window,
+                              const float* input,
+                              size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        __m128 product = _mm_mul_ps(_mm_loadu_ps(window + i), _mm_loadu_ps(input + i));
+        _mm_storeu_ps(accumulator + i, _mm_add_ps(_mm_loadu_ps(accumulator + i), product));
+    }
+#endif
+
+    for (; i < n; ++i)
+        accumulator[i] += window[i] * input[i];
+}
+
+
+/* Append frames to the input, silent ones if frames is NULL */
+void wav_stretch_append (WavStretch* stretch,
+                         const float* frames,
+                         size_t nbFrames)
+{
+    unsigned nbChannels = stretch->nbChannels;
+
+    if (stretch->inputFrames + nbFrames > stretch->inputCapacity) {
+        while (stretch->inputFrames + nbFrames > stretch->inputCapacity)
+            stretch->inputCapacity *= 2;
+        stretch->input = (float*)realloc(stretch->input, stretch->inputCapacity * nbChannels * sizeof(float));
+        stretch->mono = (float*)realloc(stretch->mono, stretch->inputCapacity * sizeof(float));
+        if (!stretch->input || !stretch->mono) {
+            fprintf(stderr, "Cannot allocate memory for stretching\n");
+            exit(1);
+        }
+    }
+
+    float* input = stretch->input + stretch->inputFrames * nbChannels;
+    float* mono = stretch->mono + stretch->inputFrames;
+
+    if (!frames) {
+        memset(input, 0, nbFrames * nbChannels * sizeof(float));
+        memset(mono, 0, nbFrames * sizeof(float));
+    }
+    else {
+        memcpy(input, frames, nbFrames * nbChannels * sizeof(float));
+        for (size_t i = 0; i < nbFrames; ++i) {
+            float sum = 0.0f;
+            for (unsigned c = 0; c < nbChannels; ++c)
+                sum += frames[i * nbChannels + c];
+            mono[i] = sum;
+        }
+    }
+    stretch->inputFrames += nbFrames;
+}
+
+
+/**
+ * @brief   Restart a stretcher, keeping its settings
+ *
+ */
+void wav_stretch_reset (WavStretch* stretch)
+{
+    stretch->inputStart = 0;
+    stretch->inputFrames = 0;
+    stretch->position = 0.0;
+    stretch->previous = -1;
+    stretch->nbStretched = 0;
+    stretch->skip = stretch->hop;
+    stretch->phase = 0.0;
+    stretch->expected = 0.0;
+    stretch->nbOutput = 0;
+    stretch->flushed = 0;
+    memset(stretch->accumulator, 0, stretch->frameLength * stretch->nbChannels * sizeof(float));
+    wav_stretch_append(stretch, NULL, stretch->hop);
+}
+
+
+/**
+ * @brief   Change the speed and the pitch
+ * @details Changes apply from the next segment, so they can follow a
+ *          control while the signal plays.
+ *
+ * @param[in]   stretch   Pointer to the stretcher
+ * @param[in]   speed     Playback speed, 2 plays twice as fast
+ * @param[in]   pitch     Frequency ratio, 2 shifts the pitch up an octave
+ * @returns               None
+ *
+ */
+void wav_stretch_set (WavStretch* stretch,
+                      double speed,
+                      double pitch)
+{
+    if (!(speed >= 0.0625 && speed <= 16.0) || !(pitch >= 0.0625 && pitch <= 16.0)) {
+        fprintf(stderr, "Speed and pitch ratios must be from 1/16 to 16\n");
+        exit(1);
+    }
+
+    stretch->speed = speed;
+    stretch->pitch = pitch;
+}
+
+
+/**
+ * @brief   Prepare a stretcher
+ *
+ * @param[out]  stretch     Pointer to the stretcher, to close with wav_stretch_close
+ * @param[in]   nbChannels  Number of interleaved channels
+ * @param[in]   sampleRate  Sample rate in Hz, which sets the segment length
+ * @param[in]   speed       Playback speed, 2 plays twice as fast
+ * @param[in]   pitch       Frequency ratio, 2 shifts the pitch up an octave
+ * @returns                 None
+ *
+ */
+void wav_stretch_open (WavStretch* stretch,
+                       unsigned nbChannels,
+                       uint32_t sampleRate,
+                       double speed,
+                       double pitch)
+{
+    memset(stretch, 0, sizeof(WavStretch));
+    wav_stretch_set(stretch, speed, pitch);
+
+    stretch->nbChannels = nbChannels;
+    stretch->hop = sampleRate / 100 > 16 ? sampleRate / 100 : 16;
+    stretch->frameLength = 2 * stretch->hop;
+    stretch->tolerance = stretch->hop / 2;
+    stretch->inputCapacity = 4 * stretch->frameLength;
+
+    size_t length = (size_t)stretch->frameLength * nbChannels;
+    stretch->window = (float*)malloc(length * sizeof(float));
+    stretch->accumulator = (float*)malloc(length * sizeof(float));
+    stretch->stretched = (float*)malloc((stretch->hop + 2) * nbChannels * sizeof(float));
+    stretch->input = (float*)malloc(stretch->inputCapacity * nbChannels * sizeof(float));
+    stretch->mono = (float*)malloc(stretch->inputCapacity * sizeof(float));
+
+    if (!stretch->window || !stretch->accumulator || !stretch->stretched || !stretch->input || !stretch->mono) {
+        fprintf(stderr, "Cannot allocate memory for stretching\n");
+        exit(1);
+    }
+
+    // Periodic Hann window: windows a hop apart add up to 1
+    for (uint32_t i = 0; i < stretch->frameLength; ++i) {
+        float weight = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / stretch->frameLength);
+        for (unsigned c = 0; c < nbChannels; ++c)
+            stretch->window[i * nbChannels + c] = weight;
+    }
+
+    wav_stretch_reset(stretch);
+}
+
+
+void wav_stretch_close (WavStretch* stretch)
+{
+    free(stretch->window);
+    free(stretch->accumulator);
+    free(stretch->stretched);
+    free(stretch->input);
+    free(stretch->mono);
+}
+
+
+/**
+ * @brief   Queue input frames
+ *
+ * @param[in]   stretch   Pointer to the stretcher
+ * @param[in]   frames    Interleaved frames
+ * @param[in]   nbFrames  Number of frames
+ * @returns               None
+ *
+ */
+void wav_stretch_push (WavStretch* stretch,
+                       const float* frames,
+                       size_t nbFrames)
+{
+    wav_stretch_append(stretch, frames, nbFrames);
+    stretch->expected += nbFrames / stretch->speed;
+}
+
+
+/**
+ * @brief   Mark the end of the input
+ * @details The remaining output is pulled with wav_stretch_pull, whose
+ *          total is then the input length divided by the speed.
+ *
+ */
+void wav_stretch_flush (WavStretch* stretch)
+{
+    stretch->flushed = 1;
+}
+
+
+/* Add the next segment, 0 if more input is needed */
+int wav_stretch_segment (WavStretch* stretch)
+{
+    unsigned nbChannels = stretch->nbChannels;
+    uint32_t hop = stretch->hop;
+    int64_t nominal = llround(stretch->position);
+    int64_t from = nominal > stretch->tolerance ? nominal - stretch->tolerance : 0;
+    int64_t to = nominal + stretch->tolerance;
+    int64_t need = to + stretch->frameLength;
+    int64_t end = stretch->inputStart + stretch->inputFrames;
+
+    // The template is the continuation of the previous segment
+    if (stretch->previous >= 0 && stretch->previous + 2 * hop > need)
+        need = stretch->previous + 2 * hop;
+
+    if (end < need) {
+        if (!stretch->flushed)
+            return 0;
+        wav_stretch_append(stretch, NULL, need - end);
+    }
+
+    int64_t chosen = nominal;
+    if (stretch->previous >= 0) {
+        // Positions relative to the first input frame kept
+        const float* mono = stretch->mono;
+        const float* pattern = mono + (stretch->previous + hop - stretch->inputStart);
+        size_t first = from - stretch->inputStart;
+        size_t last = to - stretch->inputStart;
+        double energy = wav_stretch_dot(mono + first, mono + first, hop);
+        double bestScore = -INFINITY;
+
+        for (size_t candidate = first; candidate <= last; ++candidate) {
+            double correlation = wav_stretch_dot(pattern, mono + candidate, hop);
+            double score = correlation / sqrt(energy + 1e-9);
+
+            // Periodic signals tie one period apart: keep the nominal timing
+            int64_t position = candidate + stretch->inputStart;
+            if (score > bestScore ||
+                (score == bestScore && llabs(position - nominal) < llabs(chosen - nominal)))
+            {
+                bestScore = score;
+                chosen = position;
+            }
+            energy += (double)mono[candidate + hop] * mono[candidate + hop] - (double)mono[candidate] * mono[candidate];
+            energy = energy > 0.0 ? energy : 0.0;
+        }
+    }
+
+    size_t length = (size_t)stretch->frameLength * nbChannels;
+    wav_stretch_overlap_add(stretch->accumulator, stretch->window,
+                            stretch->input + (chosen - stretch->inputStart) * nbChannels, length);
+
+    // The first hop frames are complete
+    uint32_t skip = stretch->skip < hop ? stretch->skip : hop;
+    memcpy(stretch->stretched + stretch->nbStretched * nbChannels, stretch->accumulator + skip * nbChannels,
+           (hop - skip) * nbChannels * sizeof(float));
+    stretch->nbStretched += hop - skip;
+    stretch->skip -= skip;
+
+    memmove(stretch->accumulator, stretch->accumulator + hop * nbChannels, (length - hop * nbChannels) * sizeof(float));
+    memset(stretch->accumulator + length - hop * nbChannels, 0, hop * nbChannels * sizeof(float));
+
+    stretch->previous = chosen;
+    stretch->position += hop * stretch->speed / stretch->pitch;
+
+    // Drop the input before the next template and search range
+    int64_t keep = llround(stretch->position) - stretch->tolerance;
+    keep = keep < chosen + hop ? keep : chosen + hop;
+    if (keep > (int64_t)stretch->inputStart) {
+        size_t drop = keep - stretch->inputStart;
+        drop = drop < stretch->inputFrames ? drop : stretch->inputFrames;
+        memmove(stretch->input, stretch->input + drop * nbChannels,
+                (stretch->inputFrames - drop) * nbChannels * sizeof(float));
+        memmove(stretch->mono, stretch->mono + drop, (stretch->inputFrames - drop) * sizeof(float));
+        stretch->inputStart += drop;
+        stretch->inputFrames -= drop;
+    }
+    return 1;
+}
+
+
+/**
+ * @brief   Get the output frames available
+ * @details After wav_stretch_flush, frames are produced until the end of
+ *          the output, padded with silence.
+ *
+ * @param[in]   stretch     Pointer to the stretcher
+ * @param[out]  frames      Interleaved frames
+ * @param[in]   maxFrames   Largest number of frames written
+ * @returns                 Number of frames written
+ *
+ */
+size_t wav_stretch_pull (WavStretch* stretch,
+                         float* frames,
+                         size_t maxFrames)
+{
+    unsigned nbChannels = stretch->nbChannels;
+    uint64_t total = stretch->flushed ? (uint64_t)llround(stretch->expected) : UINT64_MAX;
+    size_t done = 0;
+
+    while (done < maxFrames && stretch->nbOutput < total) {
+        // Linear interpolation between the stretched frames
+        while (done < maxFrames && stretch->nbOutput < total && stretch->phase + 1 < stretch->nbStretched) {
+            size_t index = (size_t)stretch->phase;
+            float fraction = (float)(stretch->phase - index);
+            const float* a = stretch->stretched + index * nbChannels;
+            const float* b = a + nbChannels;
+
+            for (unsigned c = 0; c < nbChannels; ++c)
+                frames[done * nbChannels + c] = a[c] + fraction * (b[c] - a[c]);
+
+            stretch->phase += stretch->pitch;
+            stretch->nbOutput++;
+            done++;
+        }
+
+        if (done == maxFrames || stretch->nbOutput == total)
+            break;
+
+        // Keep the frame before the resampling position
+        size_t drop = (size_t)stretch->phase < stretch->nbStretched ? (size_t)stretch->phase : stretch->nbStretched;
+        memmove(stretch->stretched, stretch->stretched + drop * nbChannels,
+                (stretch->nbStretched - drop) * nbChannels * sizeof(float));
+        stretch->nbStretched -= drop;
+        stretch->phase -= drop;
+
+        if (!wav_stretch_segment(stretch))
+            break;
+    }
+
+    return done;
+}
+
+
+/* Source reading another one at another speed or pitch */
+typedef struct WavStretchSource {
+    WavSource   source;
+    WavSource*  input;          // Owned source, closed with this one
+    WavStretch  stretch;
+    int16_t*    block;
+    float*      samples;
+} WavStretchSource;
+
+
+size_t wav_stretch_read_frames (WavSource* source,
+                                int16_t* frames,
+                                size_t nbFrames)
+{
+    WavStretchSource* stretchSource = (WavStretchSource*)source;
+    WavStretch* stretch = &stretchSource->stretch;
+    unsigned nbChannels = source->header.NbChannels;
+    size_t done = 0;
+
+    if (source->nbFrames != WAV_UNKNOWN_FRAMES && nbFrames > source->nbFrames - source->position)
+        nbFrames = source->nbFrames - source->position;
+
+    while (done < nbFrames) {
+        size_t length = nbFrames - done < WAV_STRETCH_BLOCK ? nbFrames - done : WAV_STRETCH_BLOCK;
+        size_t nbPulled = wav_stretch_pull(stretch, stretchSource->samples, length);
+
+        for (size_t i = 0; i < nbPulled * nbChannels; ++i) {
+            float sample = roundf(stretchSource->samples[i]);
+            sample = sample > 32767.0f ? 32767.0f : (sample < -32768.0f ? -32768.0f : sample);
+            frames[done * nbChannels + i] = (int16_t)sample;
+        }
+        done += nbPulled;
+
+        if (nbPulled == length)
+            continue;
+        if (stretch->flushed) {
+            // Rounding may end the output before the announced length
+            if (source->nbFrames == WAV_UNKNOWN_FRAMES)
+                break;
+            memset(frames + done * nbChannels, 0, (nbFrames - done) * source->header.BytePerChunk);
+            done = nbFrames;
+            break;
+        }
+
+        size_t nbRead = wav_source_read(stretchSource->input, stretchSource->block, WAV_STRETCH_BLOCK);
+        if (nbRead == 0) {
+            wav_stretch_flush(stretch);
+            continue;
+        }
+        for (size_t i = 0; i < nbRead * nbChannels; ++i)
+            stretchSource->samples[i] = stretchSource->block[i];
+        wav_stretch_push(stretch, stretchSource->samples, nbRead);
+    }
+
+    source->position += done;
+    return done;
+}
+
+
+void wav_stretch_seek_frame (WavSource* source,
+                             uint64_t frame)
+{
+    WavStretchSource* stretchSource = (WavStretchSource*)source;
+
+    wav_source_seek(stretchSource->input, (uint64_t)llround(frame * stretchSource->stretch.speed));
+    wav_stretch_reset(&stretchSource->stretch);
+    source->position = frame;
+}
+
+
+void wav_stretch_close_source (WavSource* source)
+{
+    WavStretchSource* stretchSource = (WavStretchSource*)source;
+
+    wav_source_close(stretchSource->input);
+    wav_stretch_close(&stretchSource->stretch);
+    free(stretchSource->block);
+    free(stretchSource->samples);
+    free(stretchSource);
+}
+
+
+/**
+ * @brief   Read a source at another speed or pitch
+ * @details Frames are stretched while they are read, with a latency of
+ *          about 35 ms of input, so previews start at once. The length is
+ *          the input length divided by the speed.
+ *
+ * @param[in]   input     Pointer to the source, owned and closed with the new one
+ * @param[in]   speed     Playback speed, 2 plays twice as fast
+ * @param[in]   pitch     Frequency ratio, 2 shifts the pitch up an octave
+ * @returns               Pointer to the source, to close with wav_source_close
+ *
+ */
+WavSource* wav_stretch_source_open (WavSource* input,
+                                    double speed,
+                                    double pitch)
+{
+    WavStretchSource* stretchSource = (WavStretchSource*)calloc(1, sizeof(WavStretchSource));
+    unsigned nbChannels = input->header.NbChannels;
+
+    if (!stretchSource) {
+        fprintf(stderr, "Cannot allocate memory for stretching source\n");
+        exit(1);
+    }
+
+    wav_stretch_open(&stretchSource->stretch, nbChannels, input->header.SampleRate, speed, pitch);
+    stretchSource->input = input;
+    stretchSource->block = (int16_t*)malloc(WAV_STRETCH_BLOCK * input->header.BytePerChunk);
+    stretchSource->samples = (float*)malloc(WAV_STRETCH_BLOCK * nbChannels * sizeof(float));
+
+    if (!stretchSource->block || !stretchSource->samples) {
+        fprintf(stderr, "Cannot allocate memory for stretching source\n");
+        exit(1);
+    }
+
+    WavSource* source = &stretchSource->source;
+    source->nbFrames = input->nbFrames == WAV_UNKNOWN_FRAMES ? WAV_UNKNOWN_FRAMES :
+                       (uint64_t)llround(input->nbFrames / speed);
+
+    uint64_t dataSize = source->nbFrames * input->header.BytePerChunk;
+    if (source->nbFrames == WAV_UNKNOWN_FRAMES || dataSize > UINT32_MAX)
+        dataSize = 0;
+    wav_header_init(&source->header, nbChannels, input->header.SampleRate, 16, dataSize);
+
+    source->read = wav_stretch_read_frames;
+    source->seek = wav_stretch_seek_frame;
+    source->close = wav_stretch_close_source;
+    return source;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_STRETCH_H__
@@ -0,0 +1,216 @@
+/**
+ ******************************************************************************
+ * @file     wav_timeline.h
+ * @brief    Present an ordered list of wav clips as a single source
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_TIMELINE_H__
+#define __WAV_TIMELINE_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include "wav_stream.h"
+
+/* Use as outFrame to play a clip until the end of its file */
+#define WAV_CLIP_END UINT64_MAX
+
+/* Portion of a wav file placed on a timeline */
+typedef struct WavClip {
+    const char* filename;   // Path of the wav file
+    uint64_t    inFrame;    // First frame of the file played by the clip
+    uint64_t    outFrame;   // Frame of the file where the clip stops (excluded)
+} WavClip;
+
+/* Virtual source reading its clips one after the other */
+typedef struct WavTimeline {
+    WavSource   source;
+    WavClip*    clips;      // Copy of the clips, with out points clamped
+    uint64_t*   starts;     // Timeline position of the first frame of each clip
+    size_t      nbClips;
+    size_t      current;    // Index of the clip opened by reader
+    WavReader*  reader;     // Only one file is open at a time
+} WavTimeline;
+
+
+/**
+ * @brief   Find the clip playing at a timeline position
+ *
+ * @param[in]   timeline  Pointer to the timeline
+ * @param[in]   frame     Position on the timeline (lower than nbFrames)
+ * @returns               Index of the clip
+ *
+ */
+size_t wav_timeline_find_clip (WavTimeline* timeline,
+                               uint64_t frame)
+{
+    size_t low = 0;
+    size_t high = timeline->nbClips - 1;
+
+    // Last clip starting at or before frame, skipping empty clips
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (timeline->starts[mid] <= frame)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+
+size_t wav_timeline_read_frames (WavSource* source,
+                                 int16_t* frames,
+                                 size_t nbFrames)
+{
+    WavTimeline* timeline = (WavTimeline*)source;
+    size_t nbRead = 0;
+
+    while (nbRead < nbFrames && source->position < source->nbFrames) {
+        size_t index = wav_timeline_find_clip(timeline, source->position);
+        WavClip* clip = &timeline->clips[index];
+        uint64_t clipFrame = clip->inFrame + source->position - timeline->starts[index];
+
+        if (!timeline->reader || timeline->current != index) {
+            if (timeline->reader)
+                wav_source_close(&timeline->reader->source);
+            timeline->reader = wav_reader_open(clip->filename);
+            timeline->current = index;
+        }
+
+        if (timeline->reader->source.position != clipFrame)
+            wav_source_seek(&timeline->reader->source, clipFrame);
+
+        uint64_t available = clip->outFrame - clipFrame;
+        size_t request = nbFrames - nbRead;
+        if (request > available)
+            request = available;
+
+        size_t count = wav_source_read(&timeline->reader->source,
+                                       frames + nbRead * source->header.NbChannels,
+                                       request);
+        if (count == 0) {
+            fprintf(stderr, "Unexpected end of file %s\n", clip->filename);
+            exit(1);
+        }
+
+        nbRead += count;
+        source->position += count;
+    }
+
+    return nbRead;
+}
+
+
+void wav_timeline_seek_frame (WavSource* source,
+                              uint64_t frame)
+{
+    // Files are only reopened and repositioned by the next read
+    source->position = frame;
+}
+
+
+void wav_timeline_close (WavSource* source)
+{
+    WavTimeline* timeline = (WavTimeline*)source;
+
+    if (timeline->reader)
+        wav_source_close(&timeline->reader->source);
+
+    for (size_t i = 0; i < timeline->nbClips; ++i)
+        free((char*)timeline->clips[i].filename);
+
+    free(timeline->clips);
+    free(timeline->starts);
+    free(timeline);
+}
+
+
+/**
+ * @brief   Create a timeline from an ordered list of clips
+ * @details Only the headers of the files are read at creation. Samples are
+ *          read on demand from the file of the clip under the read position,
+ *          so playback uses the same memory whatever the number of clips.
+ *          All files must share the channel count and the sample rate.
+ *
+ * @param[in]   clips     Array of clips, in playback order
+ * @param[in]   nbClips   Number of clips (at least one)
+ * @returns               Pointer to the timeline, to close with wav_source_close
+ *
+ */
+WavTimeline* wav_timeline_open (const WavClip* clips,
+                                size_t nbClips)
+{
+    if (nbClips == 0) {
+        fprintf(stderr, "Timeline needs at least one clip\n");
+        exit(1);
+    }
+
+    WavTimeline* timeline = (WavTimeline*)calloc(1, sizeof(WavTimeline));
+
+    if (timeline) {
+        timeline->clips = (WavClip*)malloc(nbClips * sizeof(WavClip));
+        timeline->starts = (uint64_t*)malloc(nbClips * sizeof(uint64_t));
+    }
+
+    if (!timeline || !timeline->clips || !timeline->starts) {
+        fprintf(stderr, "Cannot allocate memory for timeline\n");
+        exit(1);
+    }
+
+    timeline->nbClips = nbClips;
+    uint64_t length = 0;
+
+    for (size_t i = 0; i < nbClips; ++i) {
+        // Header-only probe of the clip file
+        WavReader* probe = wav_reader_open(clips[i].filename);
+        WavHeader* header = &probe->source.header;
+
+        if (i == 0) {
+            memcpy(&timeline->source.header, header, sizeof(WavHeader));
+        }
+        else if (header->NbChannels != timeline->source.header.NbChannels ||
+                 header->SampleRate != timeline->source.header.SampleRate)
+        {
+            fprintf(stderr, "Clip %s does not match the timeline format\n", clips[i].filename);
+            exit(1);
+        }
+
+        WavClip* clip = &timeline->clips[i];
+        clip->filename = strdup(clips[i].filename);
+        clip->outFrame = clips[i].outFrame < probe->source.nbFrames ?
+                         clips[i].outFrame : probe->source.nbFrames;
+        clip->inFrame = clips[i].inFrame < clip->outFrame ?
+                        clips[i].inFrame : clip->outFrame;
+
+        timeline->starts[i] = length;
+        length += clip->outFrame - clip->inFrame;
+
+        wav_source_close(&probe->source);
+    }
+
+    timeline->source.nbFrames = length;
+    timeline->source.header.DataSize = length * timeline->source.header.BytePerChunk;
+    timeline->source.header.FileSize = timeline->source.header.DataSize + sizeof(WavHeader) - 8;
+    timeline->source.read = wav_timeline_read_frames;
+    timeline->source.seek = wav_timeline_seek_frame;
+    timeline->source.close = wav_timeline_close;
+
+    return timeline;
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_TIMELINE_H__
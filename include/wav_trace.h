@@ -0,0 +1,184 @@
+/**
+ ******************************************************************************
+ * @file     wav_trace.h
+ * @brief    Provide begin/end trace events exported as Chrome trace JSON
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#ifndef __WAV_TRACE_H__
+#define __WAV_TRACE_H__
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Number of events kept per thread, older events are overwritten */
+#ifndef WAV_TRACE_RING_SIZE
+#define WAV_TRACE_RING_SIZE 65536
+#endif
+
+/* Event recorded by wav_trace_begin or wav_trace_end */
+typedef struct WavTraceEvent {
+    const char* name;       // Static string, not copied
+    uint64_t    timestamp;  // Monotonic time in nanoseconds
+    char        phase;      // 'B' for begin, 'E' for end
+} WavTraceEvent;
+
+/**
+ * @details Each thread writes its events in its own ring, so recording
+ *          an event takes no lock and no atomic read-modify-write on a
+ *          shared variable. Rings are registered once in a global list
+ *          with a compare-and-swap, and are never freed so that they can
+ *          be exported after their thread exited.
+ *
+ */
+typedef struct WavTraceRing {
+    struct WavTraceRing*    next;
+    uint32_t                threadId;
+    uint64_t                nbEvents;   // Total number of events written
+    WavTraceEvent           events[WAV_TRACE_RING_SIZE];
+} WavTraceRing;
+
+WavTraceRing* wav_trace_rings;
+uint32_t wav_trace_next_thread;
+__thread WavTraceRing* wav_trace_ring;
+
+
+WavTraceRing* wav_trace_thread_ring (void)
+{
+    if (wav_trace_ring)
+        return wav_trace_ring;
+
+    WavTraceRing* ring = (WavTraceRing*)calloc(1, sizeof(WavTraceRing));
+
+    if (!ring) {
+        fprintf(stderr, "Cannot allocate memory for trace ring\n");
+        exit(1);
+    }
+
+    ring->threadId = __atomic_add_fetch(&wav_trace_next_thread, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&wav_trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&wav_trace_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    wav_trace_ring = ring;
+    return ring;
+}
+
+
+void wav_trace_event (const char* name,
+                      char phase)
+{
+    WavTraceRing* ring = wav_trace_thread_ring();
+    WavTraceEvent* event = &ring->events[ring->nbEvents % WAV_TRACE_RING_SIZE];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event->name = name;
+    event->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->phase = phase;
+
+    // Publish the event to wav_trace_export
+    __atomic_store_n(&ring->nbEvents, ring->nbEvents + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief   Record the beginning of a span on the calling thread
+ *
+ * @param[in]  name      Static string naming the span
+ * @returns              None
+ *
+ */
+void wav_trace_begin (const char* name)
+{
+    wav_trace_event(name, 'B');
+}
+
+
+/**
+ * @brief   Record the end of the span opened last on the calling thread
+ *
+ * @param[in]  name      Static string naming the span
+ * @returns              None
+ *
+ */
+void wav_trace_end (const char* name)
+{
+    wav_trace_event(name, 'E');
+}
+
+#define WAV_TRACE_BEGIN(name) wav_trace_begin(name)
+#define WAV_TRACE_END(name) wav_trace_end(name)
+
+
+/**
+ * @brief   Write the recorded events as Chrome trace JSON
+ * @details The file can be opened with chrome://tracing or Perfetto.
+ *          Call it once the traced threads are idle: events recorded
+ *          during the export may be missing or torn.
+ *
+ * @param[in]  filename  String of the JSON filename to write
+ * @returns              None
+ *
+ */
+void wav_trace_export (const char* filename)
+{
+    FILE* stream = fopen(filename, "w");
+    int first = 1;
+
+    if (stream == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        exit(1);
+    }
+
+    fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (WavTraceRing* ring = __atomic_load_n(&wav_trace_rings, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next)
+    {
+        uint64_t nbEvents = __atomic_load_n(&ring->nbEvents, __ATOMIC_ACQUIRE);
+        uint64_t i = nbEvents > WAV_TRACE_RING_SIZE ? nbEvents - WAV_TRACE_RING_SIZE : 0;
+
+        for (; i < nbEvents; ++i) {
+            const WavTraceEvent* event = &ring->events[i % WAV_TRACE_RING_SIZE];
+
+            fprintf(stream, "%s\n{\"name\":\"", first ? "" : ",");
+            for (const char* c = event->name; *c; ++c) {
+                if (*c == '"' || *c == '\\')
+                    fputc('\\', stream);
+                fputc(*c, stream);
+            }
+            fprintf(stream, "\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+                    event->phase, event->timestamp / 1000.0, ring->threadId);
+            first = 0;
+        }
+    }
+
+    fprintf(stream, "\n]}\n");
+
+    if (fclose(stream) == EOF) {
+        fprintf(stderr, "Cannot close file\n");
+        exit(1);
+    }
+}
+
+
+#ifdef __cplusplus
+    }  /* extern "C" */
+#endif
+
+#endif  // __WAV_TRACE_H__
@@ -0,0 +1,502 @@
+/**
+ ******************************************************************************
+ * @file     wavfile.c
+ * @brief    Python bindings exposing mapped wav samples through the buffer protocol
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "wav_buffer.h"
+
+/**
+ * @details A WavFile shares the storage of a WavBuffer: the samples stay
+ *          mapped as long as the object or any view of it (memoryview,
+ *          numpy array) is alive. Decoded files own a float32 copy instead.
+ *          Both are exposed as 2D arrays of [frames, channels].
+ *
+ */
+typedef struct WavFileObject {
+    PyObject_HEAD
+    WavBuffer   buffer;
+    float*      decoded;        // float32 samples of decoded files, NULL otherwise
+    Py_ssize_t  shape[2];
+    Py_ssize_t  strides[2];
+} WavFileObject;
+
+static PyTypeObject WavFileType;
+
+
+static WavFileObject* wavfile_new(const WavBuffer* buffer)
+{
+    WavFileObject* self = PyObject_New(WavFileObject, &WavFileType);
+    if (self == NULL)
+        return NULL;
+
+    memcpy(&self->buffer, buffer, sizeof(WavBuffer));
+    self->decoded = NULL;
+    self->shape[0] = buffer->nbFrames;
+    self->shape[1] = buffer->header.NbChannels;
+    self->strides[0] = buffer->header.BytePerChunk;
+    self->strides[1] = sizeof(int16_t);
+    return self;
+}
+
+
+/* Decode in place of the samples; called without the GIL */
+static int wavfile_decode(WavFileObject* self)
+{
+    size_t count = (size_t)self->shape[0] * self->shape[1];
+    float* decoded = (float*)malloc(count * sizeof(float) + 1);
+
+    if (decoded == NULL)
+        return ENOMEM;
+
+    wav_convert_s16_to_f32(decoded, self->buffer.data, count);
+    self->decoded = decoded;
+    self->strides[0] = self->shape[1] * sizeof(float);
+    self->strides[1] = sizeof(float);
+    return 0;
+}
+
+
+static void wavfile_dealloc(WavFileObject* self)
+{
+    free(self->decoded);
+    wav_buffer_release(&self->buffer);
+    PyObject_Free(self);
+}
+
+
+static int wavfile_getbuffer(WavFileObject* self, Py_buffer* view, int flags)
+{
+    if ((flags & PyBUF_WRITABLE) && !self->decoded) {
+        PyErr_SetString(PyExc_BufferError, "mapped samples are read-only, use decode() or copy them");
+        view->obj = NULL;
+        return -1;
+    }
+
+    // Frames are interleaved: only single-channel or single-frame files are
+    // also Fortran-contiguous
+    if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS && self->shape[0] > 1 && self->shape[1] > 1) {
+        PyErr_SetString(PyExc_BufferError, "samples are interleaved, not Fortran-contiguous");
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->buf = self->decoded ? (void*)self->decoded : (void*)self->buffer.data;
+    view->itemsize = self->strides[1];
+    view->len = self->shape[0] * self->strides[0];
+    view->readonly = self->decoded == NULL;
+    view->format = (flags & PyBUF_FORMAT) ? (self->decoded ? "f" : "h") : NULL;
+
+    // Frames are contiguous: consumers not asking for a shape see flat bytes
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    if (view->shape == NULL)
+        view->ndim = 1;
+    return 0;
+}
+
+
+static PyObject* wavfile_get_header(WavFileObject* self, void* closure)
+{
+    const WavHeader* header = &self->buffer.header;
+    (void)closure;
+
+    return Py_BuildValue("{s:H,s:H,s:I,s:I,s:H,s:H,s:I}",
+                         "audio_format", header->AudioFormat,
+                         "channels", header->NbChannels,
+                         "sample_rate", header->SampleRate,
+                         "byte_rate", header->BytePerSec,
+                         "block_align", header->BytePerChunk,
+                         "bits_per_sample", header->BitsPerSample,
+                         "data_size", header->DataSize);
+}
+
+
+static PyObject* wavfile_get_channels(WavFileObject* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromLong(self->buffer.header.NbChannels);
+}
+
+
+static PyObject* wavfile_get_sample_rate(WavFileObject* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLong(self->buffer.header.SampleRate);
+}
+
+
+static PyObject* wavfile_get_frames(WavFileObject* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLongLong(self->buffer.nbFrames);
+}
+
+
+static PyObject* wavfile_get_duration(WavFileObject* self, void* closure)
+{
+    (void)closure;
+    return PyFloat_FromDouble((double)self->buffer.nbFrames / self->buffer.header.SampleRate);
+}
+
+
+static PyObject* wavfile_get_mapped(WavFileObject* self, void* closure)
+{
+    (void)closure;
+    return PyBool_FromLong(self->buffer.storage->mapped && !self->decoded);
+}
+
+
+static Py_ssize_t wavfile_length(WavFileObject* self)
+{
+    return self->shape[0];
+}
+
+
+static PyObject* wavfile_slice(WavFileObject* self, PyObject* args)
+{
+    unsigned long long start;
+    unsigned long long nbFrames = UINT64_MAX;
+    WavBuffer slice;
+
+    if (!PyArg_ParseTuple(args, "K|K:slice", &start, &nbFrames))
+        return NULL;
+
+    if (self->decoded) {
+        PyErr_SetString(PyExc_ValueError, "cannot slice a decoded file, slice before decode()");
+        return NULL;
+    }
+
+    wav_buffer_slice(&slice, &self->buffer, start, nbFrames);
+    WavFileObject* result = wavfile_new(&slice);
+    if (result == NULL)
+        wav_buffer_release(&slice);
+    return (PyObject*)result;
+}
+
+
+static PyObject* wavfile_decode_method(WavFileObject* self, PyObject* unused)
+{
+    WavBuffer buffer;
+    (void)unused;
+
+    if (self->decoded) {
+        Py_INCREF(self);
+        return (PyObject*)self;
+    }
+
+    wav_buffer_retain(&buffer, &self->buffer);
+    WavFileObject* result = wavfile_new(&buffer);
+    if (result == NULL) {
+        wav_buffer_release(&buffer);
+        return NULL;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = wavfile_decode(result);
+    Py_END_ALLOW_THREADS
+
+    if (status) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    return (PyObject*)result;
+}
+
+
+static PyObject* wavfile_repr(WavFileObject* self)
+{
+    return PyUnicode_FromFormat("<WavFile %llu frames, %u channels, %u Hz%s>",
+                                (unsigned long long)self->buffer.nbFrames,
+                                (unsigned)self->buffer.header.NbChannels,
+                                (unsigned)self->buffer.header.SampleRate,
+                                self->decoded ? ", float32" : "");
+}
+
+
+static PyGetSetDef wavfile_getset[] = {
+    { "header", (getter)wavfile_get_header, NULL, "Format fields of the header", NULL },
+    { "channels", (getter)wavfile_get_channels, NULL, "Number of channels", NULL },
+    { "sample_rate", (getter)wavfile_get_sample_rate, NULL, "Sample rate in Hz", NULL },
+    { "frames", (getter)wavfile_get_frames, NULL, "Number of frames", NULL },
+    { "duration", (getter)wavfile_get_duration, NULL, "Duration in seconds", NULL },
+    { "mapped", (getter)wavfile_get_mapped, NULL, "True if the samples are mapped from the file", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyMethodDef wavfile_methods[] = {
+    { "slice", (PyCFunction)wavfile_slice, METH_VARARGS,
+      "slice(start, frames=all) -> WavFile sharing the samples of this one" },
+    { "decode", (PyCFunction)wavfile_decode_method, METH_NOARGS,
+      "decode() -> WavFile of writable float32 samples in [-1, 1)" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods wavfile_sequence = {
+    .sq_length = (lenfunc)wavfile_length,
+};
+
+static PyBufferProcs wavfile_buffer = {
+    .bf_getbuffer = (getbufferproc)wavfile_getbuffer,
+};
+
+static PyTypeObject WavFileType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "wavfile.WavFile",
+    .tp_doc = "Samples of a wav file, viewable as a [frames, channels] array without copy\n"
+              "(numpy.asarray(f) or memoryview(f)).",
+    .tp_basicsize = sizeof(WavFileObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)wavfile_dealloc,
+    .tp_repr = (reprfunc)wavfile_repr,
+    .tp_as_sequence = &wavfile_sequence,
+    .tp_as_buffer = &wavfile_buffer,
+    .tp_methods = wavfile_methods,
+    .tp_getset = wavfile_getset,
+};
+
+
+static PyObject* raise_error(int status, PyObject* path)
+{
+    if (status == EINVAL)
+        PyErr_Format(PyExc_ValueError, "%s is not a 16-bit PCM wav file", PyBytes_AS_STRING(path));
+    else {
+        errno = status;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path));
+    }
+    return NULL;
+}
+
+
+static PyObject* module_open(PyObject* module, PyObject* args)
+{
+    PyObject* path;
+    WavBuffer buffer;
+    int status;
+    (void)module;
+
+    if (!PyArg_ParseTuple(args, "O&:open", PyUnicode_FSConverter, &path))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = wav_buffer_open_checked(&buffer, PyBytes_AS_STRING(path));
+    Py_END_ALLOW_THREADS
+
+    if (status) {
+        errno = status;
+        raise_error(status, path);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    Py_DECREF(path);
+    WavFileObject* result = wavfile_new(&buffer);
+    if (result == NULL)
+        wav_buffer_release(&buffer);
+    return (PyObject*)result;
+}
+
+
+/* Files of load_many, taken in turn by the loader threads */
+typedef struct WavLoad {
+    const char**    paths;
+    WavFileObject** files;
+    int*            status;
+    size_t          nbFiles;
+    size_t          next;
+    int             decode;
+} WavLoad;
+
+
+static void* load_worker(void* arg)
+{
+    WavLoad* load = (WavLoad*)arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED)) < load->nbFiles) {
+        WavFileObject* file = load->files[i];
+
+        load->status[i] = wav_buffer_open_checked(&file->buffer, load->paths[i]);
+        if (load->status[i])
+            continue;
+
+        file->shape[0] = file->buffer.nbFrames;
+        file->shape[1] = file->buffer.header.NbChannels;
+        file->strides[0] = file->buffer.header.BytePerChunk;
+        file->strides[1] = sizeof(int16_t);
+
+        // Fault the pages in from this thread rather than on first use
+        if (load->decode) {
+            load->status[i] = wavfile_decode(file);
+        }
+        else if (file->buffer.storage->mapped) {
+            WavStorage* storage = file->buffer.storage;
+            madvise(storage->base, storage->size, MADV_WILLNEED);
+        }
+    }
+    return NULL;
+}
+
+
+static PyObject* module_load_many(PyObject* module, PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = { "paths", "threads", "decode", NULL };
+    PyObject* sequence;
+    unsigned threads = 0;
+    int decode = 0;
+    (void)module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Ip:load_many", keywords,
+                                     &sequence, &threads, &decode))
+        return NULL;
+
+    PyObject* items = PySequence_Fast(sequence, "paths must be a sequence");
+    if (items == NULL)
+        return NULL;
+
+    size_t nbFiles = PySequence_Fast_GET_SIZE(items);
+    PyObject* list = PyList_New(nbFiles);
+    PyObject** encoded = (PyObject**)calloc(nbFiles + 1, sizeof(PyObject*));
+    WavLoad load = { NULL, NULL, NULL, nbFiles, 0, decode };
+
+    load.paths = (const char**)calloc(nbFiles + 1, sizeof(const char*));
+    load.files = (WavFileObject**)calloc(nbFiles + 1, sizeof(WavFileObject*));
+    load.status = (int*)calloc(nbFiles + 1, sizeof(int));
+
+    if (!list || !encoded || !load.paths || !load.files || !load.status) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    // Objects are created with the GIL, filled by the threads
+    for (size_t i = 0; i < nbFiles; ++i) {
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(items, i), &encoded[i]))
+            goto cleanup;
+        load.paths[i] = PyBytes_AS_STRING(encoded[i]);
+
+        load.files[i] = PyObject_New(WavFileObject, &WavFileType);
+        if (load.files[i] == NULL)
+            goto cleanup;
+        memset(&load.files[i]->buffer, 0, sizeof(WavBuffer));
+        load.files[i]->decoded = NULL;
+        PyList_SET_ITEM(list, i, (PyObject*)load.files[i]);
+    }
+
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < nbFiles ? threads : nbFiles;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_t* workers = (pthread_t*)calloc(threads + 1, sizeof(pthread_t));
+    unsigned nbStarted = 0;
+
+    while (workers && nbStarted < threads &&
+           pthread_create(&workers[nbStarted], NULL, load_worker, &load) == 0)
+        ++nbStarted;
+
+    // The caller helps, and loads alone if no thread could start
+    load_worker(&load);
+    for (unsigned t = 0; t < nbStarted; ++t)
+        pthread_join(workers[t], NULL);
+    free(workers);
+    Py_END_ALLOW_THREADS
+
+    for (size_t i = 0; i < nbFiles; ++i) {
+        if (load.status[i]) {
+            errno = load.status[i];
+            if (load.status[i] == ENOMEM)
+                PyErr_NoMemory();
+            else
+                raise_error(load.status[i], encoded[i]);
+            goto cleanup;
+        }
+    }
+
+    Py_DECREF(items);
+    for (size_t i = 0; i < nbFiles; ++i)
+        Py_DECREF(encoded[i]);
+    free(encoded);
+    free(load.paths);
+    free(load.files);
+    free(load.status);
+    return list;
+
+cleanup:
+    // Releasing the list releases the buffers loaded so far
+    Py_DECREF(items);
+    Py_XDECREF(list);
+    if (encoded) {
+        for (size_t i = 0; i < nbFiles; ++i)
+            Py_XDECREF(encoded[i]);
+    }
+    free(encoded);
+    free(load.paths);
+    free(load.files);
+    free(load.status);
+    return NULL;
+}
+
+
+static PyObject* module_purge(PyObject* module, PyObject* unused)
+{
+    (void)module;
+    (void)unused;
+    return PyLong_FromSize_t(wav_buffer_cache_purge());
+}
+
+
+static PyMethodDef module_methods[] = {
+    { "open", (PyCFunction)module_open, METH_VARARGS,
+      "open(path) -> WavFile mapping the samples of a 16-bit PCM wav file" },
+    { "load_many", (PyCFunction)(void (*)(void))module_load_many, METH_VARARGS | METH_KEYWORDS,
+      "load_many(paths, threads=0, decode=False) -> list of WavFile\n\n"
+      "Open the files in parallel threads (0: one per CPU) without the GIL,\n"
+      "prefetching the mapped pages or decoding them to float32." },
+    { "purge", (PyCFunction)module_purge, METH_NOARGS,
+      "purge() -> number of files no longer used removed from the shared mapping cache" },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef wavfile_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "wavfile",
+    .m_doc = "Zero-copy access to wav files mapped by the C library",
+    .m_size = -1,
+    .m_methods = module_methods,
+};
+
+
+PyMODINIT_FUNC PyInit_wavfile(void)
+{
+    if (PyType_Ready(&WavFileType) < 0)
+        return NULL;
+
+    PyObject* module = PyModule_Create(&wavfile_module);
+    if (module == NULL)
+        return NULL;
+
+    Py_INCREF(&WavFileType);
+    if (PyModule_AddObject(module, "WavFile", (PyObject*)&WavFileType) < 0) {
+        Py_DECREF(&WavFileType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
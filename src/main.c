@@ -1,25 +1,756 @@
-#include "wav.h"
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
 
-int main()
+#include "wav_timeline.h"
+#include "wav_analysis.h"
+#include "wav_split.h"
+#include "wav_align.h"
+#include "wav_compare.h"
+#include "wav_pitch.h"
+#include "wav_rhythm.h"
+#include "wav_stretch.h"
+
+/* Number of frames processed at once by the commands */
+#define BLOCK_FRAMES 16384
+
+typedef struct Options {
+    const char* command;
+    const char* output;     // Output directory (output file for concat)
+    unsigned    channel;    // Channel of extract
+    const char* format;     // Sample format of convert (s16, u8, f32)
+    double      start;      // Trim start in seconds
+    double      end;        // Trim end in seconds (negative: end of file)
+    unsigned    nbJobs;     // Number of files processed concurrently
+    const char* reference;  // Reference recording of align and compare
+    double      maxLag;     // Largest lag searched by align in seconds (0: any)
+    int         stopAtFirst;    // compare stops at the first difference
+    int         pitchMethod;    // Estimator of pitch (WAV_PITCH_YIN or WAV_PITCH_MPM)
+    double      hop;        // Time between pitch estimates in ms
+    double      speed;      // Playback speed of stretch
+    double      semitones;  // Pitch shift of stretch
+    double      onsetThreshold; // Onset threshold of rhythm (negative: default)
+} Options;
+
+/* Files shared by the worker threads */
+typedef struct Jobs {
+    const Options*  options;
+    char**          files;
+    size_t          nbFiles;
+    size_t          next;       // Index of the next file to process
+    char**          reports;    // Text printed by each file, shown in order
+    size_t*         reportSizes;
+    char*           done;       // 1 once the report of a file is complete
+    pthread_mutex_t lock;
+} Jobs;
+
+/* Batch whose reports are not printed yet */
+static Jobs* pendingJobs = NULL;
+
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: main <command> [options] <file.wav>...\n"
+        "\n"
+        "Commands:\n"
+        "  info                 Print the format of the files\n"
+        "  extract -c <ch>      Write one channel of each file to <name>_c<ch>.wav\n"
+        "  split                Write each channel of each file to <name>_c<i>.wav\n"
+        "  convert -t <fmt>     Write each file as s16, u8 or f32 to <name>_<fmt>.wav\n"
+        "  stats                Print per-channel statistics\n"
+        "  concat -o <out.wav>  Write the files one after the other to <out.wav>\n"
+        "  trim -s <s> -e <s>   Write the part between two times to <name>_trim.wav\n"
+        "  hash                 Print the hash of the samples of the files\n"
+        "  align -r <ref.wav>   Print where each file starts in the reference recording\n"
+        "  compare -r <ref.wav> Compare the samples of each file to the reference\n"
+        "  pitch                Print the pitch track of the files\n"
+        "  rhythm               Print the tempo, beat grid and onsets of the files\n"
+        "  stretch -v <x>       Write each file at x times the speed to <name>_stretch.wav\n"
+        "\n"
+        "Options:\n"
+        "  -j <n>               Process n files concurrently (default 1)\n"
+        "  -o <dir>             Output directory (default: next to each input),\n"
+        "                       - for stdout when a single file is written\n"
+        "  -m <s>               Largest offset searched by align (default: any)\n"
+        "  -x                   Stop compare at the first difference\n"
+        "  -a <yin|mpm>         Pitch estimator (default yin)\n"
+        "  -h <ms>              Time between pitch estimates (default 10)\n"
+        "  -p <n>               Shift the pitch of stretch by n semitones (default 0)\n"
+        "  -d <x>               Onset threshold of rhythm, times the average novelty (default 1)\n"
+        "\n"
+        "The file - is read from stdin.\n");
+    exit(1);
+}
+
+
+/* Build <dir>/<name without .wav><suffix>.wav, to free after usage.
+   "-o -" writes to stdout, for commands writing a single file. */
+static char* output_path(const Options* options, const char* input, const char* suffix)
+{
+    if (options->output && !strcmp(options->output, "-"))
+        return strdup("-");
+
+    char* inputCopy = strdup(input);
+    char* dirCopy = strdup(input);
+    const char* dir = options->output ? options->output : dirname(dirCopy);
+    char* name = basename(inputCopy);
+    size_t length = strlen(name);
+
+    if (length > 4 && !strcasecmp(name + length - 4, ".wav"))
+        name[length - 4] = '\0';
+
+    length = strlen(dir) + strlen(name) + strlen(suffix) + 6;
+    char* path = (char*)malloc(length);
+    snprintf(path, length, "%s/%s%s.wav", dir, name, suffix);
+
+    free(inputCopy);
+    free(dirCopy);
+    return path;
+}
+
+
+static void command_info(const Options* options, const char* file, FILE* report)
+{
+    (void)options;
+    WavReader* reader = wav_reader_open(file);
+    WavHeader* header = &reader->source.header;
+
+    fprintf(report, "%s: %u Hz, %u channels, %u bits, ",
+            file, header->SampleRate, header->NbChannels, header->BitsPerSample);
+    if (reader->source.nbFrames == WAV_UNKNOWN_FRAMES)
+        fprintf(report, "unknown length\n");
+    else
+        fprintf(report, "%llu frames, %.3f s\n", (unsigned long long)reader->source.nbFrames,
+                (double)reader->source.nbFrames / header->SampleRate);
+    if (reader->channelMask)
+        fprintf(report, "  channel mask 0x%x\n", reader->channelMask);
+
+    wav_source_close(&reader->source);
+}
+
+
+static void command_extract(const Options* options, const char* file, FILE* report)
+{
+    (void)report;
+    WavReader* reader = wav_reader_open(file);
+    WavHeader* header = &reader->source.header;
+    unsigned nbChannels = header->NbChannels;
+    unsigned channel = options->channel;
+    char suffix[16];
+
+    if (channel >= nbChannels) {
+        fprintf(stderr, "%s has no channel %u\n", file, channel);
+        exit(1);
+    }
+
+    WavHeader format;
+    wav_header_init(&format, 1, header->SampleRate, 16, 0);
+    snprintf(suffix, sizeof(suffix), "_c%u", channel);
+    char* path = output_path(options, file, suffix);
+    WavWriter* writer = wav_writer_open(path, &format);
+
+    int16_t* block = (int16_t*)malloc(BLOCK_FRAMES * header->BytePerChunk);
+    int16_t* mono = (int16_t*)malloc(BLOCK_FRAMES * sizeof(int16_t));
+    size_t nbRead;
+
+    if (!block || !mono) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    while ((nbRead = wav_source_read(&reader->source, block, BLOCK_FRAMES))) {
+        WAV_INSTR_BEGIN(WAV_STAGE_EXTRACT);
+        for (size_t i = 0; i < nbRead; ++i)
+            mono[i] = block[i * nbChannels + channel];
+        WAV_INSTR_END(WAV_STAGE_EXTRACT);
+        wav_writer_write(writer, mono, nbRead);
+    }
+
+    wav_writer_close(writer);
+    wav_source_close(&reader->source);
+    free(mono);
+    free(block);
+    free(path);
+}
+
+
+static void command_split(const Options* options, const char* file, FILE* report)
+{
+    (void)report;
+    WavReader* reader = wav_reader_open(file);
+    unsigned nbChannels = reader->source.header.NbChannels;
+    char** outputs = (char**)malloc(nbChannels * sizeof(char*));
+    char suffix[16];
+
+    if (!outputs) {
+        fprintf(stderr, "Cannot allocate memory for output names\n");
+        exit(1);
+    }
+
+    if (nbChannels > 1 && options->output && !strcmp(options->output, "-")) {
+        fprintf(stderr, "Cannot split the %u channels of %s to stdout\n", nbChannels, file);
+        exit(1);
+    }
+
+    for (unsigned c = 0; c < nbChannels; ++c) {
+        snprintf(suffix, sizeof(suffix), "_c%u", c);
+        outputs[c] = output_path(options, file, suffix);
+    }
+
+    wav_split_source(&reader->source, (const char* const*)outputs, 0);
+
+    for (unsigned c = 0; c < nbChannels; ++c)
+        free(outputs[c]);
+    free(outputs);
+    wav_source_close(&reader->source);
+}
+
+
+static void command_convert(const Options* options, const char* file, FILE* report)
+{
+    (void)report;
+    WavReader* reader = wav_reader_open(file);
+    WavHeader* header = &reader->source.header;
+    size_t nbSamples = BLOCK_FRAMES * header->NbChannels;
+    WavHeader format;
+    char suffix[16];
+
+    if (!strcmp(options->format, "f32")) {
+        wav_header_init(&format, header->NbChannels, header->SampleRate, 32, 0);
+        format.AudioFormat = 3;
+    }
+    else if (!strcmp(options->format, "u8")) {
+        wav_header_init(&format, header->NbChannels, header->SampleRate, 8, 0);
+    }
+    else if (!strcmp(options->format, "s16")) {
+        wav_header_init(&format, header->NbChannels, header->SampleRate, 16, 0);
+    }
+    else {
+        fprintf(stderr, "Unknown sample format %s\n", options->format);
+        exit(1);
+    }
+
+    snprintf(suffix, sizeof(suffix), "_%s", options->format);
+    char* path = output_path(options, file, suffix);
+    WavWriter* writer = wav_writer_open(path, &format);
+
+    int16_t* block = (int16_t*)malloc(nbSamples * sizeof(int16_t));
+    void* converted = malloc(nbSamples * sizeof(float));
+    size_t nbRead;
+
+    if (!block || !converted) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    while ((nbRead = wav_source_read(&reader->source, block, BLOCK_FRAMES))) {
+        size_t count = nbRead * header->NbChannels;
+
+        if (format.BitsPerSample == 32) {
+            wav_convert_s16_to_f32((float*)converted, block, count);
+        }
+        else if (format.BitsPerSample == 8) {
+            uint8_t* dst = (uint8_t*)converted;
+            for (size_t i = 0; i < count; ++i)
+                dst[i] = (uint8_t)((block[i] >> 8) + 128);
+        }
+        else {
+            memcpy(converted, block, count * sizeof(int16_t));
+        }
+
+        wav_writer_write(writer, converted, nbRead);
+    }
+
+    wav_writer_close(writer);
+    wav_source_close(&reader->source);
+    free(converted);
+    free(block);
+    free(path);
+}
+
+
+static void command_stats(const Options* options, const char* file, FILE* report)
+{
+    (void)options;
+    WavReader* reader = wav_reader_open(file);
+    WavStats stats;
+
+    wav_stats_compute(&reader->source, &stats);
+    fprintf(report, "%s: %llu frames\n", file, (unsigned long long)stats.nbFrames);
+
+    for (unsigned c = 0; c < stats.nbChannels; ++c) {
+        WavChannelStats* channel = &stats.channels[c];
+        fprintf(report, "  channel %u: min %d, max %d, mean %.2f, rms %.2f, clipped %llu\n",
+                c, channel->min, channel->max, channel->mean, channel->rms,
+                (unsigned long long)channel->nbClipped);
+    }
+
+    wav_source_close(&reader->source);
+}
+
+
+static void command_trim(const Options* options, const char* file, FILE* report)
+{
+    (void)report;
+    WavReader* reader = wav_reader_open(file);
+    WavSource* source = &reader->source;
+    uint32_t sampleRate = source->header.SampleRate;
+    uint64_t end = options->end < 0 ? WAV_UNKNOWN_FRAMES : (uint64_t)(options->end * sampleRate);
+
+    // Seeking forward also works on pipes
+    wav_source_seek(source, (uint64_t)(options->start * sampleRate));
+
+    char* path = output_path(options, file, "_trim");
+    WavWriter* writer = wav_writer_open(path, &source->header);
+    int16_t* block = (int16_t*)malloc(BLOCK_FRAMES * source->header.BytePerChunk);
+    size_t nbRead;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    while (source->position < end) {
+        size_t length = end - source->position < BLOCK_FRAMES ? end - source->position : BLOCK_FRAMES;
+        if (!(nbRead = wav_source_read(source, block, length)))
+            break;
+        wav_writer_write(writer, block, nbRead);
+    }
+
+    wav_writer_close(writer);
+    wav_source_close(source);
+    free(block);
+    free(path);
+}
+
+
+static void command_stretch(const Options* options, const char* file, FILE* report)
+{
+    (void)report;
+    WavReader* reader = wav_reader_open(file);
+    WavSource* source = wav_stretch_source_open(&reader->source, options->speed,
+                                                pow(2.0, options->semitones / 12.0));
+
+    char* path = output_path(options, file, "_stretch");
+    WavWriter* writer = wav_writer_open(path, &source->header);
+    int16_t* block = (int16_t*)malloc(BLOCK_FRAMES * source->header.BytePerChunk);
+    size_t nbRead;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    while ((nbRead = wav_source_read(source, block, BLOCK_FRAMES)))
+        wav_writer_write(writer, block, nbRead);
+
+    wav_writer_close(writer);
+    wav_source_close(source);
+    free(block);
+    free(path);
+}
+
+
+static void command_hash(const Options* options, const char* file, FILE* report)
+{
+    (void)options;
+    WavReader* reader = wav_reader_open(file);
+
+    fprintf(report, "%016llx  %s\n", (unsigned long long)wav_hash_source(&reader->source), file);
+    wav_source_close(&reader->source);
+}
+
+
+static void command_align(const Options* options, const char* file, FILE* report)
+{
+    WavReader* reference = wav_reader_open(options->reference);
+    WavReader* reader = wav_reader_open(file);
+    uint32_t rate = reference->source.header.SampleRate;
+    WavAlignment alignment;
+
+    // Both recordings are read twice, which pipes cannot do
+    if (reference->dataOffset < 0 || reader->dataOffset < 0) {
+        fprintf(stderr, "align cannot read %s twice: save the pipe to a file first\n",
+                reference->dataOffset < 0 ? options->reference : file);
+        exit(1);
+    }
+
+    wav_align_sources(&reference->source, &reader->source,
+                      (uint64_t)(options->maxLag * rate), &alignment);
+    fprintf(report, "%s: lag %lld frames (%.6f s), confidence %.3f\n", file,
+            (long long)alignment.lag, (double)alignment.lag / rate, alignment.confidence);
+
+    wav_source_close(&reader->source);
+    wav_source_close(&reference->source);
+}
+
+
+/* Files found different by compare, for the exit status */
+static unsigned nbDifferent = 0;
+
+static void command_compare(const Options* options, const char* file, FILE* report)
+{
+    WavReader* reference = wav_reader_open(options->reference);
+    WavReader* reader = wav_reader_open(file);
+    WavDiff diff;
+
+    wav_diff_sources(&reference->source, &reader->source, options->stopAtFirst, &diff);
+
+    if (!wav_diff_differs(&diff)) {
+        fprintf(report, "%s: identical, %llu frames\n", file, (unsigned long long)diff.nbFrames);
+    }
+    else if (diff.formatMismatch) {
+        fprintf(report, "%s: format differs\n", file);
+    }
+    else {
+        fprintf(report, "%s: differs", file);
+        if (diff.lengthA != diff.lengthB)
+            fprintf(report, ", %llu frames instead of %llu", (unsigned long long)diff.lengthB,
+                    (unsigned long long)diff.lengthA);
+        if (diff.firstFrame != WAV_DIFF_NONE)
+            fprintf(report, ", first at frame %llu channel %u (%d instead of %d)",
+                    (unsigned long long)diff.firstFrame, diff.firstChannel, diff.firstB, diff.firstA);
+        fprintf(report, "\n");
+
+        for (unsigned c = 0; c < diff.nbChannels && diff.firstFrame != WAV_DIFF_NONE; ++c) {
+            const WavChannelDiff* channel = &diff.channels[c];
+            fprintf(report, "  channel %u: %llu samples differ, max error %u at frame %llu, "
+                    "rms error %.3f, snr %.2f dB\n", c, (unsigned long long)channel->nbDiffs,
+                    channel->maxError, (unsigned long long)channel->maxErrorFrame,
+                    channel->rmsError, channel->snr);
+        }
+        if (options->stopAtFirst && diff.firstFrame != WAV_DIFF_NONE)
+            fprintf(report, "  (errors of the first %llu frames)\n", (unsigned long long)diff.nbFrames);
+
+        __atomic_add_fetch(&nbDifferent, 1, __ATOMIC_RELAXED);
+    }
+
+    wav_source_close(&reader->source);
+    wav_source_close(&reference->source);
+}
+
+
+static void command_pitch(const Options* options, const char* file, FILE* report)
+{
+    WavReader* reader = wav_reader_open(file);
+    WavPitchConfig config;
+    WavPitchTrack track;
+    size_t nbVoiced = 0;
+
+    wav_pitch_config_default(&config);
+    config.method = options->pitchMethod;
+    config.hop = (uint32_t)(options->hop * reader->source.header.SampleRate / 1000.0);
+    config.hop = config.hop ? config.hop : 1;
+
+    wav_pitch_track(&reader->source, &config, &track);
+
+    for (size_t i = 0; i < track.nbEstimates; ++i)
+        nbVoiced += track.estimates[i].frequency > 0.0f;
+    fprintf(report, "%s: %zu estimates, %zu voiced\n", file, track.nbEstimates, nbVoiced);
+
+    for (size_t i = 0; i < track.nbEstimates; ++i) {
+        const WavPitchEstimate* estimate = &track.estimates[i];
+        fprintf(report, "  %.3f  %8.2f  %.3f\n", estimate->time, estimate->frequency, estimate->confidence);
+    }
+
+    wav_pitch_track_free(&track);
+    wav_source_close(&reader->source);
+}
+
+
+static void command_rhythm(const Options* options, const char* file, FILE* report)
+{
+    WavReader* reader = wav_reader_open(file);
+    WavRhythmConfig config;
+    WavRhythm rhythm;
+
+    wav_rhythm_config_default(&config);
+    if (options->onsetThreshold >= 0.0)
+        config.threshold = options->onsetThreshold;
+    wav_rhythm_source(&reader->source, &config, &rhythm);
+
+    fprintf(report, "%s: tempo %.2f bpm, first beat %.3f s, confidence %.3f, %zu onsets\n", file,
+            rhythm.tempo, rhythm.firstBeat, rhythm.confidence, rhythm.nbOnsets);
+    for (size_t i = 0; i < rhythm.nbOnsets; ++i)
+        fprintf(report, "  %.3f  %.3f\n", rhythm.onsets[i].time, rhythm.onsets[i].strength);
+
+    wav_rhythm_free(&rhythm);
+    wav_source_close(&reader->source);
+}
+
+
+/* Concatenation reads all the files in order, so it is a single job */
+static void command_concat(const Options* options, char** files, size_t nbFiles)
+{
+    WavClip* clips = (WavClip*)malloc(nbFiles * sizeof(WavClip));
+
+    if (!options->output) {
+        fprintf(stderr, "concat needs an output file (-o)\n");
+        exit(1);
+    }
+
+    if (!clips) {
+        fprintf(stderr, "Cannot allocate memory for clips\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < nbFiles; ++i) {
+        clips[i].filename = files[i];
+        clips[i].inFrame = 0;
+        clips[i].outFrame = WAV_CLIP_END;
+    }
+
+    WavTimeline* timeline = wav_timeline_open(clips, nbFiles);
+    WavWriter* writer = wav_writer_open(options->output, &timeline->source.header);
+    int16_t* block = (int16_t*)malloc(BLOCK_FRAMES * timeline->source.header.BytePerChunk);
+    size_t nbRead;
+
+    if (!block) {
+        fprintf(stderr, "Cannot allocate memory for data buffer\n");
+        exit(1);
+    }
+
+    while ((nbRead = wav_source_read(&timeline->source, block, BLOCK_FRAMES)))
+        wav_writer_write(writer, block, nbRead);
+
+    wav_writer_close(writer);
+    wav_source_close(&timeline->source);
+    free(block);
+    free(clips);
+}
+
+
+#ifdef WAV_INSTRUMENT
+static void dump_instrumentation()
 {
-    const char* filename = "./sound_files/mozart.wav";
-    int16_t* data = NULL;
-    WavHeader header;
+    wav_instr_dump(stderr);
+}
+#endif
+
+#ifdef WAV_TRACE
+static void export_trace()
+{
+    const char* filename = getenv("WAV_TRACE_FILE");
+    wav_trace_export(filename ? filename : "wav_trace.json");
+}
+#endif
+
+
+static void* worker(void* arg)
+{
+    Jobs* jobs = (Jobs*)arg;
+    const Options* options = jobs->options;
+
+    for (;;) {
+        pthread_mutex_lock(&jobs->lock);
+        size_t index = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+
+        if (index >= jobs->nbFiles)
+            break;
+
+        const char* file = jobs->files[index];
+        FILE* report = open_memstream(&jobs->reports[index], &jobs->reportSizes[index]);
+
+        if (report == NULL) {
+            fprintf(stderr, "Cannot allocate memory for report\n");
+            exit(1);
+        }
+
+        WAV_TRACE_BEGIN(file);
+
+        if (!strcmp(options->command, "info"))
+            command_info(options, file, report);
+        else if (!strcmp(options->command, "extract"))
+            command_extract(options, file, report);
+        else if (!strcmp(options->command, "split"))
+            command_split(options, file, report);
+        else if (!strcmp(options->command, "convert"))
+            command_convert(options, file, report);
+        else if (!strcmp(options->command, "stats"))
+            command_stats(options, file, report);
+        else if (!strcmp(options->command, "trim"))
+            command_trim(options, file, report);
+        else if (!strcmp(options->command, "hash"))
+            command_hash(options, file, report);
+        else if (!strcmp(options->command, "align"))
+            command_align(options, file, report);
+        else if (!strcmp(options->command, "compare"))
+            command_compare(options, file, report);
+        else if (!strcmp(options->command, "pitch"))
+            command_pitch(options, file, report);
+        else if (!strcmp(options->command, "rhythm"))
+            command_rhythm(options, file, report);
+        else if (!strcmp(options->command, "stretch"))
+            command_stretch(options, file, report);
+
+        WAV_TRACE_END(file);
+        fclose(report);
+
+        pthread_mutex_lock(&jobs->lock);
+        jobs->done[index] = 1;
+        pthread_mutex_unlock(&jobs->lock);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Print the reports of the completed files in order, at the end of the
+ * batch or at exit when a file fails, which keeps those of the other files.
+ */
+static void print_reports(void)
+{
+    Jobs* jobs = pendingJobs;
+
+    if (!jobs)
+        return;
+
+    pthread_mutex_lock(&jobs->lock);
+    pendingJobs = NULL;
+    for (size_t i = 0; i < jobs->nbFiles; ++i) {
+        if (jobs->done[i])
+            fwrite(jobs->reports[i], 1, jobs->reportSizes[i], stdout);
+    }
+    pthread_mutex_unlock(&jobs->lock);
+}
+
+
+int main(int argc, char** argv)
+{
+    static const char* commands[] = {
+        "info", "extract", "split", "convert", "stats", "concat", "trim", "hash", "align", "compare",
+        "pitch", "rhythm", "stretch"
+    };
+    Options options = { NULL, NULL, 0, "f32", 0.0, -1.0, 1, NULL, 0.0, 0, WAV_PITCH_YIN, 10.0, 1.0, 0.0, -1.0 };
+    int option;
+    int known = 0;
+
+    if (argc < 2)
+        usage();
+
+    options.command = argv[1];
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+        known |= !strcmp(options.command, commands[i]);
+
+    if (!known)
+        usage();
+
+    // Options are parsed after the command name
+    optind = 2;
+    while ((option = getopt(argc, argv, "j:o:c:t:s:e:r:m:xa:h:v:p:d:")) != -1) {
+        switch (option) {
+            case 'j': options.nbJobs = strtoul(optarg, NULL, 10); break;
+            case 'o': options.output = optarg; break;
+            case 'c': options.channel = strtoul(optarg, NULL, 10); break;
+            case 't': options.format = optarg; break;
+            case 's': options.start = strtod(optarg, NULL); break;
+            case 'e': options.end = strtod(optarg, NULL); break;
+            case 'r': options.reference = optarg; break;
+            case 'm': options.maxLag = strtod(optarg, NULL); break;
+            case 'x': options.stopAtFirst = 1; break;
+            case 'a':
+                if (!strcmp(optarg, "yin"))
+                    options.pitchMethod = WAV_PITCH_YIN;
+                else if (!strcmp(optarg, "mpm"))
+                    options.pitchMethod = WAV_PITCH_MPM;
+                else
+                    usage();
+                break;
+            case 'h': options.hop = strtod(optarg, NULL); break;
+            case 'v': options.speed = strtod(optarg, NULL); break;
+            case 'p': options.semitones = strtod(optarg, NULL); break;
+            case 'd': options.onsetThreshold = strtod(optarg, NULL); break;
+            default: usage();
+        }
+    }
+
+    if (optind >= argc)
+        usage();
+
+    if ((!strcmp(options.command, "align") || !strcmp(options.command, "compare")) &&
+        !options.reference)
+    {
+        fprintf(stderr, "%s needs a reference recording (-r)\n", options.command);
+        exit(1);
+    }
+
+#ifdef WAV_INSTRUMENT
+    atexit(dump_instrumentation);
+#endif
+#ifdef WAV_TRACE
+    atexit(export_trace);
+#endif
+
+    char** files = &argv[optind];
+    size_t nbFiles = argc - optind;
+
+    // Stdout holds a single wav file
+    if (options.output && !strcmp(options.output, "-") && nbFiles > 1 &&
+        (!strcmp(options.command, "extract") || !strcmp(options.command, "split") ||
+         !strcmp(options.command, "convert") || !strcmp(options.command, "trim") ||
+         !strcmp(options.command, "stretch")))
+    {
+        fprintf(stderr, "%s writes one file per input: -o - needs a single input\n", options.command);
+        exit(1);
+    }
+
+    if (!strcmp(options.command, "concat")) {
+        command_concat(&options, files, nbFiles);
+        return 0;
+    }
+
+    Jobs jobs;
+    jobs.options = &options;
+    jobs.files = files;
+    jobs.nbFiles = nbFiles;
+    jobs.next = 0;
+    jobs.reports = (char**)calloc(nbFiles, sizeof(char*));
+    jobs.reportSizes = (size_t*)calloc(nbFiles, sizeof(size_t));
+    jobs.done = (char*)calloc(nbFiles, sizeof(char));
+    pthread_mutex_init(&jobs.lock, NULL);
+
+    if (!jobs.reports || !jobs.reportSizes || !jobs.done) {
+        fprintf(stderr, "Cannot allocate memory for reports\n");
+        exit(1);
+    }
+
+    pendingJobs = &jobs;
+    atexit(print_reports);
+
+    unsigned nbThreads = options.nbJobs ? options.nbJobs : 1;
+    if (nbThreads > nbFiles)
+        nbThreads = nbFiles;
+
+    pthread_t* threads = (pthread_t*)malloc(nbThreads * sizeof(pthread_t));
+
+    if (!threads) {
+        fprintf(stderr, "Cannot allocate memory for threads\n");
+        exit(1);
+    }
 
-    // Read wav file and get wav information & data raw
-    wav_read(filename, &header, &data);
+    for (unsigned i = 0; i < nbThreads; ++i) {
+        if (pthread_create(&threads[i], NULL, worker, &jobs)) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            exit(1);
+        }
+    }
 
-    // Extract channel 0 information and data from original signal
-    int16_t* s0 = NULL;
-    WavHeader headerS0;
-    wav_extract_channel_data(&s0, &data, &headerS0, &header, 1, -1);
+    for (unsigned i = 0; i < nbThreads; ++i)
+        pthread_join(threads[i], NULL);
 
-    // Save channel signal to wav file
-    wav_write("./sound_files/mozart_s1.wav", &headerS0, &s0);
+    // Reports are printed in the order of the files
+    print_reports();
+    for (size_t i = 0; i < nbFiles; ++i)
+        free(jobs.reports[i]);
 
-    // Don't forget to delete data after usage
-    free(s0);
-    free(data);
+    pthread_mutex_destroy(&jobs.lock);
+    free(threads);
+    free(jobs.done);
+    free(jobs.reportSizes);
+    free(jobs.reports);
 
-    return 0;
+    return nbDifferent ? 1 : 0;
 }
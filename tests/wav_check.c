@@ -0,0 +1,398 @@
+/**
+ ******************************************************************************
+ * @file     wav_check.c
+ * @brief    Regression checks on malformed wav files
+ *
+ ******************************************************************************
+ * @attention
+ *
+ *  Licensed under the MIT License
+ *  Contributor(s): Vincent TEMPLIER
+ *
+ ******************************************************************************
+ */
+
+#include <stddef.h>
+
+#include "wav_server.h"
+#include "wav_pack.h"
+#include "wav_cache.h"
+#include "wav_graph.h"
+
+static unsigned nbFailures = 0;
+
+#define CHECK(condition, name) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAIL %s (%s:%d)\n", name, __FILE__, __LINE__); \
+            nbFailures++; \
+        } \
+    } while (0)
+
+
+static void put16(uint8_t* p, uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+
+static void put32(uint8_t* p, uint32_t value)
+{
+    put16(p, value & 0xffff);
+    put16(p + 2, value >> 16);
+}
+
+
+/*
+ * Write a stereo 16-bit file whose fmt chunk is fmtSize bytes long, with
+ * the given format tag and block align; 64 frames of silence follow.
+ */
+static void write_file(const char* path,
+                       uint16_t formatTag,
+                       uint32_t fmtSize,
+                       uint16_t blockAlign)
+{
+    uint8_t bytes[44 + 24 + 256] = { 0 };
+    uint32_t dataSize = 64 * 4;
+    uint8_t* p = bytes;
+
+    memcpy(p, "RIFF", 4);
+    put32(p + 4, 4 + 8 + fmtSize + 8 + dataSize);
+    memcpy(p + 8, "WAVE", 4);
+    memcpy(p + 12, "fmt ", 4);
+    put32(p + 16, fmtSize);
+    put16(p + 20, formatTag);
+    put16(p + 22, 2);
+    put32(p + 24, 44100);
+    put32(p + 28, 44100 * blockAlign);
+    put16(p + 32, blockAlign);
+    put16(p + 34, 16);
+    p += 20 + 16;
+
+    // Extension of WAVE_FORMAT_EXTENSIBLE, PCM subformat, cut to fmtSize
+    if (fmtSize > 16) {
+        uint8_t extension[24] = { 0 };
+        put16(extension, 22);
+        put16(extension + 2, 16);
+        put32(extension + 4, 0x3);
+        put16(extension + 8, 1);
+        memcpy(p, extension, fmtSize - 16);
+        p += fmtSize - 16;
+    }
+
+    memcpy(p, "data", 4);
+    put32(p + 4, dataSize);
+    p += 8 + dataSize;
+
+    FILE* stream = fopen(path, "wb");
+    if (!stream || fwrite(bytes, 1, p - bytes, stream) != (size_t)(p - bytes) || fclose(stream)) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        exit(1);
+    }
+}
+
+
+/* Fill every slot of the hash table of a pack with its first clip */
+static void fill_pack_table(const char* path)
+{
+    FILE* stream = fopen(path, "r+b");
+    WavPackHeader header;
+    WavPackEntry entry;
+
+    if (!stream || !fread(&header, sizeof(header), 1, stream)) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        exit(1);
+    }
+
+    fseeko(stream, header.IndexOffset, SEEK_SET);
+    do {
+        if (!fread(&entry, sizeof(entry), 1, stream)) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            exit(1);
+        }
+    } while (!entry.NameLength);
+
+    fseeko(stream, header.IndexOffset, SEEK_SET);
+    for (uint64_t i = 0; i < header.NbSlots; ++i)
+        fwrite(&entry, sizeof(entry), 1, stream);
+    fclose(stream);
+}
+
+
+/* Threads opening the same file at once */
+#define CHECK_THREADS 8
+
+typedef struct OpenJob {
+    pthread_barrier_t*  barrier;
+    const char*         path;
+    WavBuffer           buffer;
+    int                 status;
+} OpenJob;
+
+static void* open_file(void* arg)
+{
+    OpenJob* job = (OpenJob*)arg;
+
+    pthread_barrier_wait(job->barrier);
+    job->status = wav_buffer_open_checked(&job->buffer, job->path);
+    return NULL;
+}
+
+
+/* Stereo frames of the graph check, resampled from 44.1 to 32 kHz */
+#define GRAPH_FRAMES 1000
+#define GRAPH_OUTPUT ((GRAPH_FRAMES - 1) * 32000 / 44100 + 1)
+
+/*
+ * Run convert, gain, mix, clip and resample one stage at a time on the
+ * whole signal, and compare the frames of the fused graph with them.
+ */
+static int check_graph(void)
+{
+    static float reference[GRAPH_FRAMES * 2], output[GRAPH_OUTPUT * 2 + 2];
+    const float matrix[4] = { 0.5f, 0.5f, 1.0f, -1.0f };
+    WavBuffer buffer;
+    WavHeader format;
+
+    wav_header_init(&format, 2, 44100, 16, 0);
+    wav_buffer_alloc(&buffer, &format, GRAPH_FRAMES);
+    int16_t* samples = wav_buffer_mutable(&buffer);
+    for (int i = 0; i < GRAPH_FRAMES * 2; ++i)
+        samples[i] = (int16_t)((i * 7919) % 65536 - 32768);
+
+    for (int i = 0; i < GRAPH_FRAMES * 2; ++i)
+        reference[i] = samples[i] / 32768.0f * 1.5f;
+    for (int i = 0; i < GRAPH_FRAMES; ++i) {
+        float left = reference[2 * i], right = reference[2 * i + 1];
+        reference[2 * i] = matrix[0] * left + matrix[1] * right;
+        reference[2 * i + 1] = matrix[2] * left + matrix[3] * right;
+    }
+    for (int i = 0; i < GRAPH_FRAMES * 2; ++i) {
+        float sample = reference[i] < -1.0f ? -1.0f : reference[i];
+        reference[i] = sample > 32767.0f / 32768.0f ? 32767.0f / 32768.0f : sample;
+    }
+
+    WavGraph* graph = wav_graph_open(wav_buffer_source_open(&buffer));
+    wav_buffer_release(&buffer);
+    wav_graph_gain(graph, 1.5f);
+    wav_graph_mix(graph, 2, matrix);
+    wav_graph_clip(graph);
+    wav_graph_resample(graph, 32000);
+
+    size_t nbFrames = wav_graph_read_f32(graph, output, GRAPH_OUTPUT + 1);
+    int matches = nbFrames == GRAPH_OUTPUT && graph->source.nbFrames == GRAPH_OUTPUT;
+
+    for (size_t k = 0; matches && k < nbFrames; ++k) {
+        uint64_t position = k * 44100;
+        size_t i = position / 32000;
+        float weight = (float)(position % 32000) / 32000;
+
+        for (int c = 0; c < 2; ++c) {
+            float prev = reference[2 * i + c];
+            float expected = weight ? prev + weight * (reference[2 * (i + 1) + c] - prev) : prev;
+            if (fabsf(output[2 * k + c] - expected) >= 1e-6f)
+                matches = 0;
+        }
+    }
+
+    wav_source_close(&graph->source);
+    return matches;
+}
+
+
+static void* serve(void* server)
+{
+    wav_server_run((WavServer*)server);
+    return NULL;
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* dir = argc > 1 ? argv[1] : "build/check";
+    char good[WAV_SERVER_PATH_MAX], socketPath[WAV_SERVER_PATH_MAX];
+    char blockAlign[WAV_SERVER_PATH_MAX], shortExtensible[WAV_SERVER_PATH_MAX];
+    char truncated[WAV_SERVER_PATH_MAX], packPath[WAV_SERVER_PATH_MAX];
+    const char* bad[3] = { blockAlign, shortExtensible, truncated };
+
+    mkdir(dir, 0755);
+    snprintf(good, sizeof(good), "%s/good.wav", dir);
+    snprintf(blockAlign, sizeof(blockAlign), "%s/block_align.wav", dir);
+    snprintf(shortExtensible, sizeof(shortExtensible), "%s/short_extensible.wav", dir);
+    snprintf(truncated, sizeof(truncated), "%s/truncated_extension.wav", dir);
+    snprintf(socketPath, sizeof(socketPath), "%s/server.sock", dir);
+    snprintf(packPath, sizeof(packPath), "%s/full.pak", dir);
+
+    write_file(good, 1, 16, 4);
+    write_file(blockAlign, 1, 16, 3);
+    write_file(shortExtensible, 0xfffe, 18, 4);
+    write_file(truncated, 0xfffe, 30, 4);
+
+    // Readers and buffers report the malformed files instead of exiting
+    for (int i = 0; i < 3; ++i) {
+        WavReader* reader = NULL;
+        WavBuffer buffer;
+
+        CHECK(wav_reader_open_checked(bad[i], &reader) == EINVAL, bad[i]);
+        CHECK(wav_buffer_open_checked(&buffer, bad[i]) == EINVAL, bad[i]);
+    }
+
+    WavReader* reader = NULL;
+    WavBuffer buffer;
+
+    CHECK(wav_reader_open_checked(good, &reader) == 0 && reader->source.nbFrames == 64, good);
+    if (reader)
+        wav_source_close(&reader->source);
+    CHECK(wav_buffer_open_checked(&buffer, good) == 0 && buffer.nbFrames == 64, good);
+    wav_buffer_release(&buffer);
+
+    // Data announced past the end of the file is not allocated
+    char longData[WAV_SERVER_PATH_MAX];
+    uint8_t dataSize[4];
+    FILE* stream;
+
+    snprintf(longData, sizeof(longData), "%s/long_data.wav", dir);
+    write_file(longData, 1, 16, 4);
+    put32(dataSize, 0xfffffff0);
+    stream = fopen(longData, "r+b");
+    CHECK(stream && !fseeko(stream, 40, SEEK_SET) && fwrite(dataSize, 4, 1, stream), longData);
+    if (stream)
+        fclose(stream);
+    CHECK(wav_buffer_map_checked(&buffer, longData) == 0 && buffer.nbFrames == 64 &&
+          buffer.storage->size < sizeof(WavStorage) + 4096, longData);
+    wav_buffer_release(&buffer);
+
+    // Lookups in a pack whose table has no free slot end
+    const char* clips[1] = { good };
+    WavPack pack;
+    WavHeader header;
+
+    wav_pack_build(packPath, clips, NULL, 1);
+    fill_pack_table(packPath);
+    wav_pack_open(&pack, packPath);
+    CHECK(wav_pack_find(&pack, "missing", &header, NULL) == -1, packPath);
+    CHECK(wav_pack_find(&pack, good, &header, NULL) == 0, packPath);
+    wav_pack_close(&pack);
+
+    // The cache keeps a bounded number of files, and one mapping per file
+    char cached[3][WAV_SERVER_PATH_MAX];
+    WavBuffer buffers[3];
+
+    wav_buffer_cache_purge();
+    wav_buffer_cache_limit(2);
+    for (int i = 0; i < 3; ++i) {
+        snprintf(cached[i], sizeof(cached[i]), "%s/cached%d.wav", dir, i);
+        write_file(cached[i], 1, 16, 4);
+        CHECK(wav_buffer_open_checked(&buffers[i], cached[i]) == 0, cached[i]);
+    }
+    CHECK(wav_buffer_cache.nbFiles == 2, "cache limit");
+    CHECK(wav_buffer_open_checked(&buffer, cached[2]) == 0 && buffer.storage == buffers[2].storage,
+          "cache sharing");
+    wav_buffer_release(&buffer);
+    CHECK(buffers[0].data[0] == 0 && buffers[0].nbFrames == 64, "released file still used");
+    for (int i = 0; i < 3; ++i)
+        wav_buffer_release(&buffers[i]);
+    wav_buffer_cache_limit(WAV_BUFFER_CACHE_FILES);
+
+    pthread_barrier_t barrier;
+    pthread_t threads[CHECK_THREADS];
+    OpenJob jobs[CHECK_THREADS];
+
+    wav_buffer_cache_purge();
+    pthread_barrier_init(&barrier, NULL, CHECK_THREADS);
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        jobs[i].barrier = &barrier;
+        jobs[i].path = good;
+        pthread_create(&threads[i], NULL, open_file, &jobs[i]);
+    }
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        CHECK(jobs[i].status == 0 && jobs[i].buffer.storage == jobs[0].buffer.storage, "concurrent opens");
+    }
+    for (int i = 0; i < CHECK_THREADS; ++i)
+        wav_buffer_release(&jobs[i].buffer);
+    pthread_barrier_destroy(&barrier);
+
+    // Cache entries whose size does not match their file are misses
+    char cacheDir[WAV_SERVER_PATH_MAX], entryPath[WAV_SERVER_PATH_MAX];
+    uint64_t payload = 42, hugeSize = UINT64_MAX;
+    void* data = NULL;
+    size_t size;
+    WavCache cache;
+
+    snprintf(cacheDir, sizeof(cacheDir), "%s/cache", dir);
+    wav_cache_open(&cache, cacheDir, 1 << 20, 0);
+    wav_cache_put(&cache, 1, &payload, sizeof(payload));
+    CHECK(wav_cache_get(&cache, 1, &data, &size) == 0 && size == sizeof(payload), "cache entry");
+    free(data);
+
+    wav_cache_entry_path(&cache, 1, entryPath, sizeof(entryPath));
+    FILE* entry = fopen(entryPath, "r+b");
+    CHECK(entry && !fseeko(entry, offsetof(WavCacheEntryHeader, Size), SEEK_SET) &&
+          fwrite(&hugeSize, sizeof(hugeSize), 1, entry), entryPath);
+    if (entry)
+        fclose(entry);
+    CHECK(wav_cache_get(&cache, 1, &data, &size) == -1 && access(entryPath, F_OK), "corrupted cache entry");
+    wav_cache_close(&cache);
+
+    // Overviews of streamed files grow their bins up to the end of the pipe
+    uint8_t bytes[512];
+    const char* message;
+    WavPeaks pipePeaks;
+    int fds[2];
+
+    stream = fopen(good, "rb");
+    size_t nbBytes = stream ? fread(bytes, 1, sizeof(bytes), stream) : 0;
+    if (stream)
+        fclose(stream);
+    put32(bytes + 40, WAV_UNKNOWN_SIZE);
+    CHECK(!pipe(fds) && write(fds[1], bytes, nbBytes) == (ssize_t)nbBytes && !close(fds[1]), "pipe");
+
+    reader = NULL;
+    stream = fdopen(fds[0], "rb");
+    CHECK(stream && wav_reader_open_stream_checked(stream, &reader, &message) == 0 &&
+          reader->source.nbFrames == WAV_UNKNOWN_FRAMES, "piped file");
+    if (reader) {
+        CHECK(wav_peaks_compute_checked(&reader->source, 10, &pipePeaks) == 0 && pipePeaks.nbBins == 7,
+              "piped peaks");
+        wav_peaks_free(&pipePeaks);
+        wav_source_close(&reader->source);
+    }
+
+    // Fused graphs give the frames of their stages run one at a time
+    CHECK(check_graph(), "graph chain");
+
+    // A server answers the malformed files with an error and keeps serving
+    WavServer server;
+    WavServerReply reply;
+    pthread_t thread;
+
+    wav_server_open(&server, socketPath);
+    pthread_create(&thread, NULL, serve, &server);
+    pthread_detach(thread);
+
+    int fd = wav_client_connect(socketPath);
+    for (int i = 0; i < 3; ++i) {
+        const WavStats* stats = wav_client_stats(fd, bad[i], &reply);
+        CHECK(stats == NULL && reply.status == EINVAL, bad[i]);
+    }
+    const WavStats* stats = wav_client_stats(fd, good, &reply);
+    CHECK(stats != NULL && reply.status == 0 && reply.nbFrames == 64, good);
+    if (stats)
+        wav_client_unmap(stats, &reply);
+
+    // Bins longer than the file are clamped instead of allocated
+    const int16_t* peaks = wav_client_peaks(fd, good, UINT32_MAX, &reply);
+    CHECK(peaks != NULL && reply.status == 0 && reply.size == 2 * 2 * sizeof(int16_t), "huge peak bins");
+    if (peaks)
+        wav_client_unmap(peaks, &reply);
+    close(fd);
+
+    if (nbFailures) {
+        fprintf(stderr, "%u check(s) failed\n", nbFailures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "wav_index.h"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: wav_index update <index> [--hash] <dir>...\n"
+                    "       wav_index query <index> [--rate <Hz>] [--channels <n>]\n"
+                    "                               [--min <frames>] [--max <frames>]\n"
+                    "       wav_index find <index> <path>\n");
+    exit(1);
+}
+
+static void print_record(const WavIndex* index, const WavIndexRecord* record, void* user)
+{
+    (void)user;
+    printf("%.*s\t%u Hz\t%u ch\t%u bytes", (int)record->PathLength,
+           wav_index_path(index, record), record->SampleRate,
+           record->NbChannels, record->DataSize);
+    if (record->HasHash)
+        printf("\t%016llx", (unsigned long long)record->Hash);
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    WavIndex index;
+
+    if (argc < 3)
+        usage();
+
+    wav_index_load(&index, argv[2]);
+
+    if (!strcmp(argv[1], "update")) {
+        int withHash = argc > 3 && !strcmp(argv[3], "--hash");
+        int first = 3 + withHash;
+        size_t nbProbed = wav_index_refresh(&index, (const char* const*)&argv[first],
+                                            argc - first, withHash);
+        wav_index_save(&index, argv[2]);
+        fprintf(stderr, "%zu files indexed, %zu probed\n", index.nbRecords, nbProbed);
+    }
+    else if (!strcmp(argv[1], "query")) {
+        WavIndexQuery query;
+        memset(&query, 0, sizeof(WavIndexQuery));
+
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (!strcmp(argv[i], "--rate"))
+                query.sampleRate = strtoul(argv[i + 1], NULL, 10);
+            else if (!strcmp(argv[i], "--channels"))
+                query.nbChannels = strtoul(argv[i + 1], NULL, 10);
+            else if (!strcmp(argv[i], "--min"))
+                query.minFrames = strtoull(argv[i + 1], NULL, 10);
+            else if (!strcmp(argv[i], "--max"))
+                query.maxFrames = strtoull(argv[i + 1], NULL, 10);
+            else
+                usage();
+        }
+        wav_index_query(&index, &query, print_record, NULL);
+    }
+    else if (!strcmp(argv[1], "find") && argc == 4) {
+        const WavIndexRecord* record = wav_index_find(&index, argv[3]);
+        if (!record) {
+            fprintf(stderr, "%s is not indexed\n", argv[3]);
+            exit(1);
+        }
+        print_record(&index, record, NULL);
+    }
+    else {
+        usage();
+    }
+
+    wav_index_free(&index);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include "wav_pack.h"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: wav_pack build <pack> <file.wav>...\n"
+                    "       wav_pack list <pack>\n"
+                    "       wav_pack extract <pack> <name> <file.wav>\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+        usage();
+
+    if (!strcmp(argv[1], "build")) {
+        // Clips are looked up by the path given on the command line
+        wav_pack_build(argv[2], (const char* const*)&argv[3], NULL, argc - 3);
+    }
+    else if (!strcmp(argv[1], "list")) {
+        WavPack pack;
+        wav_pack_open(&pack, argv[2]);
+
+        for (uint64_t slot = 0; slot < pack.header->NbSlots; ++slot) {
+            const WavPackEntry* entry = &pack.entries[slot];
+            if (!entry->NameLength)
+                continue;
+            wav_pack_entry_check(&pack, entry);
+            printf("%.*s\t%u Hz\t%u ch\t%u bytes\n", (int)entry->NameLength,
+                   pack.names + entry->NameOffset, entry->SampleRate,
+                   entry->NbChannels, entry->DataSize);
+        }
+
+        wav_pack_close(&pack);
+    }
+    else if (!strcmp(argv[1], "extract") && argc == 5) {
+        WavPack pack;
+        WavHeader header;
+        const int16_t* data = NULL;
+        wav_pack_open(&pack, argv[2]);
+
+        if (wav_pack_find(&pack, argv[3], &header, &data)) {
+            fprintf(stderr, "Clip %s not found\n", argv[3]);
+            exit(1);
+        }
+
+        wav_write(argv[4], &header, (int16_t**)&data);
+        wav_pack_close(&pack);
+    }
+    else {
+        usage();
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "wav_server.h"
+
+#include <signal.h>
+
+static const char* socketPath = NULL;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: wav_server serve <socket>\n"
+                    "       wav_server range <socket> <file> <start> <frames> <output.wav>\n"
+                    "       wav_server stats <socket> <file>\n"
+                    "       wav_server peaks <socket> <file> <binFrames>\n");
+    exit(1);
+}
+
+static void stop(int signal)
+{
+    (void)signal;
+    unlink(socketPath);
+    _exit(0);
+}
+
+static void check_reply(const WavServerReply* reply, const char* path)
+{
+    if (reply->status) {
+        fprintf(stderr, "Server cannot read %s: %s\n", path, strerror(reply->status));
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+        usage();
+
+    if (!strcmp(argv[1], "serve") && argc == 3) {
+        WavServer server;
+
+        socketPath = argv[2];
+        signal(SIGINT, stop);
+        signal(SIGTERM, stop);
+
+        wav_server_open(&server, socketPath);
+        fprintf(stderr, "Serving on %s\n", socketPath);
+        wav_server_run(&server);
+        wav_server_close(&server);
+        unlink(socketPath);
+        return 0;
+    }
+
+    int fd = wav_client_connect(argv[2]);
+    WavServerReply reply;
+
+    if (!strcmp(argv[1], "range") && argc == 7) {
+        const int16_t* frames = wav_client_range(fd, argv[3], strtoull(argv[4], NULL, 10),
+                                                 strtoull(argv[5], NULL, 10), &reply);
+        check_reply(&reply, argv[3]);
+
+        WavWriter* writer = wav_writer_open(argv[6], &reply.header);
+        wav_writer_write(writer, frames, reply.size / reply.header.BytePerChunk);
+        wav_writer_close(writer);
+        wav_client_unmap(frames, &reply);
+    }
+    else if (!strcmp(argv[1], "stats") && argc == 4) {
+        const WavStats* stats = wav_client_stats(fd, argv[3], &reply);
+        check_reply(&reply, argv[3]);
+
+        for (unsigned c = 0; c < stats->nbChannels; ++c) {
+            const WavChannelStats* channel = &stats->channels[c];
+            printf("channel %u\tmin %d\tmax %d\tmean %.2f\trms %.2f\tclipped %llu\n", c,
+                   channel->min, channel->max, channel->mean, channel->rms,
+                   (unsigned long long)channel->nbClipped);
+        }
+        wav_client_unmap(stats, &reply);
+    }
+    else if (!strcmp(argv[1], "peaks") && argc == 5) {
+        const int16_t* peaks = wav_client_peaks(fd, argv[3], strtoul(argv[4], NULL, 10), &reply);
+        check_reply(&reply, argv[3]);
+
+        unsigned nbChannels = reply.header.NbChannels;
+        uint64_t nbBins = reply.size / (2 * sizeof(int16_t) * nbChannels);
+        for (uint64_t bin = 0; bin < nbBins; ++bin) {
+            for (unsigned c = 0; c < nbChannels; ++c) {
+                const int16_t* minmax = peaks + (bin * nbChannels + c) * 2;
+                printf("%s%d %d", c ? "\t" : "", minmax[0], minmax[1]);
+            }
+            printf("\n");
+        }
+        wav_client_unmap(peaks, &reply);
+    }
+    else {
+        usage();
+    }
+
+    close(fd);
+    return 0;
+}